@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 #pragma once
+#include <cassert>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "location.h"
@@ -30,17 +33,31 @@ enum class BinOp : unsigned char {
 };
 // clang-format on
 
+// clang-format off
+enum class NodeKind : unsigned char {
+  ASSIGN, SINGLE_MODULE_CALL, IF_MODULE, MODULE_MODIFIER, MODULE_DECL,
+  FUNCTION_DECL,
+
+  // expressions
+  NUMBER, BOOL, STRING, UNDEF, IDENT, UNARY_OP, BINARY_OP, CALL, IF_EXPR,
+  LIST_EXPR, RANGE, LIST_COMP, LIST_COMP_C, LIST_INDEX, LET, LAMBDA,
+};
+// clang-format on
+
+// Every concrete node type T has T::nodeKind, used by isa, cast and dynCast
+// below instead of RTTI.
 struct Node {
  public:
-  Node(Location loc) : loc(loc) {}
+  Node(NodeKind kind, Location loc) : kind(kind), loc(loc) {}
+  virtual ~Node() = default;
 
+  NodeKind kind;
   Location loc;
-  virtual void dummy() {} // for typeid
 };
 
 struct ExprNode : public Node {
  public:
-  ExprNode(Location loc) : Node(loc) {}
+  ExprNode(NodeKind kind, Location loc) : Node(kind, loc) {}
 
   virtual bool isConstValue() { return false; }
 };
@@ -49,9 +66,14 @@ using Expr = std::shared_ptr<ExprNode>;
 
 struct AssignNode final : public Node {
  public:
-  AssignNode() : ident(""), expr(nullptr), Node(Location{}) {}
-  AssignNode(const std::string ident, Expr expr, Location loc)
-      : ident(ident), expr(expr), Node(loc) {}
+  static constexpr NodeKind nodeKind = NodeKind::ASSIGN;
+
+  AssignNode()
+      : ident(""), expr(nullptr), Node(NodeKind::ASSIGN, Location{}) {}
+  AssignNode(std::string ident, Expr expr, Location loc)
+      : ident(std::move(ident)),
+        expr(std::move(expr)),
+        Node(NodeKind::ASSIGN, loc) {}
 
   std::string ident;
   Expr expr;
@@ -59,8 +81,9 @@ struct AssignNode final : public Node {
 
 struct ModuleCall : public Node {
  public:
-  ModuleCall(const std::string name, std::vector<AssignNode> args, Location loc)
-      : name(name), args(args), Node(loc) {}
+  ModuleCall(NodeKind kind, std::string name, std::vector<AssignNode> args,
+             Location loc)
+      : name(std::move(name)), args(std::move(args)), Node(kind, loc) {}
 
   std::string name;
   // positional arguments have empty names
@@ -72,7 +95,7 @@ struct ModuleBody {
   ModuleBody() = default;
   ModuleBody(std::vector<AssignNode> assignments,
              std::vector<std::shared_ptr<ModuleCall>> children)
-      : assignments(assignments), children(children) {}
+      : assignments(std::move(assignments)), children(std::move(children)) {}
 
   // list of assignment operations in the children
   std::vector<AssignNode> assignments;
@@ -83,9 +106,13 @@ struct ModuleBody {
 // for and intersection_for are represented as builtin SingleModuleCall
 struct SingleModuleCall : public ModuleCall {
  public:
-  SingleModuleCall(const std::string name, std::vector<AssignNode> args,
+  static constexpr NodeKind nodeKind = NodeKind::SINGLE_MODULE_CALL;
+
+  SingleModuleCall(std::string name, std::vector<AssignNode> args,
                    ModuleBody body, Location loc)
-      : body(body), ModuleCall(name, args, loc) {}
+      : body(std::move(body)),
+        ModuleCall(NodeKind::SINGLE_MODULE_CALL, std::move(name),
+                   std::move(args), loc) {}
 
   ModuleBody body;
 };
@@ -93,10 +120,13 @@ struct SingleModuleCall : public ModuleCall {
 // if else module, then part is stored in ModuleCall::children
 struct IfModule : public ModuleCall {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::IF_MODULE;
+
   IfModule(Expr args, ModuleBody ifthen, ModuleBody ifelse, Location loc)
-      : ifthen(ifthen),
-        ifelse(ifelse),
-        ModuleCall("if", {AssignNode("", args, loc)}, loc){};
+      : ifthen(std::move(ifthen)),
+        ifelse(std::move(ifelse)),
+        ModuleCall(NodeKind::IF_MODULE, "if",
+                   {AssignNode("", std::move(args), loc)}, loc){};
 
   ModuleBody ifthen;
   ModuleBody ifelse;
@@ -104,52 +134,96 @@ struct IfModule : public ModuleCall {
 
 struct ModuleModifier : public ModuleCall {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::MODULE_MODIFIER;
+
   ModuleModifier(std::string modifier, std::shared_ptr<ModuleCall> module,
                  Location loc)
-      : modifier(modifier), module(module), ModuleCall(modifier, {}, loc) {}
+      : modifier(modifier),
+        module(std::move(module)),
+        ModuleCall(NodeKind::MODULE_MODIFIER, modifier, {}, loc) {}
 
   std::string modifier;
   std::shared_ptr<ModuleCall> module;
 };
 
+// Source text of a function or module body skipped by lazy parsing, see
+// Frontend::setLazyBodies.
+struct LazyBody {
+  std::string source;
+  Location loc;
+};
+
 struct ModuleDecl final : public Node {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::MODULE_DECL;
+
   ModuleDecl(std::string name, std::vector<AssignNode> args, ModuleBody body,
              Location loc)
-      : name(name), args(args), body(body), Node(loc) {}
+      : name(std::move(name)),
+        args(std::move(args)),
+        body(std::move(body)),
+        Node(NodeKind::MODULE_DECL, loc) {}
 
   std::string name;
   // arguments with no default value have expr=nullptr
   std::vector<AssignNode> args;
   ModuleBody body;
+  // not nullptr if the body is not parsed yet, body is empty in this case
+  std::shared_ptr<const LazyBody> lazyBody;
 };
 
 struct FunctionDecl final : public Node {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::FUNCTION_DECL;
+
   FunctionDecl(std::string name, std::vector<AssignNode> args, Expr body,
                Location loc)
-      : name(name), args(args), body(body), Node(loc) {}
+      : name(std::move(name)),
+        args(std::move(args)),
+        body(std::move(body)),
+        Node(NodeKind::FUNCTION_DECL, loc) {}
 
   std::string name;
   // arguments with no default value have expr=nullptr
   std::vector<AssignNode> args;
   Expr body;
+  // not nullptr if the body is not parsed yet, body is nullptr in this case
+  std::shared_ptr<const LazyBody> lazyBody;
 };
 
 struct NumberNode final : public ExprNode,
                           std::enable_shared_from_this<NumberNode> {
  public:
-  NumberNode(double value, Location loc) : value(value), ExprNode(loc) {}
+  static constexpr NodeKind nodeKind = NodeKind::NUMBER;
+
+  NumberNode(double value, Location loc)
+      : value(value), ExprNode(NodeKind::NUMBER, loc) {}
 
   double value;
 
   virtual bool isConstValue() override { return true; }
 };
 
+struct BoolNode final : public ExprNode,
+                        std::enable_shared_from_this<BoolNode> {
+ public:
+  static constexpr NodeKind nodeKind = NodeKind::BOOL;
+
+  BoolNode(bool value, Location loc)
+      : value(value), ExprNode(NodeKind::BOOL, loc) {}
+
+  bool value;
+
+  virtual bool isConstValue() override { return true; }
+};
+
 struct StringNode final : public ExprNode,
                           std::enable_shared_from_this<StringNode> {
  public:
-  StringNode(std::string str, Location loc) : str(str), ExprNode(loc) {}
+  static constexpr NodeKind nodeKind = NodeKind::STRING;
+
+  StringNode(std::string str, Location loc)
+      : str(std::move(str)), ExprNode(NodeKind::STRING, loc) {}
 
   std::string str;
 
@@ -159,92 +233,135 @@ struct StringNode final : public ExprNode,
 struct UndefNode final : public ExprNode,
                          public std::enable_shared_from_this<UndefNode> {
  public:
-  UndefNode(Location loc) : ExprNode(loc) {}
+  static constexpr NodeKind nodeKind = NodeKind::UNDEF;
+
+  UndefNode(Location loc) : ExprNode(NodeKind::UNDEF, loc) {}
 
   virtual bool isConstValue() override { return true; }
 };
 
 struct IdentNode : public ExprNode, std::enable_shared_from_this<IdentNode> {
  public:
-  IdentNode(std::string name, Location loc) : name(name), ExprNode(loc) {}
+  static constexpr NodeKind nodeKind = NodeKind::IDENT;
+
+  IdentNode(std::string name, Location loc)
+      : name(std::move(name)), ExprNode(NodeKind::IDENT, loc) {}
 
   std::string name;
 
   bool isConfigVar() const { return name.length() > 1 && name[0] == '$'; }
 };
 
-struct UnaryOpNode final : public ExprNode,
-                           std::enable_shared_from_this<UnaryOpNode> {
+struct UnaryOpNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::UNARY_OP;
+
   UnaryOpNode(Expr operand, UnaryOp op, Location loc)
-      : operand(operand), op(op), ExprNode(loc) {}
+      : operand(std::move(operand)),
+        op(op),
+        ExprNode(NodeKind::UNARY_OP, loc) {}
 
   Expr operand;
   UnaryOp op;
 };
 
-struct BinaryOpNode final : public ExprNode,
-                            std::enable_shared_from_this<BinaryOpNode> {
+struct BinaryOpNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::BINARY_OP;
+
   BinaryOpNode(Expr lhs, Expr rhs, BinOp op, Location loc)
-      : lhs(lhs), rhs(rhs), op(op), ExprNode(loc) {}
+      : lhs(std::move(lhs)),
+        rhs(std::move(rhs)),
+        op(op),
+        ExprNode(NodeKind::BINARY_OP, loc) {}
 
   Expr lhs;
   Expr rhs;
   BinOp op;
 };
 
-struct CallNode final : public ExprNode,
-                        std::enable_shared_from_this<CallNode> {
+struct CallNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::CALL;
+
   CallNode(Expr fun, std::vector<AssignNode> args, Location loc)
-      : fun(fun), args(args), ExprNode(loc) {}
+      : fun(std::move(fun)),
+        args(std::move(args)),
+        ExprNode(NodeKind::CALL, loc) {}
 
   Expr fun;
   // positional arguments have empty names
   std::vector<AssignNode> args;
 };
 
-struct IfExprNode final : public ExprNode,
-                          std::enable_shared_from_this<IfExprNode> {
+struct IfExprNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::IF_EXPR;
+
   IfExprNode(Expr cond, Expr ifthen, Expr ifelse, Location loc)
-      : cond(cond), ifthen(ifthen), ifelse(ifelse), ExprNode(loc) {}
+      : cond(std::move(cond)),
+        ifthen(std::move(ifthen)),
+        ifelse(std::move(ifelse)),
+        ExprNode(NodeKind::IF_EXPR, loc) {}
 
   Expr cond;
   Expr ifthen;
   Expr ifelse;
 };
 
-struct ListExprNode final : public ExprNode,
-                            std::enable_shared_from_this<ListExprNode> {
+struct ListExprNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LIST_EXPR;
+
   ListExprNode(std::vector<std::pair<Expr, bool>> elements, Location loc)
-      : elements(elements), ExprNode(loc) {}
+      : elements(std::move(elements)), ExprNode(NodeKind::LIST_EXPR, loc) {
+    for (auto &elem : this->elements)
+      if (elem.second || !elem.first->isConstValue()) constant = false;
+  }
 
   // element, is_each pair
   // if is_each is true, the element should be flattened
   std::vector<std::pair<Expr, bool>> elements;
+
+  // constant lists are stored in the constant pool instead of being built at
+  // runtime. This is computed once on construction as nested lists would make
+  // the check quadratic, so elements should not be modified afterwards.
+  virtual bool isConstValue() override { return constant; }
+
+ private:
+  bool constant = true;
 };
 
-struct RangeNode final : public ExprNode,
-                         std::enable_shared_from_this<RangeNode> {
+struct RangeNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::RANGE;
+
   RangeNode(Expr start, Expr step, Expr end, Location loc)
-      : start(start), step(step), end(end), ExprNode(loc) {}
+      : start(std::move(start)),
+        step(std::move(step)),
+        end(std::move(end)),
+        ExprNode(NodeKind::RANGE, loc) {}
 
   Expr start, step, end;
+
+  virtual bool isConstValue() override {
+    return start->isConstValue() && step->isConstValue() &&
+           end->isConstValue();
+  }
 };
 
 // TODO: multiple generator expression is encoded as nested comprehension with
 // is_each set to true
-struct ListCompNode final : public ExprNode,
-                            std::enable_shared_from_this<ListCompNode> {
+struct ListCompNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LIST_COMP;
+
   ListCompNode(std::vector<AssignNode> assignments,
                std::vector<std::tuple<Expr, Expr, bool>> generators,
                Location loc)
-      : assignments(assignments), generators(generators), ExprNode(loc) {}
+      : assignments(std::move(assignments)),
+        generators(std::move(generators)),
+        ExprNode(NodeKind::LIST_COMP, loc) {}
 
   // iterator variables
   std::vector<AssignNode> assignments;
@@ -252,18 +369,19 @@ struct ListCompNode final : public ExprNode,
   std::vector<std::tuple<Expr, Expr, bool>> generators;
 };
 
-struct ListCompCNode final : public ExprNode,
-                             std::enable_shared_from_this<ListCompCNode> {
+struct ListCompCNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LIST_COMP_C;
+
   ListCompCNode(std::vector<AssignNode> init, Expr cond,
                 std::vector<AssignNode> update,
                 std::vector<std::tuple<Expr, Expr, bool>> generators,
                 Location loc)
-      : init(init),
-        cond(cond),
-        update(update),
-        generators(generators),
-        ExprNode(loc) {}
+      : init(std::move(init)),
+        cond(std::move(cond)),
+        update(std::move(update)),
+        generators(std::move(generators)),
+        ExprNode(NodeKind::LIST_COMP_C, loc) {}
   std::vector<AssignNode> init;
   Expr cond;
   std::vector<AssignNode> update;
@@ -271,30 +389,63 @@ struct ListCompCNode final : public ExprNode,
   std::vector<std::tuple<Expr, Expr, bool>> generators;
 };
 
-struct ListIndexNode final : public ExprNode,
-                             std::enable_shared_from_this<ListIndexNode> {
+struct ListIndexNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LIST_INDEX;
+
   ListIndexNode(Expr list, Expr index, Location loc)
-      : list(list), index(index), ExprNode(loc) {}
+      : list(std::move(list)),
+        index(std::move(index)),
+        ExprNode(NodeKind::LIST_INDEX, loc) {}
   Expr list;
   Expr index;
 };
 
-struct LetNode final : public ExprNode, std::enable_shared_from_this<LetNode> {
+struct LetNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LET;
+
   LetNode(std::vector<AssignNode> bindings, Expr expr, Location loc)
-      : bindings(bindings), expr(expr), ExprNode(loc) {}
+      : bindings(std::move(bindings)),
+        expr(std::move(expr)),
+        ExprNode(NodeKind::LET, loc) {}
   std::vector<AssignNode> bindings;
   Expr expr;
 };
 
 // closure is handled by the bytecode generator
-struct LambdaNode final : public ExprNode,
-                          std::enable_shared_from_this<LambdaNode> {
+struct LambdaNode final : public ExprNode {
  public:
+  static constexpr NodeKind nodeKind = NodeKind::LAMBDA;
+
   LambdaNode(std::vector<AssignNode> params, Expr expr, Location loc)
-      : params(params), expr(expr), ExprNode(loc) {}
+      : params(std::move(params)),
+        expr(std::move(expr)),
+        ExprNode(NodeKind::LAMBDA, loc) {}
   std::vector<AssignNode> params;
   Expr expr;
 };
+
+template <typename T>
+bool isa(const Node &node) {
+  return node.kind == T::nodeKind;
+}
+
+template <typename T>
+T &cast(Node &node) {
+  assert(isa<T>(node));
+  return static_cast<T &>(node);
+}
+
+// nullptr if node is nullptr or not a T
+template <typename T>
+T *dynCast(Node *node) {
+  return node != nullptr && isa<T>(*node) ? static_cast<T *>(node) : nullptr;
+}
+
+template <typename T>
+const T *dynCast(const Node *node) {
+  return node != nullptr && isa<T>(*node) ? static_cast<const T *>(node)
+                                          : nullptr;
+}
 }  // namespace sscad
@@ -18,50 +18,73 @@
 namespace sscad {
 
 void AstVisitor::visit(Node &node) {
-  if (typeid(node) == typeid(AssignNode)) {
-    visit(static_cast<AssignNode &>(node));
-  } else if (typeid(node) == typeid(SingleModuleCall)) {
-    visit(static_cast<SingleModuleCall &>(node));
-  } else if (typeid(node) == typeid(IfModule)) {
-    visit(static_cast<IfModule &>(node));
-  } else if (typeid(node) == typeid(ModuleModifier)) {
-    visit(static_cast<ModuleModifier &>(node));
-  } else if (typeid(node) == typeid(ModuleDecl)) {
-    visit(static_cast<ModuleDecl &>(node));
-  } else if (typeid(node) == typeid(FunctionDecl)) {
-    visit(static_cast<FunctionDecl &>(node));
-  } else if (typeid(node) == typeid(NumberNode)) {
-    visit(static_cast<NumberNode &>(node));
-  } else if (typeid(node) == typeid(StringNode)) {
-    visit(static_cast<StringNode &>(node));
-  } else if (typeid(node) == typeid(UndefNode)) {
-    visit(static_cast<UndefNode &>(node));
-  } else if (typeid(node) == typeid(IdentNode)) {
-    visit(static_cast<IdentNode &>(node));
-  } else if (typeid(node) == typeid(UnaryOpNode)) {
-    visit(static_cast<UnaryOpNode &>(node));
-  } else if (typeid(node) == typeid(BinaryOpNode)) {
-    visit(static_cast<BinaryOpNode &>(node));
-  } else if (typeid(node) == typeid(CallNode)) {
-    visit(static_cast<CallNode &>(node));
-  } else if (typeid(node) == typeid(IfExprNode)) {
-    visit(static_cast<IfExprNode &>(node));
-  } else if (typeid(node) == typeid(ListExprNode)) {
-    visit(static_cast<ListExprNode &>(node));
-  } else if (typeid(node) == typeid(RangeNode)) {
-    visit(static_cast<RangeNode &>(node));
-  } else if (typeid(node) == typeid(ListCompNode)) {
-    visit(static_cast<ListCompNode &>(node));
-  } else if (typeid(node) == typeid(ListCompCNode)) {
-    visit(static_cast<ListCompCNode &>(node));
-  } else if (typeid(node) == typeid(ListIndexNode)) {
-    visit(static_cast<ListIndexNode &>(node));
-  } else if (typeid(node) == typeid(LetNode)) {
-    visit(static_cast<LetNode &>(node));
-  } else if (typeid(node) == typeid(LambdaNode)) {
-    visit(static_cast<LambdaNode &>(node));
-  } else {
-    throw std::runtime_error("unreachable");
+  switch (node.kind) {
+    case NodeKind::ASSIGN:
+      visit(static_cast<AssignNode &>(node));
+      break;
+    case NodeKind::SINGLE_MODULE_CALL:
+      visit(static_cast<SingleModuleCall &>(node));
+      break;
+    case NodeKind::IF_MODULE:
+      visit(static_cast<IfModule &>(node));
+      break;
+    case NodeKind::MODULE_MODIFIER:
+      visit(static_cast<ModuleModifier &>(node));
+      break;
+    case NodeKind::MODULE_DECL:
+      visit(static_cast<ModuleDecl &>(node));
+      break;
+    case NodeKind::FUNCTION_DECL:
+      visit(static_cast<FunctionDecl &>(node));
+      break;
+    case NodeKind::NUMBER:
+      visit(static_cast<NumberNode &>(node));
+      break;
+    case NodeKind::BOOL:
+      visit(static_cast<BoolNode &>(node));
+      break;
+    case NodeKind::STRING:
+      visit(static_cast<StringNode &>(node));
+      break;
+    case NodeKind::UNDEF:
+      visit(static_cast<UndefNode &>(node));
+      break;
+    case NodeKind::IDENT:
+      visit(static_cast<IdentNode &>(node));
+      break;
+    case NodeKind::UNARY_OP:
+      visit(static_cast<UnaryOpNode &>(node));
+      break;
+    case NodeKind::BINARY_OP:
+      visit(static_cast<BinaryOpNode &>(node));
+      break;
+    case NodeKind::CALL:
+      visit(static_cast<CallNode &>(node));
+      break;
+    case NodeKind::IF_EXPR:
+      visit(static_cast<IfExprNode &>(node));
+      break;
+    case NodeKind::LIST_EXPR:
+      visit(static_cast<ListExprNode &>(node));
+      break;
+    case NodeKind::RANGE:
+      visit(static_cast<RangeNode &>(node));
+      break;
+    case NodeKind::LIST_COMP:
+      visit(static_cast<ListCompNode &>(node));
+      break;
+    case NodeKind::LIST_COMP_C:
+      visit(static_cast<ListCompCNode &>(node));
+      break;
+    case NodeKind::LIST_INDEX:
+      visit(static_cast<ListIndexNode &>(node));
+      break;
+    case NodeKind::LET:
+      visit(static_cast<LetNode &>(node));
+      break;
+    case NodeKind::LAMBDA:
+      visit(static_cast<LambdaNode &>(node));
+      break;
   }
 }
 
@@ -88,7 +111,7 @@ void AstVisitor::visit(ModuleDecl &node) {
 }
 void AstVisitor::visit(FunctionDecl &node) {
   for (auto &arg : node.args) visit(arg);
-  visit(node.body);
+  if (node.body != nullptr) visit(node.body);
 }
 void AstVisitor::visit(UnaryOpNode &node) { visit(node.operand); }
 void AstVisitor::visit(BinaryOpNode &node) {
@@ -147,41 +170,45 @@ void ExprMap::visit(AssignNode &node) {
   if (node.expr != nullptr) node.expr = map(node.expr);
 }
 Expr ExprMap::map(ExprNode &node) {
-  if (typeid(node) == typeid(NumberNode)) {
-    return map(static_cast<NumberNode &>(node));
-  } else if (typeid(node) == typeid(StringNode)) {
-    return map(static_cast<StringNode &>(node));
-  } else if (typeid(node) == typeid(UndefNode)) {
-    return map(static_cast<UndefNode &>(node));
-  } else if (typeid(node) == typeid(IdentNode)) {
-    return map(static_cast<IdentNode &>(node));
-  } else if (typeid(node) == typeid(UnaryOpNode)) {
-    return map(static_cast<UnaryOpNode &>(node));
-  } else if (typeid(node) == typeid(BinaryOpNode)) {
-    return map(static_cast<BinaryOpNode &>(node));
-  } else if (typeid(node) == typeid(CallNode)) {
-    return map(static_cast<CallNode &>(node));
-  } else if (typeid(node) == typeid(IfExprNode)) {
-    return map(static_cast<IfExprNode &>(node));
-  } else if (typeid(node) == typeid(ListExprNode)) {
-    return map(static_cast<ListExprNode &>(node));
-  } else if (typeid(node) == typeid(RangeNode)) {
-    return map(static_cast<RangeNode &>(node));
-  } else if (typeid(node) == typeid(ListCompNode)) {
-    return map(static_cast<ListCompNode &>(node));
-  } else if (typeid(node) == typeid(ListCompCNode)) {
-    return map(static_cast<ListCompCNode &>(node));
-  } else if (typeid(node) == typeid(ListIndexNode)) {
-    return map(static_cast<ListIndexNode &>(node));
-  } else if (typeid(node) == typeid(LetNode)) {
-    return map(static_cast<LetNode &>(node));
-  } else if (typeid(node) == typeid(LambdaNode)) {
-    return map(static_cast<LambdaNode &>(node));
-  } else {
-    throw std::runtime_error("unreachable");
+  switch (node.kind) {
+    case NodeKind::NUMBER:
+      return map(static_cast<NumberNode &>(node));
+    case NodeKind::BOOL:
+      return map(static_cast<BoolNode &>(node));
+    case NodeKind::STRING:
+      return map(static_cast<StringNode &>(node));
+    case NodeKind::UNDEF:
+      return map(static_cast<UndefNode &>(node));
+    case NodeKind::IDENT:
+      return map(static_cast<IdentNode &>(node));
+    case NodeKind::UNARY_OP:
+      return map(static_cast<UnaryOpNode &>(node));
+    case NodeKind::BINARY_OP:
+      return map(static_cast<BinaryOpNode &>(node));
+    case NodeKind::CALL:
+      return map(static_cast<CallNode &>(node));
+    case NodeKind::IF_EXPR:
+      return map(static_cast<IfExprNode &>(node));
+    case NodeKind::LIST_EXPR:
+      return map(static_cast<ListExprNode &>(node));
+    case NodeKind::RANGE:
+      return map(static_cast<RangeNode &>(node));
+    case NodeKind::LIST_COMP:
+      return map(static_cast<ListCompNode &>(node));
+    case NodeKind::LIST_COMP_C:
+      return map(static_cast<ListCompCNode &>(node));
+    case NodeKind::LIST_INDEX:
+      return map(static_cast<ListIndexNode &>(node));
+    case NodeKind::LET:
+      return map(static_cast<LetNode &>(node));
+    case NodeKind::LAMBDA:
+      return map(static_cast<LambdaNode &>(node));
+    default:
+      throw std::runtime_error("unreachable");
   }
 }
 Expr ExprMap::map(NumberNode &node) { return node.shared_from_this(); }
+Expr ExprMap::map(BoolNode &node) { return node.shared_from_this(); }
 Expr ExprMap::map(StringNode &node) { return node.shared_from_this(); }
 Expr ExprMap::map(UndefNode &node) { return node.shared_from_this(); }
 Expr ExprMap::map(IdentNode &node) { return node.shared_from_this(); }
@@ -36,6 +36,7 @@ class AstVisitor {
   virtual void visit(ModuleDecl &);
   virtual void visit(FunctionDecl &);
   virtual void visit(NumberNode &){};
+  virtual void visit(BoolNode &){};
   virtual void visit(StringNode &){};
   virtual void visit(UndefNode &){};
   virtual void visit(IdentNode &){};
@@ -65,6 +66,7 @@ class ExprMap : public AstVisitor {
   }
   virtual void visit(AssignNode &) override;
   virtual std::shared_ptr<ExprNode> map(NumberNode &);
+  virtual std::shared_ptr<ExprNode> map(BoolNode &);
   virtual std::shared_ptr<ExprNode> map(StringNode &);
   virtual std::shared_ptr<ExprNode> map(UndefNode &);
   virtual std::shared_ptr<ExprNode> map(IdentNode &);
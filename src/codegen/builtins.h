@@ -0,0 +1,33 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <string>
+#include <unordered_map>
+
+#include "vm/instructions.h"
+
+namespace sscad {
+const std::unordered_map<std::string, BuiltinUnary> builtins = {
+    {"sin", BuiltinUnary::SIN},     {"cos", BuiltinUnary::COS},
+    {"tan", BuiltinUnary::TAN},     {"asin", BuiltinUnary::ASIN},
+    {"acos", BuiltinUnary::ACOS},   {"atan", BuiltinUnary::ATAN},
+    {"abs", BuiltinUnary::ABS},     {"ceil", BuiltinUnary::CEIL},
+    {"floor", BuiltinUnary::FLOOR}, {"ln", BuiltinUnary::LN},
+    {"log", BuiltinUnary::LOG},     {"norm", BuiltinUnary::NORM},
+    {"round", BuiltinUnary::ROUND}, {"sign", BuiltinUnary::SIGN},
+    {"sqrt", BuiltinUnary::SQRT},   {"len", BuiltinUnary::LEN},
+};
+}  // namespace sscad
@@ -15,30 +15,31 @@
  */
 #pragma once
 #include <cassert>
+#include <deque>
 #include <limits>
 #include <optional>
 // #include <unordered_map>
-#include <iostream>
 #include <map>
 #include <vector>
 
 #include "ast_visitor.h"
+#include "codegen/builtins.h"
 #include "frontend.h"
+#include "vm/evaluator.h"
 #include "vm/instructions.h"
+#include "vm/numeric.h"
 
 namespace sscad {
-const std::unordered_map<std::string, BuiltinUnary> builtins = {
-    {"sin", BuiltinUnary::SIN},     {"cos", BuiltinUnary::COS},
-    {"tan", BuiltinUnary::TAN},     {"asin", BuiltinUnary::ASIN},
-    {"acos", BuiltinUnary::ACOS},   {"atan", BuiltinUnary::ATAN},
-    {"abs", BuiltinUnary::ABS},     {"ceil", BuiltinUnary::CEIL},
-    {"floor", BuiltinUnary::FLOOR}, {"ln", BuiltinUnary::LN},
-    {"log", BuiltinUnary::LOG},     {"norm", BuiltinUnary::NORM},
-    {"round", BuiltinUnary::ROUND}, {"sign", BuiltinUnary::SIGN},
-    {"sqrt", BuiltinUnary::SQRT},
-};
-
 // simple direct translation...
+//
+// Each expression also records the type it is known to evaluate to, if any.
+// Functions with parameters get a number specialized clone, where the
+// parameters are assumed to be numbers and operations on known numbers skip
+// the tag checks. The generic version starts with a SpecializeI guard that
+// switches to the clone when all the arguments are numbers.
+//
+// Instructions are attributed to the innermost expression generating them,
+// which gives the line table of each function.
 class BytecodeGen : public AstVisitor {
  public:
   using AstVisitor::visit;
@@ -46,20 +47,29 @@ class BytecodeGen : public AstVisitor {
 
   virtual void visit(NumberNode& node) override {
     addDouble(tail->instructions, node.value);
+    exprType = ValueTag::NUMBER;
+  }
+
+  virtual void visit(BoolNode& node) override {
+    addInst(tail->instructions, Instruction::ConstMisc, node.value ? 1 : 0);
+    exprType = ValueTag::BOOLEAN;
   }
 
   virtual void visit(StringNode& node) override {
-    // should just be some global value thing
-    throw std::runtime_error("not implemented");
+    addConstant(node);
+    exprType = ValueTag::STRING;
   }
 
   virtual void visit(UndefNode& node) override {
     addInst(tail->instructions, Instruction::ConstMisc, 2);
+    exprType = ValueTag::UNDEF;
   }
 
   virtual void visit(IdentNode& node) override {
     // this is basically just variable node
     if (node.isConfigVar()) {
+      // config variables are dynamically scoped
+      currentPure = false;
       const auto pair =
           std::make_pair(std::numeric_limits<FileHandle>::max(), node.name);
       auto iter = globalMap.insert(std::make_pair(pair, globalMap.size()));
@@ -71,6 +81,8 @@ class BytecodeGen : public AstVisitor {
       const auto iter = variableLookup.back().find(node.name);
       if (iter != variableLookup.back().end()) {
         addInst(tail->instructions, Instruction::GetI, iter->second);
+        // locals are only parameters for now
+        if (numberParams) exprType = ValueTag::NUMBER;
         return;
       }
     }
@@ -88,107 +100,257 @@ class BytecodeGen : public AstVisitor {
         return;
       }
     }
-    warnings.emplace_back(node.loc, "undefined variable");
+    // clones are generated multiple times, only warn for the generic version
+    if (!numberParams) warnings.emplace_back(node.loc, "undefined variable");
     // undef
     addInst(tail->instructions, Instruction::ConstMisc, 2);
   }
 
   virtual void visit(UnaryOpNode& node) override {
-    visit(node.operand);
-    if (node.op == UnaryOp::NOT)
+    auto type = visitExpr(node.operand);
+    if (node.op == UnaryOp::NOT) {
       addUnaryOp(tail->instructions, BuiltinUnary::NOT);
-    else  // if (node.op == UnaryOp::NEG)
-      addUnaryOp(tail->instructions, BuiltinUnary::NEG);
+      exprType = ValueTag::BOOLEAN;
+    } else {  // if (node.op == UnaryOp::NEG)
+      addUnary(BuiltinUnary::NEG, type);
+    }
   }
 
   virtual void visit(BinaryOpNode& node) override {
-    visit(node.lhs);
-    visit(node.rhs);
+    auto lhsType = visitExpr(node.lhs);
+    auto rhsType = visitExpr(node.rhs);
+    bool numbers =
+        lhsType == ValueTag::NUMBER && rhsType == ValueTag::NUMBER;
+    if (numbers && node.op <= BinOp::NEQ) {
+      addNumBinOp(tail->instructions, node.op);
+      specializedOps++;
+      exprType = node.op <= BinOp::EXP ? ValueTag::NUMBER : ValueTag::BOOLEAN;
+      return;
+    }
     addBinOp(tail->instructions, node.op);
+    bool booleans =
+        lhsType == ValueTag::BOOLEAN && rhsType == ValueTag::BOOLEAN;
+    if (node.op == BinOp::EQ || node.op == BinOp::NEQ ||
+        (booleans && (node.op == BinOp::AND || node.op == BinOp::OR)))
+      exprType = ValueTag::BOOLEAN;
+    else
+      exprType.reset();
   }
 
   virtual void visit(CallNode& node) override {
     // don't care about multiple modules and lambda for now
     // also don't care about parameter reordering and such, will fix later...
-    auto ident = dynamic_cast<IdentNode*>(node.fun.get());
+    auto ident = dynCast<IdentNode>(node.fun.get());
     if (ident == nullptr)
       throw std::runtime_error("lambda not supported for now");
+    bool numbers = true;
     for (auto& arg : node.args) {
-      visit(arg.expr);
+      numbers &= visitExpr(arg.expr) == ValueTag::NUMBER;
     }
+    exprType.reset();
     auto iter = functionMap.find(std::make_pair(currentFile, ident->name));
     if (iter != functionMap.end()) {
-      addInst(tail->instructions, Instruction::CallI, iter->second);
+      int target = iter->second;
+      int clone = numberClones[target];
+      if (numbers && clone != -1 &&
+          node.args.size() == functions[target].parameters) {
+        // skip the guard in the generic version
+        target = clone;
+        if (cloneReturnsNumber[clone]) exprType = ValueTag::NUMBER;
+      }
+      callees[currentFunction].push_back(target);
+      addInst(tail->instructions, Instruction::CallI, target);
       return;
     }
     auto iter2 = builtins.find(ident->name);
     if (iter2 != builtins.end()) {
-      addUnaryOp(tail->instructions, iter2->second);
+      addUnary(iter2->second,
+               numbers && node.args.size() == 1
+                   ? std::optional<ValueTag>(ValueTag::NUMBER)
+                   : std::nullopt);
       return;
     }
     throw std::runtime_error("unknown function call");
   }
 
   virtual void visit(IfExprNode& node) override {
-    visit(node.cond);
-    int currentid = currentbb;
+    visitExpr(node.cond);
+    int condid = currentbb;
 
-    funbody.emplace_back();
-    int trueid = funbody.size() - 1;
-    currentbb = trueid;
-    tail = &funbody[trueid];
-    visit(node.ifthen);
+    int trueid = newBlock();
+    auto trueType = visitExpr(node.ifthen);
+    // nested conditionals can end the branch in another basic block
+    int trueEnd = currentbb;
 
-    funbody.emplace_back();
-    int falseid = funbody.size() - 1;
-    currentbb = falseid;
-    tail = &funbody[falseid];
-    visit(node.ifelse);
+    int falseid = newBlock();
+    auto falseType = visitExpr(node.ifelse);
+    int falseEnd = currentbb;
+    exprType = trueType == falseType ? trueType : std::nullopt;
 
-    funbody.emplace_back();
-    int tailid = funbody.size() - 1;
-    currentbb = tailid;
-    tail = &funbody[tailid];
+    int tailid = newBlock();
+
+    funbody[trueEnd].next = tailid;
+    funbody[falseEnd].next = tailid;
+    funbody[condid].jumpFalse = falseid;
+    funbody[condid].next = trueid;
+  }
+
+  virtual void visit(ListExprNode& node) override {
+    if (node.isConstValue()) {
+      addConstant(node);
+      exprType = ValueTag::VECTOR;
+      return;
+    }
+    addInst(tail->instructions, Instruction::MakeList);
+    for (auto& elem : node.elements) {
+      visitExpr(elem.first);
+      addBinOp(tail->instructions, elem.second ? BinOp::CONCAT : BinOp::APPEND);
+    }
+    // concatenating a non-list gives undef
+    exprType.reset();
+  }
 
-    funbody[trueid].next = tailid;
-    funbody[falseid].next = tailid;
-    funbody[currentid].jumpFalse = falseid;
-    funbody[currentid].next = trueid;
+  // The body of the comprehension is lifted into a function taking the
+  // parameters of the current function and the iteration variable, returning
+  // the list of elements for one iteration. MapI calls it for every element
+  // and concatenates the lists, in parallel if the body is pure.
+  virtual void visit(ListCompNode& node) override {
+    if (node.assignments.empty())
+      throw std::runtime_error("list comprehension without variable");
+    auto iter = liftedIds.find(&node);
+    if (iter == liftedIds.end()) {
+      std::vector<AssignNode> params;
+      for (const auto& name : currentParams)
+        params.emplace_back(name, nullptr, node.loc);
+      params.emplace_back(node.assignments[0].ident, nullptr, node.loc);
+      Expr body;
+      if (node.assignments.size() > 1) {
+        // for (i = a, j = b) is the same as nested comprehensions
+        std::vector<AssignNode> rest(node.assignments.begin() + 1,
+                                     node.assignments.end());
+        body = std::make_shared<ListCompNode>(rest, node.generators, node.loc);
+        body = std::make_shared<ListExprNode>(
+            std::vector<std::pair<Expr, bool>>{{body, true}}, node.loc);
+      } else {
+        body = generatorsBody(node.generators, node.loc);
+      }
+      int id = newFunction(params.size());
+      liftedDecls.emplace_back("for", params, body, node.loc);
+      pendingLifted.emplace_back(&liftedDecls.back(), id);
+      iter = liftedIds.insert({&node, id}).first;
+    }
+    for (size_t i = 0; i < currentParams.size(); i++)
+      addInst(tail->instructions, Instruction::GetI, i);
+    visitExpr(node.assignments[0].expr);
+    callees[currentFunction].push_back(iter->second);
+    addInst(tail->instructions, Instruction::MapI, iter->second);
+    exprType = ValueTag::VECTOR;
+  }
+
+  virtual void visit(ListCompCNode& node) override {
+    throw std::runtime_error("C-style list comprehension not supported for now");
+  }
+
+  virtual void visit(RangeNode& node) override {
+    if (node.isConstValue()) {
+      addConstant(node);
+      exprType = ValueTag::RANGE;
+      return;
+    }
+    visitExpr(node.start);
+    visitExpr(node.step);
+    visitExpr(node.end);
+    addInst(tail->instructions, Instruction::MakeRange);
+    exprType.reset();
+  }
+
+  virtual void visit(ListIndexNode& node) override {
+    visitExpr(node.list);
+    visitExpr(node.index);
+    addBinOp(tail->instructions, BinOp::INDEX);
+    exprType.reset();
   }
 
   virtual void visit(TranslationUnit& unit) override {
+    // The lifted declarations share nodes with the unit, and they and the
+    // constant indices are keyed by node addresses, which a later unit can
+    // reuse, so they are released before returning.
+    struct ReleaseLifted {
+      BytecodeGen* gen;
+      ~ReleaseLifted() {
+        gen->pendingLifted.clear();
+        gen->liftedDecls.clear();
+        gen->liftedIds.clear();
+        gen->constantIndices.clear();
+      }
+    } releaseLifted{this};
+    currentFile = unit.file;
+    std::vector<int> ids;
     for (auto& fun : unit.functions) {
-      functionMap.insert(std::make_pair(std::make_pair(currentFile, fun.name),
-                                        functionMap.size()));
+      auto iter = functionMap.insert(std::make_pair(
+          std::make_pair(currentFile, fun.name), functions.size()));
+      if (iter.second) functions.emplace_back();
+      ids.push_back(iter.first->second);
+      functions[ids.back()].parameters = fun.args.size();
     }
     for (auto& assign : unit.assignments) {
       globalMap.insert(std::make_pair(std::make_pair(currentFile, assign.ident),
                                       globalMap.size()));
     }
-    // actual translation
-    for (auto& fun : unit.functions) {
-      std::cout << "codegen for function " << fun.name << std::endl;
-      funbody.clear();
-      tail = &funbody.emplace_back();
-      currentbb = 0;
-      variableLookup.clear();
-      auto& args = variableLookup.emplace_back();
-      for (auto& assign : fun.args)
-        args.insert(std::make_pair(assign.ident, args.size()));
-      visit(fun.body);
-      tail->next = -1;
-      int i = 0;
-      for (const auto& bb : funbody) {
-        std::cout << "l" << i++ << std::endl;
-        print(std::cout, bb.instructions);
-        if (bb.jumpFalse)
-          std::cout << "  JumpFalseI l" << bb.jumpFalse.value() << std::endl;
-        if (bb.next == -1)
-          std::cout << "  ret" << std::endl;
-        else
-          std::cout << "  JumpI l" << bb.next << std::endl;
+    numberClones.resize(functions.size(), -1);
+    for (size_t i = 0; i < ids.size(); i++) {
+      if (unit.functions[i].args.empty() || numberClones[ids[i]] != -1)
+        continue;
+      numberClones[ids[i]] = functions.size();
+      functions.push_back(FunctionEntry{{}, functions[ids[i]].parameters});
+    }
+    numberClones.resize(functions.size(), -1);
+    cloneReturnsNumber.resize(functions.size(), true);
+    specialized.resize(functions.size());
+    callees.resize(functions.size());
+    locallyPure.resize(functions.size());
+
+    // clones are assumed to return numbers until proven otherwise, the
+    // assumption only gets weaker so this terminates
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < ids.size(); i++) {
+        int clone = numberClones[ids[i]];
+        if (clone == -1) continue;
+        auto type = generateFunction(unit.functions[i], clone, true);
+        if (type != ValueTag::NUMBER && cloneReturnsNumber[clone]) {
+          cloneReturnsNumber[clone] = false;
+          changed = true;
+        }
       }
     }
+    for (size_t i = 0; i < ids.size(); i++)
+      generateFunction(unit.functions[i], ids[i], false);
+    // comprehension bodies, which can contain more comprehensions
+    while (!pendingLifted.empty()) {
+      auto [decl, id] = pendingLifted.front();
+      pendingLifted.pop_front();
+      generateFunction(*decl, id, false);
+    }
+    markPure();
+  }
+
+  // generated functions, indexed by the function ID
+  std::vector<FunctionEntry> functions;
+  // constant pool for the generated functions, the evaluator takes the
+  // ownership of these values
+  std::vector<ValuePair> constants;
+
+  // number of globals used by the generated functions
+  size_t globalCount() const { return globalMap.size(); }
+  // index of a file scope or config variable, e.g. for overriding it with
+  // Evaluator::setGlobal, -1 if the generated functions do not use it
+  int globalIndex(FileHandle file, const std::string& name) const {
+    if (name.length() > 1 && name[0] == '$')
+      file = std::numeric_limits<FileHandle>::max();
+    auto iter = globalMap.find(std::make_pair(file, name));
+    return iter != globalMap.end() ? iter->second : -1;
   }
 
   // TODO: add new AST nodes
@@ -196,15 +358,276 @@ class BytecodeGen : public AstVisitor {
  private:
   struct BasicBlock {
     std::vector<unsigned char> instructions;
+    // location of the instructions from each offset, see FunctionEntry::lines
+    std::vector<std::pair<int, Location>> lines;
     std::optional<int> jumpFalse;
-    int next;
+    // -1 for return
+    int next = -1;
   };
+
+  std::optional<ValueTag> visitExpr(Expr& expr) {
+    exprType.reset();
+    Location parent = currentLoc;
+    mark(expr->loc);
+    visit(expr);
+    // the instructions after a subexpression belong to the parent
+    mark(parent);
+    return exprType;
+  }
+
+  // attribute the following instructions to loc
+  void mark(const Location& loc) {
+    currentLoc = loc;
+    auto& lines = tail->lines;
+    int offset = tail->instructions.size();
+    if (!lines.empty() && lines.back().first == offset) lines.pop_back();
+    if (lines.empty() || lines.back().second != loc)
+      lines.emplace_back(offset, loc);
+  }
+
+  void addUnary(BuiltinUnary op, std::optional<ValueTag> type) {
+    exprType.reset();
+    if (type == ValueTag::NUMBER && isNumericUnary(op)) {
+      addNumUnaryOp(tail->instructions, op);
+      specializedOps++;
+      exprType = ValueTag::NUMBER;
+      return;
+    }
+    addUnaryOp(tail->instructions, op);
+  }
+
+  // returns the type of the function result
+  std::optional<ValueTag> generateFunction(FunctionDecl& fun, int id,
+                                           bool numbers) {
+    if (fun.lazyBody != nullptr)
+      throw std::runtime_error("body of function " + fun.name +
+                               " is not parsed, see Frontend::parseBody");
+    currentFunction = id;
+    currentPure = true;
+    callees[id].clear();
+    numberParams = numbers;
+    specializedOps = 0;
+    funbody.clear();
+    newBlock();
+    mark(fun.loc);
+    variableLookup.clear();
+    auto& args = variableLookup.emplace_back();
+    currentParams.clear();
+    // later parameters shadow earlier ones, e.g. iteration variables
+    for (auto& assign : fun.args) {
+      args[assign.ident] = currentParams.size();
+      currentParams.push_back(assign.ident);
+    }
+    int clone = numberClones[id];
+    if (!numbers && clone != -1 && specialized[clone])
+      addInst(tail->instructions, Instruction::SpecializeI, clone);
+    auto type = visitExpr(fun.body);
+    tail->next = -1;
+    std::vector<std::pair<int, Location>> lines;
+    auto instructions = link(lines);
+    // clones and comprehension bodies ("for") are named like their source
+    functions[id] = FunctionEntry{std::move(instructions),
+                                  static_cast<int>(fun.args.size()), false,
+                                  false, std::move(lines), fun.name};
+    locallyPure[id] = currentPure;
+    if (numbers) specialized[id] = specializedOps > 0;
+    numberParams = false;
+    return type;
+  }
+
+  int newFunction(int parameters) {
+    functions.push_back(FunctionEntry{{}, parameters});
+    numberClones.push_back(-1);
+    cloneReturnsNumber.resize(functions.size(), true);
+    specialized.resize(functions.size());
+    callees.resize(functions.size());
+    locallyPure.resize(functions.size());
+    return functions.size() - 1;
+  }
+
+  // list of the elements produced by one iteration of a comprehension
+  static Expr generatorsBody(
+      const std::vector<std::tuple<Expr, Expr, bool>>& generators,
+      Location loc) {
+    Expr body = std::make_shared<ListExprNode>(
+        std::vector<std::pair<Expr, bool>>{}, loc);
+    for (auto iter = generators.rbegin(); iter != generators.rend(); iter++) {
+      auto& [cond, elem, each] = *iter;
+      Expr value = std::make_shared<ListExprNode>(
+          std::vector<std::pair<Expr, bool>>{{elem, each}}, loc);
+      // generators without a condition have the constant 1
+      auto number = dynCast<NumberNode>(cond.get());
+      if (number != nullptr && number->value != 0)
+        body = value;
+      else
+        body = std::make_shared<IfExprNode>(cond, value, body, loc);
+    }
+    return body;
+  }
+
+  int newBlock() {
+    funbody.emplace_back();
+    currentbb = funbody.size() - 1;
+    tail = &funbody.back();
+    if (funbody.size() > 1) mark(currentLoc);
+    return currentbb;
+  }
+
+  // Lay out the basic blocks in order. Jump immediates are variable length,
+  // so we iterate until the jump sizes converge. Sizes only grow and
+  // distances only grow with them, so this terminates.
+  std::vector<unsigned char> link(
+      std::vector<std::pair<int, Location>>& lines) {
+    const int n = funbody.size();
+    std::vector<int> falseSize(n, 2), nextSize(n, 2), offsets(n + 1, 0);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int i = 0; i < n; i++) {
+        const auto& bb = funbody[i];
+        int size = bb.instructions.size();
+        if (bb.jumpFalse) size += falseSize[i];
+        if (bb.next == -1)
+          size += 1;
+        else if (bb.next != i + 1)
+          size += nextSize[i];
+        offsets[i + 1] = offsets[i] + size;
+      }
+      for (int i = 0; i < n; i++) {
+        const auto& bb = funbody[i];
+        int pc = offsets[i] + bb.instructions.size();
+        if (bb.jumpFalse) {
+          int size = 1 + immSize(offsets[bb.jumpFalse.value()] - pc);
+          if (size > falseSize[i]) {
+            falseSize[i] = size;
+            changed = true;
+          }
+          pc += falseSize[i];
+        }
+        if (bb.next != -1 && bb.next != i + 1) {
+          int size = 1 + immSize(offsets[bb.next] - pc);
+          if (size > nextSize[i]) {
+            nextSize[i] = size;
+            changed = true;
+          }
+        }
+      }
+    }
+    std::vector<unsigned char> instructions;
+    instructions.reserve(offsets[n]);
+    for (int i = 0; i < n; i++) {
+      const auto& bb = funbody[i];
+      for (const auto& [offset, loc] : bb.lines) {
+        // empty blocks and repeated locations
+        if (!lines.empty() && lines.back().first == offsets[i] + offset)
+          lines.pop_back();
+        if (lines.empty() || lines.back().second != loc)
+          lines.emplace_back(offsets[i] + offset, loc);
+      }
+      instructions.insert(instructions.end(), bb.instructions.begin(),
+                          bb.instructions.end());
+      if (bb.jumpFalse)
+        addInst(instructions, Instruction::JumpFalseI,
+                offsets[bb.jumpFalse.value()] - instructions.size());
+      if (bb.next == -1)
+        addInst(instructions, Instruction::Ret);
+      else if (bb.next != i + 1)
+        addInst(instructions, Instruction::JumpI,
+                offsets[bb.next] - instructions.size());
+      assert(instructions.size() == offsets[i + 1]);
+    }
+    return instructions;
+  }
+
+  // a function is pure if it does not read config variables and only calls
+  // pure functions, this is the greatest fixed point so recursion is fine
+  void markPure() {
+    for (size_t i = 0; i < functions.size(); i++)
+      functions[i].pure = locallyPure[i];
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < functions.size(); i++) {
+        if (!functions[i].pure) continue;
+        for (int callee : callees[i]) {
+          if (!functions[callee].pure) {
+            functions[i].pure = false;
+            changed = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  void addConstant(ExprNode& node) {
+    auto iter = constantIndices.find(&node);
+    if (iter == constantIndices.end()) {
+      iter = constantIndices.insert({&node, constants.size()}).first;
+      constants.push_back(toValue(node));
+    }
+    addInst(tail->instructions, Instruction::ConstI, iter->second);
+  }
+
+  static ValuePair toValue(ExprNode& node) {
+    if (auto number = dynCast<NumberNode>(&node))
+      return ValuePair(number->value);
+    if (auto b = dynCast<BoolNode>(&node)) return ValuePair(b->value);
+    if (auto str = dynCast<StringNode>(&node))
+      return ValuePair(ValueTag::STRING, SValue{.s = new std::string(str->str)});
+    if (auto list = dynCast<ListExprNode>(&node)) {
+      auto values = std::make_shared<std::vector<ValuePair>>();
+      values->reserve(list->elements.size());
+      for (auto& elem : list->elements) values->push_back(toValue(*elem.first));
+      return ValuePair(ValueTag::VECTOR, SValue{.vec = new SVector{values}});
+    }
+    if (auto range = dynCast<RangeNode>(&node)) {
+      auto start = dynCast<NumberNode>(range->start.get());
+      auto step = dynCast<NumberNode>(range->step.get());
+      auto end = dynCast<NumberNode>(range->end.get());
+      if (start != nullptr && step != nullptr && end != nullptr)
+        return ValuePair(ValueTag::RANGE,
+                         SValue{.range = new SRange{start->value, step->value,
+                                                    end->value}});
+    }
+    return ValuePair::undef();
+  }
+
   std::vector<std::unordered_map<std::string, int>> variableLookup;
   std::map<std::pair<FileHandle, std::string>, int> functionMap;
   std::map<std::pair<FileHandle, std::string>, int> globalMap;
   std::vector<std::pair<Location, std::string>> warnings;
+  // constant pool index for each constant node, inlined constants share the
+  // same node so this also deduplicates them. Only valid while visiting a
+  // unit, see visit(TranslationUnit&).
+  std::unordered_map<ExprNode*, int> constantIndices;
+  // type of the last generated expression, nullopt if unknown
+  std::optional<ValueTag> exprType;
+  // number specialized clone of each function, -1 if there is none
+  std::vector<int> numberClones;
+  // indexed by clone ID, whether the clone always returns a number
+  std::vector<bool> cloneReturnsNumber;
+  // indexed by clone ID, whether the clone skips any tag check
+  std::vector<bool> specialized;
+  bool numberParams = false;
+  int specializedOps;
+  // functions called by each function, for the purity analysis
+  std::vector<std::vector<int>> callees;
+  std::vector<bool> locallyPure;
+  int currentFunction;
+  // parameter names of the current function, by local index
+  std::vector<std::string> currentParams;
+  bool currentPure;
+  // functions lifted from list comprehensions, the declarations are owned
+  // here and generated after the functions of the unit. Only valid while
+  // visiting the unit, see visit(TranslationUnit&).
+  std::unordered_map<ListCompNode*, int> liftedIds;
+  std::deque<FunctionDecl> liftedDecls;
+  std::deque<std::pair<FunctionDecl*, int>> pendingLifted;
   std::vector<BasicBlock> funbody;
   BasicBlock* tail;
+  // location of the expression being generated
+  Location currentLoc;
   unsigned int currentbb;
   FileHandle currentFile;
 };
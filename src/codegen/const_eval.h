@@ -17,27 +17,54 @@
 #include <cmath>
 #include <optional>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "ast_visitor.h"
+#include "codegen/builtins.h"
 #include "frontend.h"
+#include "vm/numeric.h"
 
 namespace sscad {
-// TODO: handle undef
-// we should also remove unused variables
+// Constant values are NumberNode, BoolNode, StringNode, UndefNode, and
+// ListExprNode/RangeNode with constant elements. Operations on them follow the
+// evaluator semantics. Boolean operators and conditions are only folded on
+// booleans, the evaluator does not cast other values to booleans.
+// Unused globals and functions are removed separately by DeadCodeElim.
 class ConstEvaluator : public ExprMap {
  public:
   using ExprMap::map;
   using ExprMap::visit;
+
+  // File scope variables whose values are replaced after compilation, e.g.
+  // customizer parameters overridden by BatchEvaluator. They are never
+  // inlined, so their readers keep reading the global.
+  void setOverridable(std::unordered_set<std::string> names) {
+    overridable = std::move(names);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(IdentNode& node) override {
+    // config variables are dynamically scoped, never inline them
+    if (node.isConfigVar()) return node.shared_from_this();
+    for (auto scope = variableLookup.rbegin(); scope != variableLookup.rend();
+         ++scope) {
+      auto iter = scope->find(node.name);
+      if (iter == scope->end()) continue;
+      if (iter->second.has_value()) return iter->second.value();
+      break;
+    }
+    return node.shared_from_this();
+  }
+
   virtual std::shared_ptr<ExprNode> map(UnaryOpNode& node) override {
     const auto operand = map(node.operand);
-    auto number = dynamic_cast<NumberNode*>(operand.get());
-    if (number != nullptr) {
-      if (node.op == UnaryOp::NEG)
-        return std::make_shared<NumberNode>(-number->value, node.loc);
-      if (node.op == UnaryOp::NOT)
-        return std::make_shared<NumberNode>(number->value != 0 ? 0 : 1,
-                                            node.loc);
+    if (node.op == UnaryOp::NOT) {
+      if (auto b = dynCast<BoolNode>(operand.get()))
+        return std::make_shared<BoolNode>(!b->value, node.loc);
+    } else if (operand->isConstValue()) {
+      auto number = dynCast<NumberNode>(operand.get());
+      if (number == nullptr) return std::make_shared<UndefNode>(node.loc);
+      return std::make_shared<NumberNode>(-number->value, node.loc);
     }
     return std::make_shared<UnaryOpNode>(operand, node.op, node.loc);
   }
@@ -45,80 +72,174 @@ class ConstEvaluator : public ExprMap {
   virtual std::shared_ptr<ExprNode> map(BinaryOpNode& node) override {
     const auto lhs = map(node.lhs);
     const auto rhs = map(node.rhs);
-    auto lhsNum = dynamic_cast<NumberNode*>(lhs.get());
-    auto rhsNum = dynamic_cast<NumberNode*>(rhs.get());
-    if (lhsNum != nullptr && rhsNum != nullptr) {
-      const double lhs = lhsNum->value;
-      const double rhs = rhsNum->value;
-      double result = 0;
-      switch (node.op) {
-        case BinOp::ADD:
-          result = lhs + rhs;
-          break;
-        case BinOp::SUB:
-          result = lhs - rhs;
-          break;
-        case BinOp::MUL:
-          result = lhs * rhs;
-          break;
-        case BinOp::DIV:
-          if (fabs(rhs) == 0.0)
-            result = NAN;
-          else
-            result = lhs / rhs;
-          break;
-        case BinOp::MOD:
-          if (fabs(rhs) == 0.0)
-            result = NAN;
-          else
-            result = std::fmod(lhs, rhs);
-          break;
-        case BinOp::EXP:
-          result = std::pow(lhs, rhs);
-          break;
-        case BinOp::LT:
-          result = lhs < rhs ? 1 : 0;
-          break;
-        case BinOp::LE:
-          result = lhs <= rhs ? 1 : 0;
-          break;
-        case BinOp::GT:
-          result = lhs > rhs ? 1 : 0;
-          break;
-        case BinOp::GE:
-          result = lhs >= rhs ? 1 : 0;
-          break;
-        case BinOp::EQ:
-          result = lhs == rhs ? 1 : 0;
-          break;
-        case BinOp::NEQ:
-          result = lhs == rhs ? 0 : 1;
-          break;
-        case BinOp::AND:
-          result = (lhs == 0 || rhs == 0) ? 0 : 1;
-          break;
-        case BinOp::OR:
-          result = (lhs == 0 && rhs == 0) ? 0 : 1;
-          break;
-        default:
-          throw std::runtime_error("invalid AST");
-      }
-      return std::make_shared<NumberNode>(result, node.loc);
+    if (lhs->isConstValue() && rhs->isConstValue()) {
+      auto result = evalBinary(*lhs, *rhs, node.op, node.loc);
+      if (result != nullptr) return result;
     }
     return std::make_shared<BinaryOpNode>(lhs, rhs, node.op, node.loc);
   }
 
   virtual std::shared_ptr<ExprNode> map(IfExprNode& node) override {
     const auto cond = map(node.cond);
-    auto number = dynamic_cast<NumberNode*>(cond.get());
-    if (number != nullptr) {
-      if (fabs(number->value) == 0.0) return map(node.ifelse);
-      return map(node.ifthen);
-    }
+    if (auto b = dynCast<BoolNode>(cond.get()))
+      return b->value ? map(node.ifthen) : map(node.ifelse);
     return std::make_shared<IfExprNode>(cond, map(node.ifthen),
                                         map(node.ifelse), node.loc);
   }
 
+  virtual std::shared_ptr<ExprNode> map(CallNode& node) override {
+    std::vector<AssignNode> args;
+    for (auto& arg : node.args)
+      args.emplace_back(arg.ident, map(arg.expr), arg.loc);
+    // function names are not variables, so identifiers are kept as is
+    auto ident = dynCast<IdentNode>(node.fun.get());
+    if (ident == nullptr)
+      return std::make_shared<CallNode>(map(node.fun), args, node.loc);
+    if (args.size() == 1 && args[0].ident.empty() &&
+        args[0].expr->isConstValue() &&
+        functionNames.find(ident->name) == functionNames.end()) {
+      auto iter = builtins.find(ident->name);
+      if (iter != builtins.end()) {
+        auto result = evalBuiltin(iter->second, *args[0].expr, node.loc);
+        if (result != nullptr) return result;
+      }
+    }
+    return std::make_shared<CallNode>(node.fun, args, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(ListExprNode& node) override {
+    std::vector<std::pair<Expr, bool>> elements;
+    for (auto& elem : node.elements) {
+      auto expr = map(elem.first);
+      auto list = dynCast<ListExprNode>(expr.get());
+      // `each` on a list literal is just splicing
+      if (elem.second && list != nullptr)
+        elements.insert(elements.end(), list->elements.begin(),
+                        list->elements.end());
+      else
+        elements.emplace_back(expr, elem.second);
+    }
+    return std::make_shared<ListExprNode>(elements, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(RangeNode& node) override {
+    auto start = map(node.start);
+    auto step = map(node.step);
+    auto end = map(node.end);
+    if (start->isConstValue() && step->isConstValue() && end->isConstValue() &&
+        (!isa<NumberNode>(*start) || !isa<NumberNode>(*step) ||
+         !isa<NumberNode>(*end)))
+      return std::make_shared<UndefNode>(node.loc);
+    return std::make_shared<RangeNode>(start, step, end, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(ListIndexNode& node) override {
+    const auto list = map(node.list);
+    const auto index = map(node.index);
+    if (list->isConstValue() && index->isConstValue())
+      return evalBinary(*list, *index, BinOp::INDEX, node.loc);
+    return std::make_shared<ListIndexNode>(list, index, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(LetNode& node) override {
+    variableLookup.emplace_back();
+    std::vector<AssignNode> bindings;
+    for (auto& binding : node.bindings) {
+      auto expr = map(binding.expr);
+      bind(binding.ident, expr);
+      // constant bindings are inlined, config variables must be kept for the
+      // callees
+      if (!expr->isConstValue() || binding.ident[0] == '$')
+        bindings.emplace_back(binding.ident, expr, binding.loc);
+    }
+    auto expr = map(node.expr);
+    variableLookup.pop_back();
+    if (bindings.empty()) return expr;
+    return std::make_shared<LetNode>(bindings, expr, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(ListCompNode& node) override {
+    std::vector<AssignNode> assignments;
+    std::vector<std::tuple<Expr, Expr, bool>> generators;
+    variableLookup.emplace_back();
+    for (auto& assignment : node.assignments) {
+      assignments.emplace_back(assignment.ident, map(assignment.expr),
+                               assignment.loc);
+      bind(assignment.ident, nullptr);
+    }
+    for (auto& tuple : node.generators)
+      generators.emplace_back(map(std::get<0>(tuple)), map(std::get<1>(tuple)),
+                              std::get<2>(tuple));
+    variableLookup.pop_back();
+    return std::make_shared<ListCompNode>(assignments, generators, node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(ListCompCNode& node) override {
+    std::vector<AssignNode> init, update;
+    std::vector<std::tuple<Expr, Expr, bool>> generators;
+    variableLookup.emplace_back();
+    for (auto& assignment : node.init) {
+      init.emplace_back(assignment.ident, map(assignment.expr),
+                        assignment.loc);
+      bind(assignment.ident, nullptr);
+    }
+    auto cond = map(node.cond);
+    for (auto& assignment : node.update)
+      update.emplace_back(assignment.ident, map(assignment.expr),
+                          assignment.loc);
+    for (auto& tuple : node.generators)
+      generators.emplace_back(map(std::get<0>(tuple)), map(std::get<1>(tuple)),
+                              std::get<2>(tuple));
+    variableLookup.pop_back();
+    return std::make_shared<ListCompCNode>(init, cond, update, generators,
+                                           node.loc);
+  }
+
+  virtual std::shared_ptr<ExprNode> map(LambdaNode& node) override {
+    std::vector<AssignNode> params;
+    for (auto& param : node.params)
+      params.emplace_back(param.ident,
+                          param.expr == nullptr ? nullptr : map(param.expr),
+                          param.loc);
+    variableLookup.emplace_back();
+    for (auto& param : node.params) bind(param.ident, nullptr);
+    auto expr = map(node.expr);
+    variableLookup.pop_back();
+    return std::make_shared<LambdaNode>(params, expr, node.loc);
+  }
+
+  virtual void visit(FunctionDecl& fun) override {
+    for (auto& arg : fun.args)
+      if (arg.expr != nullptr) arg.expr = map(arg.expr);
+    variableLookup.emplace_back();
+    for (auto& arg : fun.args) bind(arg.ident, nullptr);
+    if (fun.body != nullptr) fun.body = map(fun.body);
+    variableLookup.pop_back();
+  }
+
+  virtual void visit(ModuleDecl& module) override {
+    for (auto& arg : module.args)
+      if (arg.expr != nullptr) arg.expr = map(arg.expr);
+    variableLookup.emplace_back();
+    for (auto& arg : module.args) bind(arg.ident, nullptr);
+    visit(module.body);
+    variableLookup.pop_back();
+  }
+
+  virtual void visit(SingleModuleCall& call) override {
+    for (auto& arg : call.args) visit(arg);
+    // arguments of these builtin modules are variables in the body
+    if (call.name != "for" && call.name != "intersection_for" &&
+        call.name != "let") {
+      visit(call.body);
+      return;
+    }
+    variableLookup.emplace_back();
+    for (auto& arg : call.args) bind(arg.ident, nullptr);
+    visit(call.body);
+    variableLookup.pop_back();
+  }
+
   // TODO: store the list of available module, function and variable names, do
   // static checking.
   virtual void visit(ModuleBody& body) override {
@@ -128,6 +249,8 @@ class ConstEvaluator : public ExprMap {
   }
 
   virtual void visit(TranslationUnit& unit) override {
+    functionNames.clear();
+    for (auto& fun : unit.functions) functionNames.insert(fun.name);
     fixAssignments(unit.assignments);
     for (auto& module : unit.modules) {
       visit(module);
@@ -161,18 +284,138 @@ class ConstEvaluator : public ExprMap {
     variableLookup.push_back({});
     for (auto& assign : assignments) {
       visit(assign);
-      // note that we only cache constant values, to avoid inlining making
-      // the code too long
-      variableLookup.back().insert(
-          std::make_pair(assign.ident, assign.expr->isConstValue()
-                                           ? std::make_optional(assign.expr)
-                                           : std::nullopt));
+      bind(assign.ident, assign.expr);
     }
   }
 
  private:
+  // note that we only cache constant values, to avoid inlining making the code
+  // too long. Non-constant bindings are recorded as nullopt to shadow outer
+  // scopes.
+  void bind(const std::string& ident, const Expr& expr) {
+    // the outermost scope is the file scope
+    bool overridden = variableLookup.size() == 1 &&
+                      overridable.find(ident) != overridable.end();
+    if (expr != nullptr && expr->isConstValue() && ident[0] != '$' &&
+        !overridden)
+      variableLookup.back().insert_or_assign(ident, std::make_optional(expr));
+    else
+      variableLookup.back().insert_or_assign(ident, std::nullopt);
+  }
+
+  static bool equals(ExprNode& lhs, ExprNode& rhs) {
+    if (auto a = dynCast<NumberNode>(&lhs)) {
+      auto b = dynCast<NumberNode>(&rhs);
+      return b != nullptr && a->value == b->value;
+    }
+    if (auto a = dynCast<BoolNode>(&lhs)) {
+      auto b = dynCast<BoolNode>(&rhs);
+      return b != nullptr && a->value == b->value;
+    }
+    if (auto a = dynCast<StringNode>(&lhs)) {
+      auto b = dynCast<StringNode>(&rhs);
+      return b != nullptr && a->str == b->str;
+    }
+    if (isa<UndefNode>(lhs))
+      return isa<UndefNode>(rhs);
+    if (auto a = dynCast<ListExprNode>(&lhs)) {
+      auto b = dynCast<ListExprNode>(&rhs);
+      if (b == nullptr || a->elements.size() != b->elements.size())
+        return false;
+      for (size_t i = 0; i < a->elements.size(); i++)
+        if (!equals(*a->elements[i].first, *b->elements[i].first)) return false;
+      return true;
+    }
+    if (auto a = dynCast<RangeNode>(&lhs)) {
+      auto b = dynCast<RangeNode>(&rhs);
+      return b != nullptr && equals(*a->start, *b->start) &&
+             equals(*a->step, *b->step) && equals(*a->end, *b->end);
+    }
+    return false;
+  }
+
+  // returns nullptr if the operation cannot be evaluated at compile time
+  static Expr evalBinary(ExprNode& lhs, ExprNode& rhs, BinOp op,
+                         Location loc) {
+    switch (op) {
+      case BinOp::EQ:
+        return std::make_shared<BoolNode>(equals(lhs, rhs), loc);
+      case BinOp::NEQ:
+        return std::make_shared<BoolNode>(!equals(lhs, rhs), loc);
+      case BinOp::AND:
+      case BinOp::OR: {
+        auto a = dynCast<BoolNode>(&lhs);
+        auto b = dynCast<BoolNode>(&rhs);
+        if (a == nullptr || b == nullptr) return nullptr;
+        return std::make_shared<BoolNode>(
+            op == BinOp::AND ? a->value && b->value : a->value || b->value,
+            loc);
+      }
+      case BinOp::INDEX: {
+        auto list = dynCast<ListExprNode>(&lhs);
+        auto index = dynCast<NumberNode>(&rhs);
+        if (list == nullptr || index == nullptr || !(index->value >= 0) ||
+            index->value >= list->elements.size())
+          return std::make_shared<UndefNode>(loc);
+        return list->elements[static_cast<size_t>(index->value)].first;
+      }
+      case BinOp::APPEND:
+      case BinOp::CONCAT:
+        return nullptr;
+      default:
+        break;
+    }
+    auto lhsNum = dynCast<NumberNode>(&lhs);
+    auto rhsNum = dynCast<NumberNode>(&rhs);
+    if (lhsNum == nullptr || rhsNum == nullptr)
+      return std::make_shared<UndefNode>(loc);
+    const double a = lhsNum->value;
+    const double b = rhsNum->value;
+    switch (op) {
+      case BinOp::ADD:
+        return std::make_shared<NumberNode>(a + b, loc);
+      case BinOp::SUB:
+        return std::make_shared<NumberNode>(a - b, loc);
+      case BinOp::MUL:
+        return std::make_shared<NumberNode>(a * b, loc);
+      case BinOp::DIV:
+        return std::make_shared<NumberNode>(a / b, loc);
+      case BinOp::MOD:
+        return std::make_shared<NumberNode>(std::fmod(a, b), loc);
+      case BinOp::EXP:
+        return std::make_shared<NumberNode>(std::pow(a, b), loc);
+      case BinOp::LT:
+        return std::make_shared<BoolNode>(a < b, loc);
+      case BinOp::LE:
+        return std::make_shared<BoolNode>(a <= b, loc);
+      case BinOp::GT:
+        return std::make_shared<BoolNode>(a > b, loc);
+      case BinOp::GE:
+        return std::make_shared<BoolNode>(a >= b, loc);
+      default:
+        throw std::runtime_error("invalid AST");
+    }
+  }
+
+  // returns nullptr if the builtin cannot be evaluated at compile time
+  static Expr evalBuiltin(BuiltinUnary op, ExprNode& arg, Location loc) {
+    if (op == BuiltinUnary::NORM) return nullptr;
+    if (op == BuiltinUnary::LEN) {
+      auto list = dynCast<ListExprNode>(&arg);
+      if (list == nullptr) return nullptr;
+      return std::make_shared<NumberNode>(list->elements.size(), loc);
+    }
+    if (!isNumericUnary(op)) return nullptr;
+    auto number = dynCast<NumberNode>(&arg);
+    if (number == nullptr) return std::make_shared<UndefNode>(loc);
+    return std::make_shared<NumberNode>(numericUnary(number->value, op), loc);
+  }
+
   std::vector<std::unordered_map<std::string, std::optional<Expr>>>
       variableLookup;
+  // user defined functions shadow builtins
+  std::unordered_set<std::string> functionNames;
+  std::unordered_set<std::string> overridable;
   std::vector<std::pair<Location, std::string>> warnings;
 };
 }  // namespace sscad
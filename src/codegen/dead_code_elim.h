@@ -0,0 +1,274 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "ast_visitor.h"
+#include "codegen/builtins.h"
+#include "frontend.h"
+
+namespace sscad {
+struct DeadCodeStats {
+  size_t functions = 0;
+  size_t modules = 0;
+  size_t assignments = 0;
+};
+
+/**
+ * Whole program reachability over all the parsed translation units.
+ * Starting from the module calls of the root unit, we mark the functions,
+ * modules and global assignments that can be referenced, and remove everything
+ * else before codegen.
+ *
+ * Name resolution follows the evaluator: functions and modules are looked up
+ * in the current unit and the units it uses, globals only in the current unit.
+ * Local shadowing is ignored, which only makes the result conservative.
+ *
+ * Globals of the root unit whose initializer may have side effects are kept
+ * even if they are never read: echo and assert, calls to functions with side
+ * effects, and calls of function values, which we cannot follow.
+ *
+ * Bodies skipped by Frontend::setLazyBodies are parsed when their declaration
+ * is found to be live, or when a global initializer calls it, so the bodies of
+ * other dead declarations are never parsed.
+ */
+class DeadCodeElim : public AstVisitor {
+ public:
+  using AstVisitor::visit;
+
+  DeadCodeStats run(Frontend &frontend, FileHandle root) {
+    infos.clear();
+    worklist.clear();
+    for (auto &[file, unit] : frontend.units) {
+      auto &info = infos.insert({file, UnitInfo{&unit}}).first->second;
+      for (size_t i = 0; i < unit.functions.size(); i++)
+        info.functions.insert({unit.functions[i].name, i});
+      for (size_t i = 0; i < unit.modules.size(); i++)
+        info.modules.insert({unit.modules[i].name, i});
+      for (size_t i = 0; i < unit.assignments.size(); i++)
+        info.globals.insert({unit.assignments[i].ident, i});
+      info.liveFunctions.resize(unit.functions.size(), false);
+      info.liveModules.resize(unit.modules.size(), false);
+      info.liveGlobals.resize(unit.assignments.size(), false);
+      info.pureFunctions.resize(unit.functions.size(), false);
+    }
+
+    auto &rootInfo = infos.at(root);
+    currentFile = root;
+    // config variables are dynamically scoped, we cannot tell who reads them
+    EffectFinder effects(*this, frontend);
+    for (size_t i = 0; i < rootInfo.unit->assignments.size(); i++) {
+      auto &assign = rootInfo.unit->assignments[i];
+      if (assign.ident[0] == '$' || effects.check(root, assign.expr))
+        mark(root, Kind::GLOBAL, i);
+    }
+    for (auto &call : rootInfo.unit->moduleCalls) visit(call);
+
+    while (!worklist.empty()) {
+      auto item = worklist.back();
+      worklist.pop_back();
+      currentFile = item.file;
+      auto unit = infos.at(item.file).unit;
+      switch (item.kind) {
+        case Kind::FUNCTION:
+          frontend.parseBody(*unit, unit->functions[item.index]);
+          visit(unit->functions[item.index]);
+          break;
+        case Kind::MODULE:
+          frontend.parseBody(*unit, unit->modules[item.index]);
+          visit(unit->modules[item.index]);
+          break;
+        case Kind::GLOBAL:
+          visit(unit->assignments[item.index]);
+          break;
+      }
+    }
+
+    DeadCodeStats stats;
+    for (auto &[file, info] : infos) {
+      stats.functions += removeDead(info.unit->functions, info.liveFunctions);
+      stats.modules += removeDead(info.unit->modules, info.liveModules);
+      stats.assignments +=
+          removeDead(info.unit->assignments, info.liveGlobals);
+    }
+    infos.clear();
+    return stats;
+  }
+
+  virtual void visit(IdentNode &node) override { markGlobal(node.name); }
+
+  virtual void visit(CallNode &node) override {
+    auto ident = dynCast<IdentNode>(node.fun.get());
+    if (ident != nullptr) {
+      markCallable(Kind::FUNCTION, ident->name);
+      // the callee can also be a variable holding a function literal
+      markGlobal(ident->name);
+    } else {
+      visit(node.fun);
+    }
+    for (auto &arg : node.args) visit(arg);
+  }
+
+  virtual void visit(SingleModuleCall &node) override {
+    markCallable(Kind::MODULE, node.name);
+    AstVisitor::visit(node);
+  }
+
+ private:
+  enum class Kind { FUNCTION, MODULE, GLOBAL };
+
+  struct UnitInfo {
+    TranslationUnit *unit;
+    std::unordered_multimap<std::string, size_t> functions;
+    std::unordered_multimap<std::string, size_t> modules;
+    std::unordered_multimap<std::string, size_t> globals;
+    std::vector<bool> liveFunctions;
+    std::vector<bool> liveModules;
+    std::vector<bool> liveGlobals;
+    // functions known to have no side effects
+    std::vector<bool> pureFunctions;
+  };
+
+  struct WorkItem {
+    FileHandle file;
+    Kind kind;
+    size_t index;
+  };
+
+  // Finds side effects of an expression, following calls with the same name
+  // resolution as DeadCodeElim. Recursive calls are assumed to have no effects
+  // until one is found.
+  class EffectFinder : public AstVisitor {
+   public:
+    using AstVisitor::visit;
+
+    EffectFinder(DeadCodeElim &elim, Frontend &frontend)
+        : elim(elim), frontend(frontend) {}
+
+    bool check(FileHandle file, Expr &expr) {
+      found = false;
+      currentFile = file;
+      visit(expr);
+      // the functions visited only have effects if the expression has
+      if (!found)
+        for (auto &[unit, index] : visited)
+          elim.infos.at(unit).pureFunctions[index] = true;
+      visited.clear();
+      return found;
+    }
+
+    virtual void visit(CallNode &node) override {
+      if (found) return;
+      for (auto &arg : node.args) visit(arg);
+      auto ident = dynCast<IdentNode>(node.fun.get());
+      if (ident == nullptr || ident->name == "echo" ||
+          ident->name == "assert") {
+        found = true;
+        return;
+      }
+      const FileHandle file = currentFile;
+      bool resolved = false;
+      auto checkIn = [&](FileHandle target) {
+        auto iter = elim.infos.find(target);
+        if (iter == elim.infos.end()) return;
+        auto range = iter->second.functions.equal_range(ident->name);
+        for (auto it = range.first; it != range.second; ++it) {
+          resolved = true;
+          checkFunction(target, it->second);
+        }
+      };
+      checkIn(file);
+      for (auto use : elim.infos.at(file).unit->uses) checkIn(use);
+      currentFile = file;
+      // anything else is a function value
+      if (!resolved && builtins.find(ident->name) == builtins.end())
+        found = true;
+    }
+
+    // defining a function value has no effect, calling it is handled above
+    virtual void visit(LambdaNode &node) override {}
+
+   private:
+    void checkFunction(FileHandle file, size_t index) {
+      auto &info = elim.infos.at(file);
+      if (found || info.pureFunctions[index] ||
+          !visited.insert({file, index}).second)
+        return;
+      auto &fun = info.unit->functions[index];
+      frontend.parseBody(*info.unit, fun);
+      currentFile = file;
+      visit(fun);
+    }
+
+    DeadCodeElim &elim;
+    Frontend &frontend;
+    FileHandle currentFile;
+    std::set<std::pair<FileHandle, size_t>> visited;
+    bool found = false;
+  };
+
+  void mark(FileHandle file, Kind kind, size_t index) {
+    auto &info = infos.at(file);
+    auto &live = kind == Kind::FUNCTION ? info.liveFunctions
+                 : kind == Kind::MODULE ? info.liveModules
+                                        : info.liveGlobals;
+    if (live[index]) return;
+    live[index] = true;
+    worklist.push_back({file, kind, index});
+  }
+
+  void markGlobal(const std::string &name) {
+    auto range = infos.at(currentFile).globals.equal_range(name);
+    for (auto iter = range.first; iter != range.second; ++iter)
+      mark(currentFile, Kind::GLOBAL, iter->second);
+  }
+
+  // functions and modules are visible from the current unit and the used units
+  void markCallable(Kind kind, const std::string &name) {
+    auto markIn = [&](FileHandle file) {
+      auto iter = infos.find(file);
+      if (iter == infos.end()) return;
+      auto &map = kind == Kind::FUNCTION ? iter->second.functions
+                                         : iter->second.modules;
+      auto range = map.equal_range(name);
+      for (auto it = range.first; it != range.second; ++it)
+        mark(file, kind, it->second);
+    };
+    markIn(currentFile);
+    for (auto use : infos.at(currentFile).unit->uses) markIn(use);
+  }
+
+  template <typename T>
+  static size_t removeDead(std::vector<T> &decls,
+                           const std::vector<bool> &live) {
+    size_t j = 0;
+    for (size_t i = 0; i < decls.size(); i++) {
+      if (!live[i]) continue;
+      if (i != j) decls[j] = std::move(decls[i]);
+      j++;
+    }
+    size_t removed = decls.size() - j;
+    decls.erase(decls.begin() + j, decls.end());
+    return removed;
+  }
+
+  std::unordered_map<FileHandle, UnitInfo> infos;
+  std::vector<WorkItem> worklist;
+  FileHandle currentFile;
+};
+}  // namespace sscad
@@ -15,13 +15,17 @@
  */
 #pragma once
 #include <functional>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "ast.h"
+#include "utils/arena.h"
 
 namespace sscad {
 class Scanner;
+class ParseCache;
 
 /**
  * A translation unit, usually a single file but can include other files.
@@ -30,34 +34,148 @@ class Scanner;
 struct TranslationUnit {
   TranslationUnit(FileHandle file) : file(file) {}
 
+  // AST nodes created by the parser are allocated in the arena, which is
+  // shared by copies of the unit and kept alive by the nodes.
+  std::shared_ptr<Arena> arena = std::make_shared<Arena>();
   std::unordered_set<FileHandle> uses;
   std::vector<ModuleDecl> modules;
   std::vector<FunctionDecl> functions;
   std::vector<AssignNode> assignments;
   std::vector<std::shared_ptr<ModuleCall>> moduleCalls;
+  // locations of the include statements, see Location::Position::include
+  std::vector<Location> includes;
   FileHandle file;
+
+  template <typename T, typename... Args>
+  std::shared_ptr<T> make(Args &&...args) {
+    return std::allocate_shared<T>(ArenaAllocator<T>(arena),
+                                   std::forward<Args>(args)...);
+  }
+
+  // the include statements leading to pos, innermost first
+  std::vector<Location> includeChain(const Location::Position &pos) const {
+    std::vector<Location> chain;
+    for (uint32_t i = pos.include; i != 0; i = includes[i - 1].begin.include)
+      chain.push_back(includes[i - 1]);
+    return chain;
+  }
+};
+
+// Declarations changed by Frontend::reparse. Changed, added and moved
+// declarations are indices into the new unit, removed ones are names that are
+// no longer declared.
+struct UnitChanges {
+  std::vector<size_t> functions;
+  std::vector<size_t> modules;
+  std::vector<size_t> assignments;
+  // Declarations that are unchanged except for their locations, e.g. after
+  // inserting a line above them. Their code can be kept, but their line
+  // tables and error locations have to be updated.
+  std::vector<size_t> movedFunctions;
+  std::vector<size_t> movedModules;
+  std::vector<size_t> movedAssignments;
+  std::vector<std::string> removedFunctions;
+  std::vector<std::string> removedModules;
+  std::vector<std::string> removedAssignments;
+  // the top-level module calls changed or moved
+  bool moduleCalls = false;
+  // files used for the first time by the new unit, reparse parses them
+  std::vector<FileHandle> newUses;
 };
 
 /**
  * Parser frontend that handles use etc.
+ *
+ * Used files are independent of each other, so they are parsed concurrently.
+ * The resolver and the provider are never invoked concurrently, but they may
+ * be invoked from different threads.
  */
 class Frontend {
  public:
   // first parameter: filename to be included/used
   // second parameter: source file handle for the include/use statement
   using FileResolver = std::function<FileHandle(std::string, FileHandle)>;
-  // provide the input stream given a file handle
+  // provide the input stream given a file handle, SourceStream avoids copies
+  // for large files
   using FileProvider = std::function<std::shared_ptr<std::istream>(FileHandle)>;
 
-  Frontend(FileResolver resolver, FileProvider provider);
+  // threads: maximum number of threads used for parsing, 0 for the number of
+  // hardware threads
+  Frontend(FileResolver resolver, FileProvider provider,
+           unsigned int threads = 0);
 
+  // parse the file and all the files it uses, directly or indirectly.
+  // Files that were parsed before are not parsed again.
   TranslationUnit& parse(FileHandle file);
   std::unordered_map<FileHandle, TranslationUnit> units;
 
+  // Skip the bodies of function and module declarations when parsing, and
+  // only keep their source text. They are parsed on demand by parseBody, so
+  // the bodies of unused declarations are never parsed. Syntax errors in a
+  // body are reported when it is parsed. Disabled by default.
+  void setLazyBodies(bool lazy) { lazyBodies = lazy; }
+  // Parse the body of a declaration of the unit if it was skipped, and the
+  // files it uses. Does nothing if the body is already parsed.
+  void parseBody(TranslationUnit& unit, FunctionDecl& fun);
+  void parseBody(TranslationUnit& unit, ModuleDecl& module);
+  // parse every skipped body of every unit
+  void parseBodies();
+
+  // Reuse the units parsed by other frontends sharing the cache, see
+  // ParseCache. nullptr disables caching, which is the default.
+  void setParseCache(std::shared_ptr<ParseCache> cache) {
+    this->cache = std::move(cache);
+  }
+
+  // Keep hashes of the declarations of every unit parsed from now on, for
+  // reparse. Disabled by default.
+  void setIncremental(bool incremental) { this->incremental = incremental; }
+  // Parse an edited file again and replace its unit. Reports the
+  // declarations that changed compared to the previous parse, so callers can
+  // regenerate only those and their dependents. With lazy bodies, only the
+  // bodies of changed declarations need to be parsed afterwards.
+  // Declarations that only moved are reported separately.
+  // Everything is reported as changed if the previous parse was not
+  // incremental.
+  UnitChanges reparse(FileHandle file);
+
   friend Scanner;
 
  private:
+  void parseUnit(TranslationUnit& unit);
+  template <typename T>
+  T parseLazy(TranslationUnit& unit, std::shared_ptr<const LazyBody> body);
+  // thread-safe wrappers for the resolver and the provider
+  FileHandle resolve(const std::string& name, FileHandle src);
+  std::shared_ptr<std::istream> open(FileHandle file);
+
   FileProvider provider;
   FileResolver resolver;
+  unsigned int threads;
+  bool lazyBodies = false;
+  std::shared_ptr<ParseCache> cache;
+
+  // name, structural hash and location hash of each declaration, in unit
+  // order
+  struct DeclHash {
+    std::string name;
+    uint64_t hash;
+    uint64_t locations;
+  };
+  using DeclHashes = std::vector<DeclHash>;
+  struct UnitHashes {
+    DeclHashes functions;
+    DeclHashes modules;
+    DeclHashes assignments;
+    // locations included
+    uint64_t moduleCalls;
+  };
+  bool incremental = false;
+  std::unordered_map<FileHandle, UnitHashes> hashes;
+  static UnitHashes hashUnit(const TranslationUnit& unit);
+  static void compare(const DeclHashes& old, const DeclHashes& now,
+                      std::vector<size_t>& changed, std::vector<size_t>& moved,
+                      std::vector<std::string>& removed);
+  std::mutex callbackMutex;
 };
 }  // namespace sscad
@@ -14,29 +14,31 @@
  * limitations under the License.
  */
 #pragma once
-#include <memory>
+#include <cstdint>
 #include <ostream>
 #include <string>
 
 namespace sscad {
 using FileHandle = unsigned long;
 
+// Locations are copied with every token and stored in every AST node, so they
+// are kept small and trivially copyable.
 struct Location {
   struct Position {
-    // parent is the parent file that includes the current file
-    // there can be a chain of parents
-    std::shared_ptr<Location> parent = nullptr;
     FileHandle src = 0;
-    long line = 1;
-    long column = 1;
+    // Positions inside an included file refer to the include statement by
+    // index + 1 into TranslationUnit::includes, 0 means not included.
+    uint32_t include = 0;
+    int line = 1;
+    int column = 1;
   };
 
   Position begin;
   Position end;
 
   void step() { begin = end; }
-  void columns(long count = 1) { end.column += count; }
-  void lines(long count = 1) {
+  void columns(int count = 1) { end.column += count; }
+  void lines(int count = 1) {
     if (count) end.column = 1;
     end.line += count;
   }
@@ -52,6 +54,20 @@ struct Location {
   }
 };
 
+inline bool operator==(const Location::Position &lhs,
+                       const Location::Position &rhs) {
+  return lhs.src == rhs.src && lhs.include == rhs.include &&
+         lhs.line == rhs.line && lhs.column == rhs.column;
+}
+
+inline bool operator==(const Location &lhs, const Location &rhs) {
+  return lhs.begin == rhs.begin && lhs.end == rhs.end;
+}
+
+inline bool operator!=(const Location &lhs, const Location &rhs) {
+  return !(lhs == rhs);
+}
+
 inline std::ostream &operator<<(std::ostream &os,
                                 const Location::Position &pos) {
   return os << pos.src << ":" << pos.line << ":" << pos.column;
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "frontend.h"
+
+namespace sscad {
+struct ParseCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+/**
+ * Parsed translation units that outlive a frontend, see
+ * Frontend::setParseCache. A server that creates a frontend per request can
+ * share one cache between them, so unchanged libraries are not parsed again.
+ *
+ * A unit is reused if the content of its file, the content of the files it
+ * includes and the resolution of its use and include statements are all the
+ * same as when it was parsed. Each file has at most one entry, the entry of a
+ * changed file is replaced after it is parsed again.
+ *
+ * Passes like ConstEvaluator modify the AST in place, so units are cloned into
+ * and out of the cache. Thread-safe.
+ */
+class ParseCache {
+ public:
+  // what a unit depends on besides the content of its file
+  struct Dependencies {
+    struct Resolution {
+      std::string name;
+      FileHandle src;
+      FileHandle file;
+    };
+    std::vector<Resolution> resolutions;
+    // included files and their content hashes
+    std::vector<std::pair<FileHandle, uint64_t>> includes;
+  };
+
+  // 64-bit FNV-1a, only used to detect changes
+  static uint64_t hash(const char *data, size_t size);
+
+  ParseCacheStats stats() const;
+  void clear();
+
+ private:
+  friend Frontend;
+
+  struct Entry {
+    uint64_t hash;
+    bool lazyBodies;
+    Dependencies dependencies;
+    TranslationUnit unit;
+  };
+
+  // upToDate is called without holding the lock
+  std::shared_ptr<const Entry> find(
+      FileHandle file, uint64_t hash, bool lazyBodies,
+      const std::function<bool(const Dependencies &)> &upToDate);
+  void insert(std::shared_ptr<const Entry> entry);
+
+  mutable std::mutex mutex;
+  std::unordered_map<FileHandle, std::shared_ptr<const Entry>> entries;
+  ParseCacheStats counters;
+};
+}  // namespace sscad
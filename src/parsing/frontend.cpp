@@ -15,30 +15,291 @@
  */
 #include "frontend.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <thread>
+#include <type_traits>
+
+#include "parse_cache.h"
 #include "scanner.h"
+#include "source_stream.h"
+#include "utils/ast_clone.h"
+#include "utils/ast_hash.h"
 
 namespace sscad {
 
-Frontend::Frontend(FileResolver resolver, FileProvider provider)
-    : resolver(resolver), provider(provider) {}
+Frontend::Frontend(FileResolver resolver, FileProvider provider,
+                   unsigned int threads)
+    : resolver(resolver), provider(provider), threads(threads) {
+  if (this->threads == 0)
+    this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
 
-TranslationUnit& Frontend::parse(FileHandle file) {
-  auto pair = units.insert({file, TranslationUnit(file)});
-  if (!pair.second) return pair.first->second;
+FileHandle Frontend::resolve(const std::string& name, FileHandle src) {
+  std::lock_guard<std::mutex> guard(callbackMutex);
+  return resolver(name, src);
+}
 
-  auto& unit = pair.first->second;
+std::shared_ptr<std::istream> Frontend::open(FileHandle file) {
+  std::lock_guard<std::mutex> guard(callbackMutex);
+  return provider(file);
+}
 
-  auto stream = provider(file);
+void Frontend::parseUnit(TranslationUnit& unit) {
+  auto stream = open(unit.file);
   assert(stream != nullptr);
+  if (cache == nullptr) {
+    Scanner scanner(*this, unit, std::move(stream), lazyBodies);
+    Parser parser(scanner, unit);
+    parser.parse();
+    return;
+  }
+
+  auto source = SourceStream::read(std::move(stream));
+  uint64_t hash = ParseCache::hash(source->data(), source->size());
+  auto upToDate = [&](const ParseCache::Dependencies& dependencies) {
+    try {
+      for (const auto& r : dependencies.resolutions)
+        if (resolve(r.name, r.src) != r.file) return false;
+      for (const auto& [file, includeHash] : dependencies.includes) {
+        auto include = SourceStream::read(open(file));
+        if (ParseCache::hash(include->data(), include->size()) != includeHash)
+          return false;
+      }
+    } catch (const std::exception&) {
+      // parse again to report the error
+      return false;
+    }
+    return true;
+  };
+  auto entry = cache->find(unit.file, hash, lazyBodies, upToDate);
+  if (entry != nullptr) {
+    unit = clone(entry->unit);
+    return;
+  }
+
+  ParseCache::Dependencies dependencies;
+  Scanner scanner(*this, unit, std::move(source), lazyBodies);
+  scanner.dependencies = &dependencies;
+  Parser parser(scanner, unit);
+  parser.parse();
+  cache->insert(std::make_shared<ParseCache::Entry>(ParseCache::Entry{
+      hash, lazyBodies, std::move(dependencies), clone(unit)}));
+}
+
+TranslationUnit& Frontend::parse(FileHandle file) {
+  auto iter = units.find(file);
+  if (iter != units.end()) return iter->second;
+
+  auto root = std::make_unique<TranslationUnit>(file);
+  parseUnit(*root);
+
+  // Parse the used files on a pool of threads. Every file is parsed once, and
+  // the results are only added to units at the end, in file handle order.
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<FileHandle> queue;
+  std::unordered_set<FileHandle> seen{file};
+  std::map<FileHandle, std::unique_ptr<TranslationUnit>> parsed;
+  std::map<FileHandle, std::exception_ptr> errors;
+  int active = 0;
+
+  // must be called with the mutex held
+  auto enqueueUses = [&](const TranslationUnit& unit) {
+    for (auto use : unit.uses)
+      if (units.find(use) == units.end() && seen.insert(use).second)
+        queue.push_back(use);
+  };
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] { return !queue.empty() || active == 0; });
+      if (queue.empty()) break;
+      auto unit = std::make_unique<TranslationUnit>(queue.front());
+      queue.pop_front();
+      active++;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        parseUnit(*unit);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      active--;
+      if (error)
+        errors.emplace(unit->file, error);
+      else
+        enqueueUses(*unit);
+      parsed.emplace(unit->file, std::move(unit));
+      cv.notify_all();
+    }
+  };
+
+  enqueueUses(*root);
+  if (!queue.empty()) {
+    std::vector<std::thread> helpers;
+    for (unsigned int i = 1; i < threads && i < queue.size() + 1; i++)
+      helpers.emplace_back(worker);
+    worker();
+    for (auto& helper : helpers) helper.join();
+  }
+  // report the same error regardless of scheduling
+  if (!errors.empty()) std::rethrow_exception(errors.begin()->second);
 
-  Scanner scanner(*this, unit, std::move(stream));
+  for (auto& [handle, unit] : parsed) {
+    if (incremental) hashes[handle] = hashUnit(*unit);
+    units.insert({handle, std::move(*unit)});
+  }
+  if (incremental) hashes[file] = hashUnit(*root);
+  return units.insert({file, std::move(*root)}).first->second;
+}
+
+Frontend::UnitHashes Frontend::hashUnit(const TranslationUnit& unit) {
+  UnitHashes result;
+  for (const auto& fun : unit.functions)
+    result.functions.push_back({fun.name, hash(fun), hash(fun, true)});
+  for (const auto& module : unit.modules)
+    result.modules.push_back({module.name, hash(module), hash(module, true)});
+  for (const auto& assign : unit.assignments)
+    result.assignments.push_back(
+        {assign.ident, hash(assign), hash(assign, true)});
+  result.moduleCalls = unit.moduleCalls.size();
+  for (const auto& call : unit.moduleCalls)
+    result.moduleCalls = result.moduleCalls * 31 + hash(*call, true);
+  return result;
+}
+
+// A new declaration is unchanged if an old one has the same name and hash,
+// and moved if only the locations of the old one differ.
+void Frontend::compare(const DeclHashes& old, const DeclHashes& now,
+                       std::vector<size_t>& changed,
+                       std::vector<size_t>& moved,
+                       std::vector<std::string>& removed) {
+  std::map<std::pair<std::string, uint64_t>, std::multiset<uint64_t>>
+      unmatched;
+  std::unordered_set<std::string> names;
+  for (const auto& decl : old)
+    unmatched[{decl.name, decl.hash}].insert(decl.locations);
+  // exact matches first, so duplicates that did not move are not reported
+  std::vector<size_t> inexact;
+  for (size_t i = 0; i < now.size(); i++) {
+    names.insert(now[i].name);
+    auto iter = unmatched.find({now[i].name, now[i].hash});
+    if (iter == unmatched.end()) {
+      changed.push_back(i);
+      continue;
+    }
+    auto exact = iter->second.find(now[i].locations);
+    if (exact != iter->second.end())
+      iter->second.erase(exact);
+    else
+      inexact.push_back(i);
+  }
+  for (size_t i : inexact) {
+    auto& locations = unmatched[{now[i].name, now[i].hash}];
+    if (locations.empty()) {
+      changed.push_back(i);
+    } else {
+      locations.erase(locations.begin());
+      moved.push_back(i);
+    }
+  }
+  std::sort(changed.begin(), changed.end());
+  for (const auto& decl : old)
+    if (names.insert(decl.name).second) removed.push_back(decl.name);
+}
+
+UnitChanges Frontend::reparse(FileHandle file) {
+  UnitChanges changes;
+  auto iter = units.find(file);
+  auto oldHashes = hashes.find(file);
+  if (iter == units.end() || oldHashes == hashes.end()) {
+    if (iter != units.end()) units.erase(iter);
+    auto& unit = parse(file);
+    for (size_t i = 0; i < unit.functions.size(); i++)
+      changes.functions.push_back(i);
+    for (size_t i = 0; i < unit.modules.size(); i++)
+      changes.modules.push_back(i);
+    for (size_t i = 0; i < unit.assignments.size(); i++)
+      changes.assignments.push_back(i);
+    changes.moduleCalls = true;
+    return changes;
+  }
+
+  TranslationUnit unit(file);
+  parseUnit(unit);
+  auto newHashes = hashUnit(unit);
+  compare(oldHashes->second.functions, newHashes.functions, changes.functions,
+          changes.movedFunctions, changes.removedFunctions);
+  compare(oldHashes->second.modules, newHashes.modules, changes.modules,
+          changes.movedModules, changes.removedModules);
+  compare(oldHashes->second.assignments, newHashes.assignments,
+          changes.assignments, changes.movedAssignments,
+          changes.removedAssignments);
+  changes.moduleCalls = oldHashes->second.moduleCalls != newHashes.moduleCalls;
+  for (auto use : unit.uses)
+    if (units.find(use) == units.end()) changes.newUses.push_back(use);
+  oldHashes->second = std::move(newHashes);
+  iter->second = std::move(unit);
+  for (auto use : changes.newUses) parse(use);
+  return changes;
+}
+
+template <typename T>
+T Frontend::parseLazy(TranslationUnit& unit,
+                      std::shared_ptr<const LazyBody> body) {
+  constexpr bool module = std::is_same_v<T, ModuleBody>;
+  Location::Position start = body->loc.begin;
+  // the stream reads the source text in place
+  const std::string& source = body->source;
+  auto stream = std::make_shared<SourceStream>(source.data(), source.size(),
+                                               std::move(body));
+  Scanner scanner(*this, unit, std::move(stream), start,
+                  module ? Parser::token::START_MODULE_BODY
+                         : Parser::token::START_FUNCTION_BODY);
+  size_t uses = unit.uses.size();
   Parser parser(scanner, unit);
   parser.parse();
+  // the body can include files that use other files
+  if (unit.uses.size() != uses) {
+    std::vector<FileHandle> files(unit.uses.begin(), unit.uses.end());
+    for (auto file : files) parse(file);
+  }
+  if constexpr (module)
+    return scanner.moduleBody;
+  else
+    return scanner.bodyExpr;
+}
+
+void Frontend::parseBody(TranslationUnit& unit, FunctionDecl& fun) {
+  if (fun.lazyBody == nullptr) return;
+  fun.body = parseLazy<Expr>(unit, fun.lazyBody);
+  fun.lazyBody = nullptr;
+}
+
+void Frontend::parseBody(TranslationUnit& unit, ModuleDecl& module) {
+  if (module.lazyBody == nullptr) return;
+  module.body = parseLazy<ModuleBody>(unit, module.lazyBody);
+  module.lazyBody = nullptr;
+}
 
-  for (const auto use : unit.uses) {
-    parse(use);
+void Frontend::parseBodies() {
+  // parsing a body can add units, which are handled in the next round
+  std::unordered_set<FileHandle> done;
+  while (done.size() != units.size()) {
+    std::vector<FileHandle> files;
+    for (auto& [file, unit] : units)
+      if (done.insert(file).second) files.push_back(file);
+    for (auto file : files) {
+      auto& unit = units.at(file);
+      for (auto& fun : unit.functions) parseBody(unit, fun);
+      for (auto& module : unit.modules) parseBody(unit, module);
+    }
   }
-  return unit;
 }
 
 }  // namespace sscad
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "parse_cache.h"
+
+namespace sscad {
+
+uint64_t ParseCache::hash(const char *data, size_t size) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+ParseCacheStats ParseCache::stats() const {
+  std::lock_guard<std::mutex> guard(mutex);
+  return counters;
+}
+
+void ParseCache::clear() {
+  std::lock_guard<std::mutex> guard(mutex);
+  entries.clear();
+}
+
+std::shared_ptr<const ParseCache::Entry> ParseCache::find(
+    FileHandle file, uint64_t hash, bool lazyBodies,
+    const std::function<bool(const Dependencies &)> &upToDate) {
+  std::shared_ptr<const Entry> entry;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    auto iter = entries.find(file);
+    if (iter != entries.end() && iter->second->hash == hash &&
+        iter->second->lazyBodies == lazyBodies)
+      entry = iter->second;
+  }
+  // checking the dependencies calls the resolver and the provider, which can
+  // be slow, and the entry is immutable anyway
+  if (entry != nullptr && !upToDate(entry->dependencies)) entry = nullptr;
+  std::lock_guard<std::mutex> guard(mutex);
+  if (entry != nullptr)
+    counters.hits++;
+  else
+    counters.misses++;
+  return entry;
+}
+
+void ParseCache::insert(std::shared_ptr<const Entry> entry) {
+  std::lock_guard<std::mutex> guard(mutex);
+  entries[entry->unit.file] = std::move(entry);
+}
+
+}  // namespace sscad
@@ -46,6 +46,7 @@ using namespace sscad;
 #define YYMAXDEPTH 20000
 #define yylex(scanner) scanner.getNextToken()
 std::shared_ptr<ModuleCall> makeModifier(
+   TranslationUnit &unit,
    std::string modifier,
    std::shared_ptr<ModuleCall> child,
    Location loc);
@@ -56,6 +57,8 @@ std::shared_ptr<ModuleCall> makeModifier(
 %token END 0 "EOF"
 %token NOT COMMA ASSIGN LPAREN RPAREN COLON SEMI QUESTION
 %token LSQUARE RSQUARE LBRACE RBRACE HASH DOT
+%token START_FUNCTION_BODY START_MODULE_BODY
+%token <std::string> LAZY_BODY
 %token <std::string> ID
 %token <std::string> STRING
 %token <double> NUMBER
@@ -86,6 +89,14 @@ std::shared_ptr<ModuleCall> makeModifier(
 
 %%
 
+  /* bodies skipped by the scanner are parsed later, see Frontend::parseBody */
+start   : input
+        | START_FUNCTION_BODY expr
+          { scanner.bodyExpr = $2; }
+        | START_MODULE_BODY child_statement
+          { scanner.moduleBody = $2; }
+        ;
+
 input   : /* empty */
         | input statement
         ;
@@ -103,10 +114,23 @@ statement
           { unit.modules.emplace_back($2, std::vector<AssignNode>(), $5, @$); }
         | MODULE ID LPAREN parameter_list optional_comma RPAREN child_statement
           { unit.modules.emplace_back($2, $4, $7, @$); }
+        | MODULE ID LPAREN RPAREN LAZY_BODY
+          { unit.modules.emplace_back($2, std::vector<AssignNode>(), ModuleBody(), @$);
+            unit.modules.back().lazyBody = std::make_shared<LazyBody>(LazyBody{$5, @5}); }
+        | MODULE ID LPAREN parameter_list optional_comma RPAREN LAZY_BODY
+          { unit.modules.emplace_back($2, $4, ModuleBody(), @$);
+            unit.modules.back().lazyBody = std::make_shared<LazyBody>(LazyBody{$7, @7}); }
         | FUNCTION ID LPAREN RPAREN ASSIGN expr SEMI
           { unit.functions.emplace_back($2, std::vector<AssignNode>(), $6, @$); }
         | FUNCTION ID LPAREN parameter_list optional_comma RPAREN ASSIGN expr SEMI
           { unit.functions.emplace_back($2, $4, $8, @$); }
+          /* the lazy body includes the semicolon */
+        | FUNCTION ID LPAREN RPAREN ASSIGN LAZY_BODY
+          { unit.functions.emplace_back($2, std::vector<AssignNode>(), nullptr, @$);
+            unit.functions.back().lazyBody = std::make_shared<LazyBody>(LazyBody{$6, @6}); }
+        | FUNCTION ID LPAREN parameter_list optional_comma RPAREN ASSIGN LAZY_BODY
+          { unit.functions.emplace_back($2, $4, nullptr, @$);
+            unit.functions.back().lazyBody = std::make_shared<LazyBody>(LazyBody{$8, @8}); }
         ;
 
 inner_input
@@ -117,11 +141,11 @@ inner_input
   /* note that only module_instantiation can give nullptr... */
 module_instantiation
         : NOT module_instantiation
-          { $$ = makeModifier("!", $2, @$); }
+          { $$ = makeModifier(unit, "!", $2, @$); }
         | HASH module_instantiation
-          { $$ = makeModifier("#", $2, @$); }
+          { $$ = makeModifier(unit, "#", $2, @$); }
         | MOD module_instantiation
-          { $$ = makeModifier("%", $2, @$); }
+          { $$ = makeModifier(unit, "%", $2, @$); }
         | MUL module_instantiation
           /* remove this module */
           { $$ = nullptr; }
@@ -143,7 +167,7 @@ ifelse_statement
 
 if_statement
         : IF LPAREN expr RPAREN child_statement
-          { $$ = std::make_shared<IfModule>($3, $5, ModuleBody(), @$); }
+          { $$ = unit.make<IfModule>($3, $5, ModuleBody(), @$); }
         ;
 
 assignment
@@ -179,39 +203,39 @@ child_statement
 
 single_module_instantiation
         : module_id LPAREN RPAREN
-        { $$ = std::make_shared<SingleModuleCall>(
+        { $$ = unit.make<SingleModuleCall>(
             $1, std::vector<AssignNode>(), ModuleBody(), @$); }
         | module_id LPAREN argument_list optional_comma RPAREN
-        { $$ = std::make_shared<SingleModuleCall>($1, $3, ModuleBody(), @$); }
+        { $$ = unit.make<SingleModuleCall>($1, $3, ModuleBody(), @$); }
         ;
 
 expr    : binary QUESTION expr COLON expr
-          { $$ = std::make_shared<IfExprNode>($1, $3, $5, @$); }
+          { $$ = unit.make<IfExprNode>($1, $3, $5, @$); }
         | LET LPAREN assign_list RPAREN expr
-          { $$ = std::make_shared<LetNode>($3, $5, @$); }
+          { $$ = unit.make<LetNode>($3, $5, @$); }
         | FUNCTION LPAREN parameter_list RPAREN expr
-          { $$ = std::make_shared<LambdaNode>($3, $5, @$); }
+          { $$ = unit.make<LambdaNode>($3, $5, @$); }
         | expr2
           { $$ = $1; }
         ;
 
 expr2   : binary
         | LSQUARE RSQUARE
-          { $$ = std::make_shared<ListExprNode>(std::vector<std::pair<Expr, bool>>(), @$); }
+          { $$ = unit.make<ListExprNode>(std::vector<std::pair<Expr, bool>>(), @$); }
         | LSQUARE element_list optional_comma RSQUARE
-          { $$ = std::make_shared<ListExprNode>($2, @$); }
+          { $$ = unit.make<ListExprNode>($2, @$); }
         | LSQUARE expr COLON expr RSQUARE
-          { $$ = std::make_shared<RangeNode>(
-              $2, std::make_shared<NumberNode>(1, @$), $4, @$); }
+          { $$ = unit.make<RangeNode>(
+              $2, unit.make<NumberNode>(1, @$), $4, @$); }
         | LSQUARE expr COLON expr COLON expr RSQUARE
-          { $$ = std::make_shared<RangeNode>( $2, $4, $6, @$); }
+          { $$ = unit.make<RangeNode>( $2, $4, $6, @$); }
         | expr2 LSQUARE expr RSQUARE
-          { $$ = std::make_shared<ListIndexNode>($1, $3, @$); }
+          { $$ = unit.make<ListIndexNode>($1, $3, @$); }
         | expr2 DOT ID
           { auto s = $3;
             auto id = s == "x" ? 0 : s == "y" ? 1 : s == "z" ? 2 : -1;
             if (id == -1) throw sscad::Parser::syntax_error(@$, "unexpected " + s);
-            $$ = std::make_shared<ListIndexNode>($1, std::make_shared<NumberNode>(id, @$), @$); }
+            $$ = unit.make<ListIndexNode>($1, unit.make<NumberNode>(id, @$), @$); }
           /* ECHO and ASSERT requires list support,
              the plan is to make them special functions that take two arguments,
              one in the form of a list and one for return */
@@ -220,33 +244,33 @@ expr2   : binary
 /* Instead of using rule levels to handle binary operator precedence, we use
  * bison's precedence feature for operators */
 binary  : unary
-        | binary binop unary { $$ = std::make_shared<BinaryOpNode>($1, $3, $2, @$);}
+        | binary binop unary { $$ = unit.make<BinaryOpNode>($1, $3, $2, @$);}
         ;
 
 unary   : exponent
         | ADD unary { $$ = $2; }
-        | SUB unary { $$ = std::make_shared<UnaryOpNode>($2, UnaryOp::NEG, @$); }
-        | NOT unary { $$ = std::make_shared<UnaryOpNode>($2, UnaryOp::NOT, @$); }
+        | SUB unary { $$ = unit.make<UnaryOpNode>($2, UnaryOp::NEG, @$); }
+        | NOT unary { $$ = unit.make<UnaryOpNode>($2, UnaryOp::NOT, @$); }
         ;
 
 exponent: call
-        | call EXP unary { $$ = std::make_shared<BinaryOpNode>($1, $3, BinOp::EXP, @$); }
+        | call EXP unary { $$ = unit.make<BinaryOpNode>($1, $3, BinOp::EXP, @$); }
         ;
 
 call    : primary
         | call LPAREN RPAREN
-          { $$ = std::make_shared<CallNode>($1, std::vector<AssignNode>(), @$); }
+          { $$ = unit.make<CallNode>($1, std::vector<AssignNode>(), @$); }
         | call LPAREN argument_list optional_comma RPAREN
-          { $$ = std::make_shared<CallNode>($1, $3, @$); }
+          { $$ = unit.make<CallNode>($1, $3, @$); }
           /* list lookup not implementd yet */
         ;
 
-primary : TRUE               { $$ = std::make_shared<NumberNode>(1, @$); }
-        | FALSE              { $$ = std::make_shared<NumberNode>(0, @$); }
-        | NUMBER             { $$ = std::make_shared<NumberNode>($1, @$); }
-        | STRING             { $$ = std::make_shared<StringNode>($1, @$); }
-        | UNDEF              { $$ = std::make_shared<UndefNode>(@$); }
-        | ID                 { $$ = std::make_shared<IdentNode>($1, @$); }
+primary : TRUE               { $$ = unit.make<BoolNode>(true, @$); }
+        | FALSE              { $$ = unit.make<BoolNode>(false, @$); }
+        | NUMBER             { $$ = unit.make<NumberNode>($1, @$); }
+        | STRING             { $$ = unit.make<StringNode>($1, @$); }
+        | UNDEF              { $$ = unit.make<UndefNode>(@$); }
+        | ID                 { $$ = unit.make<IdentNode>($1, @$); }
         | LPAREN expr RPAREN { $$ = $2; }
           /* lists are not handled for now */
         ;
@@ -272,13 +296,13 @@ element_list   : expr                           { $$ = {std::make_pair($1, false
                | element_list COMMA expr        { $$ = $1; $$.emplace_back($3, false); }
                | element_list COMMA EACH expr   { $$ = $1; $$.emplace_back($4, true); }
                | FOR LPAREN assign_list RPAREN generators
-                 { $$ = { std::make_pair(std::make_shared<ListCompNode>($3, $5, @$), true) }; }
+                 { $$ = { std::make_pair(unit.make<ListCompNode>($3, $5, @$), true) }; }
                | element_list COMMA FOR LPAREN assign_list RPAREN generators
-                 { $$ = $1; $$.emplace_back( std::make_shared<ListCompNode>($5, $7, @$), true); }
+                 { $$ = $1; $$.emplace_back( unit.make<ListCompNode>($5, $7, @$), true); }
                | FOR LPAREN assign_list SEMI expr SEMI assign_list RPAREN generators
-                 { $$ = { std::make_pair(std::make_shared<ListCompCNode>($3, $5, $7, $9, @$), true) }; }
+                 { $$ = { std::make_pair(unit.make<ListCompCNode>($3, $5, $7, $9, @$), true) }; }
                | element_list COMMA FOR LPAREN assign_list SEMI expr SEMI assign_list RPAREN generators
-                 { $$ = $1; $$.emplace_back(std::make_shared<ListCompCNode>($5, $7, $9, $11, @$), true) ; }
+                 { $$ = $1; $$.emplace_back(unit.make<ListCompCNode>($5, $7, $9, $11, @$), true) ; }
                ;
 
 assign_list    : ID ASSIGN expr { $$ = {AssignNode($1, $3, @$)}; }
@@ -298,11 +322,11 @@ generators     : IF LPAREN expr RPAREN expr ELSE generators
                | expr
                  { $$ = std::vector<std::tuple<Expr, Expr, bool>>();
                    $$.insert($$.begin(), std::make_tuple(
-                     std::make_shared<NumberNode>(1, @$), $1, false)); }
+                     unit.make<NumberNode>(1, @$), $1, false)); }
                | EACH expr
                  { $$ = std::vector<std::tuple<Expr, Expr, bool>>();
                    $$.insert($$.begin(), std::make_tuple(
-                     std::make_shared<NumberNode>(1, @$), $2, true)); }
+                     unit.make<NumberNode>(1, @$), $2, true)); }
                ;
 
 module_id      : ID                             { $$ = $1; }
@@ -320,13 +344,14 @@ optional_comma : /* empty */ | COMMA ;
 %%
 
 std::shared_ptr<ModuleCall> makeModifier(
+   TranslationUnit &unit,
    std::string modifier,
    std::shared_ptr<ModuleCall> child,
    Location loc
 ) {
   if (child == nullptr)
     return nullptr;
-  return std::make_shared<ModuleModifier>(modifier, child, loc);
+  return unit.make<ModuleModifier>(modifier, child, loc);
 }
 
 void sscad::Parser::error(const Location &loc, const std::string &message) {
@@ -24,9 +24,10 @@
 #include <FlexLexer.h>
 #endif
 
+#include "parse_cache.h"
 #include "parser.h"
 #undef YY_DECL
-#define YY_DECL sscad::Parser::symbol_type sscad::Scanner::getNextToken()
+#define YY_DECL sscad::Parser::symbol_type sscad::Scanner::lex()
 
 namespace U_ICU_NAMESPACE {
 class BreakIterator;
@@ -38,12 +39,34 @@ class Frontend;
 
 class Scanner : public yyFlexLexer {
  public:
+  // lazyBodies: skip function and module bodies, see Frontend::setLazyBodies
   Scanner(Frontend &frontend, TranslationUnit &unit,
-          std::shared_ptr<std::istream> istream);
+          std::shared_ptr<std::istream> istream, bool lazyBodies = false);
+  // scan a skipped body starting at pos, startToken is START_FUNCTION_BODY or
+  // START_MODULE_BODY
+  Scanner(Frontend &frontend, TranslationUnit &unit,
+          std::shared_ptr<std::istream> istream, Location::Position pos,
+          Parser::token_kind_type startToken);
   virtual ~Scanner();
   virtual sscad::Parser::symbol_type getNextToken();
 
+  // results of parsing a skipped body
+  Expr bodyExpr;
+  ModuleBody moduleBody;
+  // records the used and included files if not nullptr
+  ParseCache::Dependencies *dependencies = nullptr;
+
+  // Number of grapheme clusters in str, negative if the string is not a valid
+  // identifier. ASCII strings are counted without ICU, icuGraphemes always
+  // uses ICU and gives the same result.
+  int numGraphemes(const char *str);
+  int icuGraphemes(const char *str);
+
  private:
+  // where we are in a function or module declaration, to know when a body
+  // follows
+  enum class DeclState { NONE, KEYWORD, NAME, PARAMS, ASSIGN };
+
   Frontend &frontend;
   TranslationUnit &unit;
 
@@ -52,14 +75,26 @@ class Scanner : public yyFlexLexer {
   Location loc;
   std::stack<std::shared_ptr<std::istream>> istreams;
 
-  // negative if the string is not a valid identifier
-  int numGraphemes(const char *str);
+  Parser::token_kind_type startToken = Parser::token::END;
+  bool lazyBodies = false;
+  DeclState declState = DeclState::NONE;
+  bool declModule = false;
+  int parenDepth = 0;
+  bool bodyModule = false;
+  int bodyDepth = 0;
+  std::string bodyText;
+
   static Parser::symbol_type parseNumber(const std::string &str,
                                          const Location loc);
   static std::string toUTF8(int c);
   void addUse(const std::string &);
   void lexerInclude(const std::string &);
   bool lexerFileEnd();
+
+  Parser::symbol_type lex();
+  void trackDeclaration(Parser::symbol_kind_type kind);
+  // append text to the body being skipped and update the location
+  void captureText(const char *text, size_t length);
 };
 
 }  // namespace sscad
@@ -17,19 +17,51 @@
 #include <unicode/bytestream.h>
 #include <unicode/utypes.h>
 
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <locale>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
 #include "frontend.h"
 #include "scanner.h"
+#include "source_stream.h"
 
 using namespace std::string_literals;
 
 namespace sscad {
+// Scanners only clone this iterator and never modify it, so it can be shared
+// by scanners running on different threads. Grapheme boundaries do not depend
+// on the locale, so we use the root locale rather than the process default,
+// which can be changed at any time.
+static const icu::BreakIterator &characterIterator() {
+  static const std::unique_ptr<icu::BreakIterator> prototype = [] {
+    UErrorCode status = U_ZERO_ERROR;
+    std::unique_ptr<icu::BreakIterator> iter(
+        icu::BreakIterator::createCharacterInstance(icu::Locale::getRoot(),
+                                                    status));
+    if (U_FAILURE(status))
+      throw std::runtime_error("cannot create character break iterator: "s +
+                               u_errorName(status));
+    return iter;
+  }();
+  return *prototype;
+}
+
+Scanner::Scanner(Frontend &frontend, TranslationUnit &unit,
+                 std::shared_ptr<std::istream> istream, bool lazyBodies)
+    : Scanner(frontend, unit, std::move(istream),
+              Location::Position{unit.file, 0, 1, 1}, Parser::token::END) {
+  this->lazyBodies = lazyBodies;
+}
+
 Scanner::Scanner(Frontend &frontend, TranslationUnit &unit,
-                 std::shared_ptr<std::istream> istream)
-    : frontend(frontend), unit(unit) {
-  UErrorCode status;
-  brkiter = icu::BreakIterator::createCharacterInstance(
-      icu::Locale::getDefault(), status);
-  Location::Position pos{nullptr, unit.file, 1, 1};
+                 std::shared_ptr<std::istream> istream, Location::Position pos,
+                 Parser::token_kind_type startToken)
+    : frontend(frontend), unit(unit), startToken(startToken) {
+  brkiter = characterIterator().clone();
   loc = {pos, pos};
   istreams.push(std::move(istream));
   switch_streams(istreams.top().get());
@@ -38,10 +70,34 @@ Scanner::Scanner(Frontend &frontend, TranslationUnit &unit,
 Scanner::~Scanner() { delete brkiter; }
 
 int Scanner::numGraphemes(const char *str) {
-  auto s = icu::UnicodeString::fromUTF8(str);
-  brkiter->setText(s);
   int length = 0;
   bool validIdent = true;
+  // ASCII fast path: every byte is a grapheme except for CRLF, and the ASCII
+  // ID_START and ID_CONTINUE characters are just letters and digits
+  const char *p = str;
+  for (; *p != '\0'; p++) {
+    char ch = *p;
+    if (static_cast<unsigned char>(ch) >= 0x80) break;
+    if (ch == '\n' && p != str && p[-1] == '\r') continue;
+    bool letter = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+    if (length == 0)
+      validIdent = letter || ch == '_';
+    else if (!letter && !(ch >= '0' && ch <= '9') && ch != '_')
+      validIdent = false;
+    length++;
+  }
+  if (*p == '\0') return validIdent ? length : -length;
+
+  // a combining character can attach to the previous ASCII byte, so count the
+  // whole string with ICU
+  return icuGraphemes(str);
+}
+
+int Scanner::icuGraphemes(const char *str) {
+  int length = 0;
+  bool validIdent = true;
+  auto s = icu::UnicodeString::fromUTF8(str);
+  brkiter->setText(s);
   int c;
   while ((c = brkiter->next()) != icu::BreakIterator::DONE) {
     if (validIdent) {
@@ -59,9 +115,19 @@ int Scanner::numGraphemes(const char *str) {
 
 Parser::symbol_type Scanner::parseNumber(const std::string &str,
                                          const Location loc) {
-  errno = 0;
-  double value = std::strtod(str.c_str(), nullptr);
-  if (errno == 0) return Parser::make_NUMBER(value, loc);
+  // strtod depends on the global C locale, which can be changed by another
+  // thread while we are parsing
+  double value;
+#ifdef __cpp_lib_to_chars
+  auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (result.ec == std::errc() && result.ptr == str.data() + str.size())
+    return Parser::make_NUMBER(value, loc);
+#else
+  std::istringstream ss(str);
+  ss.imbue(std::locale::classic());
+  if (ss >> value && std::isfinite(value))
+    return Parser::make_NUMBER(value, loc);
+#endif
   throw Parser::syntax_error(loc, "Invalid number \""s + str + '"');
 }
 
@@ -73,38 +139,65 @@ std::string Scanner::toUTF8(int c) {
 }
 
 void Scanner::addUse(const std::string &filename) {
-  FileHandle file = frontend.resolver(filename, loc.begin.src);
+  FileHandle file = frontend.resolve(filename, loc.begin.src);
+  if (dependencies != nullptr)
+    dependencies->resolutions.push_back({filename, loc.begin.src, file});
   unit.uses.insert(file);
 }
 
 void Scanner::lexerInclude(const std::string &filename) {
-  FileHandle file = frontend.resolver(filename, loc.begin.src);
+  FileHandle file = frontend.resolve(filename, loc.begin.src);
+  if (dependencies != nullptr)
+    dependencies->resolutions.push_back({filename, loc.begin.src, file});
   // avoid cyclic include by walking the include stack
-  Location *locPtr = &loc;
-  while (true) {
-    if (file == locPtr->begin.src)
+  if (file == loc.begin.src)
+    throw Parser::syntax_error(loc, "recursive include detected");
+  for (const auto &site : unit.includeChain(loc.begin))
+    if (file == site.begin.src)
       throw Parser::syntax_error(loc, "recursive include detected");
-    if (locPtr->begin.parent == nullptr) break;
-    locPtr = locPtr->begin.parent.get();
-  }
-  const auto parent = std::make_shared<Location>(loc);
-  auto stream = frontend.provider(file);
+  unit.includes.push_back(loc);
+  uint32_t include = unit.includes.size();
+  std::shared_ptr<std::istream> stream = frontend.open(file);
   assert(stream != nullptr);
+  if (dependencies != nullptr) {
+    auto source = SourceStream::read(std::move(stream));
+    dependencies->includes.emplace_back(
+        file, ParseCache::hash(source->data(), source->size()));
+    stream = std::move(source);
+  }
   switch_streams(stream.get());
   istreams.push(std::move(stream));
   loc = Location{
-      {parent, file, 1, 1},
-      {parent, file, 1, 1},
+      {file, include, 1, 1},
+      {file, include, 1, 1},
   };
 }
 
+void Scanner::captureText(const char *text, size_t length) {
+  bodyText.append(text, length);
+  // the rule already counted every byte as a column
+  loc.columns(-static_cast<int>(length));
+  size_t start = 0;
+  for (size_t i = 0; i <= length; i++) {
+    if (i < length && text[i] != '\r' && text[i] != '\n') continue;
+    if (i > start) {
+      std::string line(text + start, i - start);
+      loc.columns(abs(numGraphemes(line.c_str())));
+    }
+    if (i == length) break;
+    if (text[i] == '\r' && i + 1 < length && text[i + 1] == '\n') i++;
+    loc.lines();
+    start = i + 1;
+  }
+}
+
 // return true if the file is truely ended, false otherwise (include stack)
 bool Scanner::lexerFileEnd() {
   auto oldStream = std::move(istreams.top());
   istreams.pop();
   if (istreams.empty()) return true;
-  assert(loc.begin.parent != nullptr);
-  loc = *loc.begin.parent;
+  assert(loc.begin.include != 0);
+  loc = unit.includes[loc.begin.include - 1];
   switch_streams(istreams.top().get());
   return false;
 }
@@ -0,0 +1,123 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "source_stream.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SSCAD_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::string_literals;
+
+namespace sscad {
+
+SourceStream::Buffer::Buffer(const char *data, size_t size) {
+  // the get area is never written to
+  char *p = const_cast<char *>(data);
+  setg(p, p, p + size);
+}
+
+std::streamsize SourceStream::Buffer::showmanyc() {
+  return egptr() - gptr();
+}
+
+SourceStream::Buffer::pos_type SourceStream::Buffer::seekoff(
+    off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+  if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+  off_type base = dir == std::ios_base::beg   ? 0
+                  : dir == std::ios_base::cur ? gptr() - eback()
+                                              : egptr() - eback();
+  off_type pos = base + off;
+  if (pos < 0 || pos > egptr() - eback()) return pos_type(off_type(-1));
+  setg(eback(), eback() + pos, egptr());
+  return pos_type(pos);
+}
+
+SourceStream::Buffer::pos_type SourceStream::Buffer::seekpos(
+    pos_type pos, std::ios_base::openmode which) {
+  return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+SourceStream::SourceStream(const char *data, size_t size,
+                           std::shared_ptr<const void> owner)
+    : std::istream(nullptr),
+      owner(std::move(owner)),
+      begin(data),
+      length(size),
+      buffer(data, size) {
+  rdbuf(&buffer);
+}
+
+SourceStream::SourceStream(std::string contents)
+    : std::istream(nullptr),
+      contents(std::move(contents)),
+      begin(this->contents.data()),
+      length(this->contents.size()),
+      buffer(begin, length) {
+  rdbuf(&buffer);
+}
+
+SourceStream::~SourceStream() {
+#ifdef SSCAD_HAS_MMAP
+  if (mapped != 0) munmap(const_cast<char *>(begin), mapped);
+#endif
+}
+
+std::shared_ptr<SourceStream> SourceStream::mapFile(const std::string &path) {
+#ifdef SSCAD_HAS_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open file "s + path);
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    size_t size = st.st_size;
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error("cannot map file "s + path);
+    // the scanner reads the file from start to end
+    madvise(ptr, size, MADV_SEQUENTIAL);
+    auto stream =
+        std::make_shared<SourceStream>(static_cast<const char *>(ptr), size);
+    stream->mapped = size;
+    return stream;
+  }
+  close(fd);
+#endif
+  // empty files and special files cannot be mapped, read them instead
+  std::ifstream file(path, std::ios::binary);
+  if (!file) throw std::runtime_error("cannot open file "s + path);
+  std::stringstream ss;
+  ss << file.rdbuf();
+  return std::make_shared<SourceStream>(ss.str());
+}
+
+std::shared_ptr<SourceStream> SourceStream::read(
+    std::shared_ptr<std::istream> stream) {
+  auto source = std::dynamic_pointer_cast<SourceStream>(stream);
+  if (source != nullptr) return source;
+  std::stringstream ss;
+  ss << stream->rdbuf();
+  return std::make_shared<SourceStream>(ss.str());
+}
+
+}  // namespace sscad
@@ -0,0 +1,75 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+
+namespace sscad {
+/**
+ * Input stream over a contiguous buffer in memory, for use with
+ * Frontend::FileProvider.
+ *
+ * Reads are served directly from the buffer, without the intermediate
+ * buffering and system calls of a file stream. This matters for large
+ * generated files: the scanner copies the source into its own buffer once and
+ * that is the only copy.
+ */
+class SourceStream : public std::istream {
+ public:
+  // Maps the file into memory, or reads it if mapping is not supported.
+  // Throws std::runtime_error if the file cannot be opened.
+  static std::shared_ptr<SourceStream> mapFile(const std::string &path);
+  // Returns stream itself if it is a SourceStream, otherwise reads the rest of
+  // it into a new SourceStream.
+  static std::shared_ptr<SourceStream> read(
+      std::shared_ptr<std::istream> stream);
+
+  // The buffer is not copied, owner is released with the stream and can be
+  // used to keep the buffer alive.
+  SourceStream(const char *data, size_t size,
+               std::shared_ptr<const void> owner = nullptr);
+  SourceStream(std::string contents);
+  SourceStream(const SourceStream &) = delete;
+  SourceStream &operator=(const SourceStream &) = delete;
+  virtual ~SourceStream();
+
+  const char *data() const { return begin; }
+  size_t size() const { return length; }
+
+ private:
+  class Buffer : public std::streambuf {
+   public:
+    Buffer(const char *data, size_t size);
+
+   protected:
+    virtual std::streamsize showmanyc() override;
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode which) override;
+    virtual pos_type seekpos(pos_type pos,
+                             std::ios_base::openmode which) override;
+  };
+
+  std::string contents;
+  std::shared_ptr<const void> owner;
+  const char *begin;
+  size_t length;
+  // non-zero if begin is a mapping we have to unmap
+  size_t mapped = 0;
+  Buffer buffer;
+};
+}  // namespace sscad
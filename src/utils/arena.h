@@ -0,0 +1,98 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace sscad {
+/**
+ * Bump allocator. Individual deallocations are no-ops, all the memory is
+ * released at once when the arena is destroyed. Not thread-safe.
+ */
+class Arena {
+ public:
+  static constexpr size_t blockSize = 64 * 1024;
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t align) {
+    // blocks are only aligned for fundamental types, align the address
+    size_t offset =
+        current == nullptr ? 0 : alignUp(current + used, align) - current;
+    if (current == nullptr || offset + size > capacity) {
+      // large objects get their own block, so we do not waste the current one
+      if (size + align > blockSize / 4) {
+        blocks.emplace_back(new char[size + align]);
+        total += size + align;
+        return alignUp(blocks.back().get(), align);
+      }
+      blocks.emplace_back(new char[blockSize]);
+      total += blockSize;
+      current = blocks.back().get();
+      capacity = blockSize;
+      offset = alignUp(current, align) - current;
+    }
+    used = offset + size;
+    return current + offset;
+  }
+
+  // total size of the blocks owned by the arena
+  size_t reserved() const { return total; }
+
+ private:
+  static char *alignUp(char *p, size_t align) {
+    auto addr = reinterpret_cast<uintptr_t>(p);
+    return p + (((addr + align - 1) & ~(align - 1)) - addr);
+  }
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *current = nullptr;
+  size_t used = 0;
+  size_t capacity = 0;
+  size_t total = 0;
+};
+
+// Allocator for std::allocate_shared. The control block of every object
+// keeps a copy of the allocator, so the objects keep the arena alive.
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+
+  ArenaAllocator(std::shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+
+  std::shared_ptr<Arena> arena;
+};
+}  // namespace sscad
@@ -0,0 +1,182 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ast_clone.h"
+
+#include <cassert>
+
+namespace sscad {
+namespace {
+class Cloner {
+ public:
+  Cloner(TranslationUnit &target) : target(target) {}
+
+  Expr clone(const Expr &expr) {
+    if (expr == nullptr) return nullptr;
+    const auto &loc = expr->loc;
+    switch (expr->kind) {
+      case NodeKind::NUMBER:
+        return target.make<NumberNode>(cast<NumberNode>(*expr).value, loc);
+      case NodeKind::BOOL:
+        return target.make<BoolNode>(cast<BoolNode>(*expr).value, loc);
+      case NodeKind::STRING:
+        return target.make<StringNode>(cast<StringNode>(*expr).str, loc);
+      case NodeKind::UNDEF:
+        return target.make<UndefNode>(loc);
+      case NodeKind::IDENT:
+        return target.make<IdentNode>(cast<IdentNode>(*expr).name, loc);
+      case NodeKind::UNARY_OP: {
+        const auto &node = cast<UnaryOpNode>(*expr);
+        return target.make<UnaryOpNode>(clone(node.operand), node.op, loc);
+      }
+      case NodeKind::BINARY_OP: {
+        const auto &node = cast<BinaryOpNode>(*expr);
+        return target.make<BinaryOpNode>(clone(node.lhs), clone(node.rhs),
+                                         node.op, loc);
+      }
+      case NodeKind::CALL: {
+        const auto &node = cast<CallNode>(*expr);
+        return target.make<CallNode>(clone(node.fun), clone(node.args), loc);
+      }
+      case NodeKind::IF_EXPR: {
+        const auto &node = cast<IfExprNode>(*expr);
+        return target.make<IfExprNode>(clone(node.cond), clone(node.ifthen),
+                                       clone(node.ifelse), loc);
+      }
+      case NodeKind::LIST_EXPR: {
+        const auto &node = cast<ListExprNode>(*expr);
+        std::vector<std::pair<Expr, bool>> elements;
+        elements.reserve(node.elements.size());
+        for (const auto &[elem, each] : node.elements)
+          elements.emplace_back(clone(elem), each);
+        return target.make<ListExprNode>(std::move(elements), loc);
+      }
+      case NodeKind::RANGE: {
+        const auto &node = cast<RangeNode>(*expr);
+        return target.make<RangeNode>(clone(node.start), clone(node.step),
+                                      clone(node.end), loc);
+      }
+      case NodeKind::LIST_COMP: {
+        const auto &node = cast<ListCompNode>(*expr);
+        return target.make<ListCompNode>(clone(node.assignments),
+                                         clone(node.generators), loc);
+      }
+      case NodeKind::LIST_COMP_C: {
+        const auto &node = cast<ListCompCNode>(*expr);
+        return target.make<ListCompCNode>(clone(node.init), clone(node.cond),
+                                          clone(node.update),
+                                          clone(node.generators), loc);
+      }
+      case NodeKind::LIST_INDEX: {
+        const auto &node = cast<ListIndexNode>(*expr);
+        return target.make<ListIndexNode>(clone(node.list), clone(node.index),
+                                          loc);
+      }
+      case NodeKind::LET: {
+        const auto &node = cast<LetNode>(*expr);
+        return target.make<LetNode>(clone(node.bindings), clone(node.expr),
+                                    loc);
+      }
+      case NodeKind::LAMBDA: {
+        const auto &node = cast<LambdaNode>(*expr);
+        return target.make<LambdaNode>(clone(node.params), clone(node.expr),
+                                       loc);
+      }
+      default:
+        assert(false && "not an expression");
+        return nullptr;
+    }
+  }
+
+  std::shared_ptr<ModuleCall> clone(const std::shared_ptr<ModuleCall> &call) {
+    switch (call->kind) {
+      case NodeKind::SINGLE_MODULE_CALL: {
+        const auto &node = cast<SingleModuleCall>(*call);
+        return target.make<SingleModuleCall>(node.name, clone(node.args),
+                                             clone(node.body), node.loc);
+      }
+      case NodeKind::IF_MODULE: {
+        const auto &node = cast<IfModule>(*call);
+        return target.make<IfModule>(clone(node.args[0].expr),
+                                     clone(node.ifthen), clone(node.ifelse),
+                                     node.loc);
+      }
+      case NodeKind::MODULE_MODIFIER: {
+        const auto &node = cast<ModuleModifier>(*call);
+        return target.make<ModuleModifier>(node.modifier, clone(node.module),
+                                           node.loc);
+      }
+      default:
+        assert(false && "not a module call");
+        return nullptr;
+    }
+  }
+
+  AssignNode clone(const AssignNode &assign) {
+    return AssignNode(assign.ident, clone(assign.expr), assign.loc);
+  }
+
+  std::vector<AssignNode> clone(const std::vector<AssignNode> &assigns) {
+    std::vector<AssignNode> result;
+    result.reserve(assigns.size());
+    for (const auto &assign : assigns) result.push_back(clone(assign));
+    return result;
+  }
+
+  ModuleBody clone(const ModuleBody &body) {
+    std::vector<std::shared_ptr<ModuleCall>> children;
+    children.reserve(body.children.size());
+    for (const auto &child : body.children) children.push_back(clone(child));
+    return ModuleBody(clone(body.assignments), std::move(children));
+  }
+
+  std::vector<std::tuple<Expr, Expr, bool>> clone(
+      const std::vector<std::tuple<Expr, Expr, bool>> &generators) {
+    std::vector<std::tuple<Expr, Expr, bool>> result;
+    result.reserve(generators.size());
+    for (const auto &[cond, elem, each] : generators)
+      result.emplace_back(clone(cond), clone(elem), each);
+    return result;
+  }
+
+ private:
+  TranslationUnit &target;
+};
+}  // namespace
+
+TranslationUnit clone(const TranslationUnit &unit) {
+  TranslationUnit result(unit.file);
+  Cloner cloner(result);
+  result.uses = unit.uses;
+  result.includes = unit.includes;
+  result.modules.reserve(unit.modules.size());
+  for (const auto &module : unit.modules) {
+    result.modules.emplace_back(module.name, cloner.clone(module.args),
+                                cloner.clone(module.body), module.loc);
+    result.modules.back().lazyBody = module.lazyBody;
+  }
+  result.functions.reserve(unit.functions.size());
+  for (const auto &fun : unit.functions) {
+    result.functions.emplace_back(fun.name, cloner.clone(fun.args),
+                                  cloner.clone(fun.body), fun.loc);
+    result.functions.back().lazyBody = fun.lazyBody;
+  }
+  result.assignments = cloner.clone(unit.assignments);
+  result.moduleCalls.reserve(unit.moduleCalls.size());
+  for (const auto &call : unit.moduleCalls)
+    result.moduleCalls.push_back(cloner.clone(call));
+  return result;
+}
+}  // namespace sscad
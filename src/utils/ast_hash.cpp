@@ -0,0 +1,240 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ast_hash.h"
+
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace sscad {
+namespace {
+class Hasher {
+ public:
+  uint64_t value = 0xcbf29ce484222325ull;
+  // hash the locations of the nodes as well
+  bool locations = false;
+
+  void mix(uint64_t v) {
+    value = (value ^ v) * 0x9e3779b97f4a7c15ull;
+    value ^= value >> 29;
+  }
+  void mixString(const std::string &str) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : str) h = (h ^ c) * 0x100000001b3ull;
+    mix(str.size());
+    mix(h);
+  }
+  void mixNumber(double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    mix(bits);
+  }
+  void mixLocation(const Location &loc) {
+    if (!locations) return;
+    for (const auto &pos : {loc.begin, loc.end}) {
+      mix(pos.include);
+      mix(uint64_t(pos.line) << 32 | uint32_t(pos.column));
+    }
+  }
+
+  void hash(const Expr &expr) {
+    if (expr == nullptr) {
+      mix(uint64_t(~0ull));
+      return;
+    }
+    mix(static_cast<uint64_t>(expr->kind));
+    mixLocation(expr->loc);
+    switch (expr->kind) {
+      case NodeKind::NUMBER:
+        mixNumber(cast<NumberNode>(*expr).value);
+        break;
+      case NodeKind::BOOL:
+        mix(uint64_t(cast<BoolNode>(*expr).value));
+        break;
+      case NodeKind::STRING:
+        mixString(cast<StringNode>(*expr).str);
+        break;
+      case NodeKind::UNDEF:
+        break;
+      case NodeKind::IDENT:
+        mixString(cast<IdentNode>(*expr).name);
+        break;
+      case NodeKind::UNARY_OP: {
+        const auto &node = cast<UnaryOpNode>(*expr);
+        mix(static_cast<uint64_t>(node.op));
+        hash(node.operand);
+        break;
+      }
+      case NodeKind::BINARY_OP: {
+        const auto &node = cast<BinaryOpNode>(*expr);
+        mix(static_cast<uint64_t>(node.op));
+        hash(node.lhs);
+        hash(node.rhs);
+        break;
+      }
+      case NodeKind::CALL: {
+        const auto &node = cast<CallNode>(*expr);
+        hash(node.fun);
+        hash(node.args);
+        break;
+      }
+      case NodeKind::IF_EXPR: {
+        const auto &node = cast<IfExprNode>(*expr);
+        hash(node.cond);
+        hash(node.ifthen);
+        hash(node.ifelse);
+        break;
+      }
+      case NodeKind::LIST_EXPR: {
+        const auto &node = cast<ListExprNode>(*expr);
+        mix(node.elements.size());
+        for (const auto &[elem, each] : node.elements) {
+          mix(uint64_t(each));
+          hash(elem);
+        }
+        break;
+      }
+      case NodeKind::RANGE: {
+        const auto &node = cast<RangeNode>(*expr);
+        hash(node.start);
+        hash(node.step);
+        hash(node.end);
+        break;
+      }
+      case NodeKind::LIST_COMP: {
+        const auto &node = cast<ListCompNode>(*expr);
+        hash(node.assignments);
+        hash(node.generators);
+        break;
+      }
+      case NodeKind::LIST_COMP_C: {
+        const auto &node = cast<ListCompCNode>(*expr);
+        hash(node.init);
+        hash(node.cond);
+        hash(node.update);
+        hash(node.generators);
+        break;
+      }
+      case NodeKind::LIST_INDEX: {
+        const auto &node = cast<ListIndexNode>(*expr);
+        hash(node.list);
+        hash(node.index);
+        break;
+      }
+      case NodeKind::LET: {
+        const auto &node = cast<LetNode>(*expr);
+        hash(node.bindings);
+        hash(node.expr);
+        break;
+      }
+      case NodeKind::LAMBDA: {
+        const auto &node = cast<LambdaNode>(*expr);
+        hash(node.params);
+        hash(node.expr);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  void hash(const ModuleCall &call) {
+    mix(static_cast<uint64_t>(call.kind));
+    mixLocation(call.loc);
+    mixString(call.name);
+    hash(call.args);
+    if (auto single = dynCast<SingleModuleCall>(&call)) {
+      hash(single->body);
+    } else if (auto ifmodule = dynCast<IfModule>(&call)) {
+      hash(ifmodule->ifthen);
+      hash(ifmodule->ifelse);
+    } else if (auto modifier = dynCast<ModuleModifier>(&call)) {
+      hash(*modifier->module);
+    }
+  }
+
+  void hash(const AssignNode &assign) {
+    mixString(assign.ident);
+    mixLocation(assign.loc);
+    hash(assign.expr);
+  }
+
+  void hash(const std::vector<AssignNode> &assigns) {
+    mix(assigns.size());
+    for (const auto &assign : assigns) hash(assign);
+  }
+
+  void hash(const ModuleBody &body) {
+    hash(body.assignments);
+    mix(body.children.size());
+    for (const auto &child : body.children) hash(*child);
+  }
+
+  void hash(const std::vector<std::tuple<Expr, Expr, bool>> &generators) {
+    mix(generators.size());
+    for (const auto &[cond, elem, each] : generators) {
+      hash(cond);
+      hash(elem);
+      mix(uint64_t(each));
+    }
+  }
+
+  void hash(const std::shared_ptr<const LazyBody> &body) {
+    mix(uint64_t(body != nullptr));
+    if (body == nullptr) return;
+    mixString(body->source);
+    mixLocation(body->loc);
+  }
+};
+}  // namespace
+
+uint64_t hash(const FunctionDecl &fun, bool locations) {
+  Hasher hasher;
+  hasher.locations = locations;
+  hasher.mixString(fun.name);
+  hasher.mixLocation(fun.loc);
+  hasher.hash(fun.args);
+  hasher.hash(fun.lazyBody);
+  hasher.hash(fun.body);
+  return hasher.value;
+}
+
+uint64_t hash(const ModuleDecl &module, bool locations) {
+  Hasher hasher;
+  hasher.locations = locations;
+  hasher.mixString(module.name);
+  hasher.mixLocation(module.loc);
+  hasher.hash(module.args);
+  hasher.hash(module.lazyBody);
+  hasher.hash(module.body);
+  return hasher.value;
+}
+
+uint64_t hash(const AssignNode &assign, bool locations) {
+  Hasher hasher;
+  hasher.locations = locations;
+  hasher.hash(assign);
+  return hasher.value;
+}
+
+uint64_t hash(const ModuleCall &call, bool locations) {
+  Hasher hasher;
+  hasher.locations = locations;
+  hasher.hash(call);
+  return hasher.value;
+}
+}  // namespace sscad
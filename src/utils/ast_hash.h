@@ -0,0 +1,31 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cstdint>
+
+#include "ast.h"
+
+namespace sscad {
+// Structural hashes of declarations, ignoring locations, so moving a
+// declaration or editing whitespace and comments does not change its hash.
+// Skipped bodies are hashed by their source text instead.
+// With locations, the locations of all the nodes are hashed too, so a
+// declaration that only moved changes its hash.
+uint64_t hash(const FunctionDecl &fun, bool locations = false);
+uint64_t hash(const ModuleDecl &module, bool locations = false);
+uint64_t hash(const AssignNode &assign, bool locations = false);
+uint64_t hash(const ModuleCall &call, bool locations = false);
+}  // namespace sscad
@@ -91,7 +91,10 @@ void AstPrinter::visit(ModuleDecl &module) {
     if (assign.expr != nullptr) visit(assign.expr);
   }
   *ostream << "), ";
-  visit(module.body);
+  if (module.lazyBody != nullptr)
+    *ostream << "<lazy>";
+  else
+    visit(module.body);
   *ostream << ", loc=" << module.loc << ")";
 }
 
@@ -105,7 +108,10 @@ void AstPrinter::visit(FunctionDecl &fun) {
     if (assign.expr != nullptr) visit(assign.expr);
   }
   *ostream << "), ";
-  visit(fun.body);
+  if (fun.lazyBody != nullptr)
+    *ostream << "<lazy>";
+  else
+    visit(fun.body);
   *ostream << ", loc=" << fun.loc << ")";
 }
 
@@ -113,6 +119,11 @@ void AstPrinter::visit(NumberNode &number) {
   *ostream << "Number(" << number.value << ", loc=" << number.loc << ")";
 }
 
+void AstPrinter::visit(BoolNode &b) {
+  *ostream << "Bool(" << (b.value ? "true" : "false") << ", loc=" << b.loc
+           << ")";
+}
+
 void AstPrinter::visit(StringNode &str) {
   *ostream << "String(\"";
   // handle escaping
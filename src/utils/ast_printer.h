@@ -26,6 +26,7 @@ class AstPrinter : public AstVisitor {
   virtual void visit(ModuleDecl &) override;
   virtual void visit(FunctionDecl &) override;
   virtual void visit(NumberNode &) override;
+  virtual void visit(BoolNode &) override;
   virtual void visit(StringNode &) override;
   virtual void visit(UndefNode &) override;
   virtual void visit(IdentNode &) override;
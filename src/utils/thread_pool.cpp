@@ -0,0 +1,158 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace sscad {
+// set on the threads currently running a loop
+static thread_local bool inLoop = false;
+
+ThreadPool::ThreadPool(unsigned int threads) {
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int i = 0; i < threads; i++)
+    workers.push_back(std::make_unique<Worker>());
+  for (unsigned int i = 1; i < threads; i++) {
+    helpers.emplace_back([this, i]() {
+      inLoop = true;
+      unsigned long seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        cv.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) break;
+        seen = generation;
+        lock.unlock();
+        work(i);
+        lock.lock();
+      }
+    });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  for (auto &helper : helpers) helper.join();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const Body &body) {
+  if (count == 0) return;
+  if (inLoop) throw std::runtime_error("nested parallel loop");
+  grain = std::max<size_t>(grain, 1);
+  if (workers.size() == 1 || count <= grain) {
+    body(0, count, 0);
+    return;
+  }
+
+  std::lock_guard<std::mutex> loop(loopMutex);
+  this->body = &body;
+  this->grain = grain;
+  {
+    std::lock_guard<std::mutex> lock(workers[0]->mutex);
+    workers[0]->ranges.push_back({0, count});
+    queued = 1;
+  }
+  remaining = count;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    generation++;
+  }
+  cv.notify_all();
+
+  inLoop = true;
+  work(0);
+  inLoop = false;
+  // remaining only drops to zero after the last body returned, so no helper
+  // is still using the body
+  this->body = nullptr;
+  if (error) {
+    auto e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+void ThreadPool::work(unsigned int id) {
+  auto &own = *workers[id];
+  while (remaining.load() > 0) {
+    Range range;
+    if (!take(id, range)) {
+      // The other workers are running their ranges, wait until one of them
+      // splits off another range or the loop ends. A worker queuing a range
+      // reads idle after incrementing queued, and we read queued after
+      // incrementing idle, so at least one of us sees the other.
+      std::unique_lock<std::mutex> lock(mutex);
+      idle++;
+      progress.wait(lock, [&] { return remaining == 0 || queued > 0; });
+      idle--;
+      continue;
+    }
+    while (range.end - range.begin > grain) {
+      size_t mid = range.begin + (range.end - range.begin) / 2;
+      {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.ranges.push_back({mid, range.end});
+        queued++;
+      }
+      range.end = mid;
+      if (idle > 0) {
+        // the waiting worker holds the mutex until it sleeps
+        { std::lock_guard<std::mutex> lock(mutex); }
+        progress.notify_one();
+      }
+    }
+    try {
+      (*body)(range.begin, range.end, id);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) error = std::current_exception();
+    }
+    if ((remaining -= range.end - range.begin) == 0) {
+      { std::lock_guard<std::mutex> lock(mutex); }
+      progress.notify_all();
+    }
+  }
+}
+
+// newest range of our own deque, or steal the oldest range of another
+bool ThreadPool::take(unsigned int id, Range &range) {
+  {
+    auto &own = *workers[id];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.ranges.empty()) {
+      range = own.ranges.back();
+      own.ranges.pop_back();
+      queued--;
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    auto &victim = *workers[(id + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.ranges.empty()) {
+      range = victim.ranges.front();
+      victim.ranges.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace sscad
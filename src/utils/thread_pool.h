@@ -0,0 +1,99 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sscad {
+/**
+ * Work-stealing thread pool for data parallel loops.
+ *
+ * parallelFor hands the whole index range to the calling thread. A worker
+ * splits the range it is working on in halves until it is at most `grain`
+ * long, keeping the upper halves in its own deque, and idle workers steal the
+ * oldest, i.e. largest, ranges from the other deques. This balances loops
+ * where some elements are much more expensive than others without knowing
+ * the costs in advance. Workers that find nothing to steal sleep until a range
+ * is split off or the loop ends.
+ *
+ * The calling thread takes part as worker 0. Loops started from different
+ * threads run one after the other, and loops must not be started from inside
+ * a loop body.
+ */
+class ThreadPool {
+ public:
+  // with 0 threads, use one thread per core
+  ThreadPool(unsigned int threads = 0);
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ~ThreadPool();
+
+  // number of workers, including the calling thread
+  unsigned int size() const { return workers.size(); }
+
+  // Calls body(begin, end, worker) for disjoint ranges covering [0, count),
+  // each at most `grain` long, and waits for all of them. The worker index is
+  // less than size() and no two ranges run on the same worker concurrently.
+  // If a body throws, the remaining ranges still run and the first exception
+  // is rethrown at the end.
+  using Body = std::function<void(size_t, size_t, unsigned int)>;
+  void parallelFor(size_t count, size_t grain, const Body &body);
+
+ private:
+  struct Range {
+    size_t begin;
+    size_t end;
+  };
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Range> ranges;
+  };
+
+  void work(unsigned int id);
+  bool take(unsigned int id, Range &range);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> helpers;
+  // held for the duration of a loop
+  std::mutex loopMutex;
+
+  // state of the current loop, body and grain are set before remaining
+  const Body *body = nullptr;
+  size_t grain = 1;
+  // number of indices that are not done yet
+  std::atomic<size_t> remaining = 0;
+  // number of ranges in the deques, and of workers waiting for one
+  std::atomic<size_t> queued = 0;
+  std::atomic<unsigned int> idle = 0;
+  std::exception_ptr error;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // notified when a range is queued while a worker is idle, and at the end
+  // of a loop
+  std::condition_variable progress;
+  unsigned long generation = 0;
+  bool stopping = false;
+};
+}  // namespace sscad
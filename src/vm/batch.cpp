@@ -0,0 +1,121 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+namespace sscad {
+
+static void releaseOverrides(GlobalOverrides &overrides) {
+  for (auto &[_, value] : overrides) {
+    Evaluator::release(value);
+    value = ValuePair::undef();
+  }
+}
+
+BatchEvaluator::BatchEvaluator(std::ostream *ostream,
+                               std::shared_ptr<const Program> program,
+                               unsigned int threads)
+    : ostream(ostream), program(std::move(program)), threads(threads) {
+  if (this->threads == 0)
+    this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<ValuePair> BatchEvaluator::eval(
+    int entry, std::vector<GlobalOverrides> variants) {
+  // Every variant starts from the globals of this evaluator. The workers only
+  // copy values out of it, like they do with the program.
+  Evaluator base(ostream, program);
+  bool shareInit = false;
+  try {
+    if (init >= 0) {
+      std::unordered_set<int> overridden;
+      for (const auto &variant : variants)
+        for (const auto &[index, _] : variant) overridden.insert(index);
+      std::unordered_set<int> reads, writes;
+      program->globalAccess(init, reads, writes);
+      auto touched = [&](int global) {
+        return overridden.find(global) != overridden.end();
+      };
+      shareInit = std::none_of(reads.begin(), reads.end(), touched) &&
+                  std::none_of(writes.begin(), writes.end(), touched);
+      if (shareInit) {
+        Evaluator::release(base.eval(init));
+        stats.initRuns++;
+      }
+    }
+  } catch (...) {
+    for (auto &variant : variants) releaseOverrides(variant);
+    throw;
+  }
+
+  std::vector<ValuePair> results(variants.size(), ValuePair::undef());
+  std::vector<std::string> outputs(variants.size());
+  std::vector<std::exception_ptr> errors(variants.size());
+  std::atomic<size_t> next = 0;
+  std::atomic<size_t> initRuns = 0;
+  auto worker = [&]() {
+    std::stringstream output;
+    Evaluator evaluator(&output, program);
+    evaluator.setMemoization(memoCapacity);
+    evaluator.setJit(jitThreshold);
+    for (size_t i = next++; i < variants.size(); i = next++) {
+      try {
+        evaluator.setGlobals(base);
+        for (auto &[index, value] : variants[i]) {
+          auto owned = value;
+          value = ValuePair::undef();
+          evaluator.setGlobal(index, owned);
+        }
+        if (init >= 0 && !shareInit) {
+          initRuns++;
+          Evaluator::release(evaluator.eval(init));
+        }
+        results[i] = evaluator.eval(entry);
+      } catch (...) {
+        errors[i] = std::current_exception();
+        releaseOverrides(variants[i]);
+      }
+      outputs[i] = output.str();
+      output.str("");
+    }
+  };
+
+  std::vector<std::thread> helpers;
+  for (unsigned int i = 1; i < threads && i < variants.size(); i++)
+    helpers.emplace_back(worker);
+  worker();
+  for (auto &helper : helpers) helper.join();
+
+  stats.variants += variants.size();
+  stats.initRuns += initRuns;
+  for (const auto &output : outputs) *ostream << output;
+  // report the same error regardless of scheduling
+  auto error = std::find_if(errors.begin(), errors.end(),
+                            [](const auto &e) { return e != nullptr; });
+  if (error != errors.end()) {
+    for (auto result : results) Evaluator::release(result);
+    std::rethrow_exception(*error);
+  }
+  return results;
+}
+}  // namespace sscad
@@ -0,0 +1,77 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "evaluator.h"
+
+namespace sscad {
+// Values of some globals for one variant of a batch, by global index.
+// ConstEvaluator inlines constant globals into their readers, so globals that
+// are overridden must be passed to ConstEvaluator::setOverridable.
+using GlobalOverrides = std::vector<std::pair<int, ValuePair>>;
+
+struct BatchStats {
+  size_t variants = 0;
+  // times the init function was run, 1 per batch if it could be shared
+  size_t initRuns = 0;
+};
+
+/**
+ * Evaluates the entry function of a program once for each of a batch of
+ * variants, e.g. customizer parameter sets, in parallel. Every variant starts
+ * with the globals of the program and replaces some of them.
+ *
+ * Each thread has its own evaluator for the shared program, reused across the
+ * variants it runs, so functions compiled by the JIT stay compiled. Output of
+ * each variant is buffered and written in the order of the variants.
+ */
+class BatchEvaluator {
+ public:
+  // with 0 threads, use one thread per core
+  BatchEvaluator(std::ostream *ostream, std::shared_ptr<const Program> program,
+                 unsigned int threads = 0);
+
+  // Function run before the entry function of each variant, to initialize
+  // globals derived from the overridden ones. If it does not read or write
+  // any overridden global, directly or in the functions it calls, it is only
+  // run once per batch and the variants start from the globals it computed.
+  // -1 for no init function, which is the default.
+  void setInit(int id) { init = id; }
+  // applied to the evaluator of each thread, see Evaluator
+  void setMemoization(size_t capacity) { memoCapacity = capacity; }
+  void setJit(int threshold) { jitThreshold = threshold; }
+
+  // Results are in the order of the variants and owned by the caller, see
+  // Evaluator::release. The batch takes ownership of the override values.
+  // If any variant fails, the exception of the first failed variant is
+  // rethrown once all the variants are done.
+  std::vector<ValuePair> eval(int entry, std::vector<GlobalOverrides> variants);
+  BatchStats batchStats() const { return stats; }
+
+ private:
+  std::ostream *ostream;
+  std::shared_ptr<const Program> program;
+  unsigned int threads;
+  int init = -1;
+  size_t memoCapacity = 0;
+  int jitThreshold = -1;
+  BatchStats stats;
+};
+}  // namespace sscad
@@ -15,12 +15,25 @@
  */
 #include "evaluator.h"
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
 
 #include "ast.h"
 #include "instructions.h"
+#include "jit.h"
+#include "numeric.h"
+#include "profile.h"
+#include "sampler.h"
+#include "utils/thread_pool.h"
 
 using namespace std::string_literals;
 
@@ -43,15 +56,168 @@ constexpr char toHex(char n) {
 #define COLD
 #endif
 
-COLD void invalid() { throw std::runtime_error("invalid bytecode"); }
+[[noreturn]] COLD void invalid() {
+  throw std::runtime_error("invalid bytecode");
+}
+
+// Allocation counters of an evaluator, see Evaluator::memoryStats. Only the
+// thread running the evaluation writes them, so they are updated without
+// read-modify-write operations and other threads can still read them.
+struct MemoryCounters {
+  struct Counter {
+    std::atomic<long> count = 0;
+    std::atomic<long> peakCount = 0;
+    std::atomic<long> bytes = 0;
+    std::atomic<long> peakBytes = 0;
+  };
+  // indexed by the tag, STRING, VECTOR or RANGE
+  std::array<Counter, 3> kinds;
+  std::atomic<long> bytes = 0;
+  std::atomic<long> peakBytes = 0;
+  std::atomic<unsigned long> clones = 0;
+  std::atomic<size_t> peakFrames = 0;
+  std::atomic<size_t> peakStackValues = 0;
+  // bytes allowed by the memory limit of the evaluation, exceeding it sets
+  // nextCheck to 0 so the evaluator checks the limit soon
+  long limit = std::numeric_limits<long>::max();
+  unsigned long *nextCheck;
+
+  MemoryCounters(unsigned long *nextCheck) : nextCheck(nextCheck) {}
+  void reset(long limit);
+  // add the counters of parallel workers started by this evaluation
+  void merge(const std::vector<const MemoryCounters *> &workers);
+  MemoryStats stats() const;
+};
+
+template <typename T>
+static void increase(std::atomic<T> &value, T delta) {
+  value.store(value.load(std::memory_order_relaxed) + delta,
+              std::memory_order_relaxed);
+}
+
+template <typename T>
+static void raise(std::atomic<T> &peak, T value) {
+  if (value > peak.load(std::memory_order_relaxed))
+    peak.store(value, std::memory_order_relaxed);
+}
+
+void MemoryCounters::reset(long limit) {
+  for (auto &kind : kinds) {
+    kind.count.store(0, std::memory_order_relaxed);
+    kind.peakCount.store(0, std::memory_order_relaxed);
+    kind.bytes.store(0, std::memory_order_relaxed);
+    kind.peakBytes.store(0, std::memory_order_relaxed);
+  }
+  bytes.store(0, std::memory_order_relaxed);
+  peakBytes.store(0, std::memory_order_relaxed);
+  clones.store(0, std::memory_order_relaxed);
+  peakFrames.store(0, std::memory_order_relaxed);
+  peakStackValues.store(0, std::memory_order_relaxed);
+  this->limit = limit;
+}
+
+void MemoryCounters::merge(const std::vector<const MemoryCounters *> &workers) {
+  auto combine = [&](std::atomic<long> MemoryCounters::Counter::*value,
+                     std::atomic<long> MemoryCounters::Counter::*peak) {
+    for (size_t i = 0; i < kinds.size(); i++) {
+      long total = (kinds[i].*value).load(std::memory_order_relaxed);
+      long peakTotal = total;
+      for (auto *worker : workers) {
+        total += (worker->kinds[i].*value).load(std::memory_order_relaxed);
+        peakTotal += (worker->kinds[i].*peak).load(std::memory_order_relaxed);
+      }
+      (kinds[i].*value).store(total, std::memory_order_relaxed);
+      raise(kinds[i].*peak, peakTotal);
+    }
+  };
+  combine(&Counter::count, &Counter::peakCount);
+  combine(&Counter::bytes, &Counter::peakBytes);
+  long total = bytes.load(std::memory_order_relaxed);
+  long peakTotal = total;
+  for (auto *worker : workers) {
+    total += worker->bytes.load(std::memory_order_relaxed);
+    peakTotal += worker->peakBytes.load(std::memory_order_relaxed);
+    increase(clones, worker->clones.load(std::memory_order_relaxed));
+    // the worker stacks include the frames of this evaluation
+    raise(peakFrames, worker->peakFrames.load(std::memory_order_relaxed));
+    raise(peakStackValues,
+          worker->peakStackValues.load(std::memory_order_relaxed));
+  }
+  bytes.store(total, std::memory_order_relaxed);
+  raise(peakBytes, peakTotal);
+}
+
+MemoryStats MemoryCounters::stats() const {
+  MemoryStats stats;
+  AllocationStats *out[] = {&stats.strings, &stats.vectors, &stats.ranges};
+  for (size_t i = 0; i < kinds.size(); i++) {
+    out[i]->count = kinds[i].count.load(std::memory_order_relaxed);
+    out[i]->peakCount = kinds[i].peakCount.load(std::memory_order_relaxed);
+    out[i]->bytes = kinds[i].bytes.load(std::memory_order_relaxed);
+    out[i]->peakBytes = kinds[i].peakBytes.load(std::memory_order_relaxed);
+  }
+  stats.bytes = bytes.load(std::memory_order_relaxed);
+  stats.peakBytes = peakBytes.load(std::memory_order_relaxed);
+  stats.clones = clones.load(std::memory_order_relaxed);
+  stats.peakFrames = peakFrames.load(std::memory_order_relaxed);
+  stats.peakStackValues = peakStackValues.load(std::memory_order_relaxed);
+  return stats;
+}
+
+// counters of the evaluation running on this thread, nullptr outside of
+// evaluations
+static thread_local MemoryCounters *threadMemory = nullptr;
+
+// count the allocations of this thread for an evaluator in a scope
+struct MemoryScope {
+  MemoryCounters *outer;
+  MemoryScope(MemoryCounters *memory) : outer(threadMemory) {
+    threadMemory = memory;
+  }
+  ~MemoryScope() { threadMemory = outer; }
+};
+
+// count values of an allocated type, and bytes allocated for them
+static void account(ValueTag tag, long count, long bytes) {
+  MemoryCounters *memory = threadMemory;
+  if (memory == nullptr) return;
+  auto &kind = memory->kinds[tag];
+  if (count != 0) {
+    increase(kind.count, count);
+    raise(kind.peakCount, kind.count.load(std::memory_order_relaxed));
+  }
+  increase(kind.bytes, bytes);
+  raise(kind.peakBytes, kind.bytes.load(std::memory_order_relaxed));
+  increase(memory->bytes, bytes);
+  long total = memory->bytes.load(std::memory_order_relaxed);
+  raise(memory->peakBytes, total);
+  if (UNLIKELY(total > memory->limit)) *memory->nextCheck = 0;
+}
+
+static long stringBytes(const std::string &s) {
+  return sizeof(std::string) + s.capacity();
+}
+
+// the shared buffer of vectors, without the SVector referring to it
+static long bufferBytes(const std::vector<ValuePair> &values) {
+  return sizeof(std::vector<ValuePair>) +
+         values.capacity() * sizeof(ValuePair);
+}
 
 ALWAYS_INLINE ValuePair copy(ValuePair v) {
   if (isAllocated(v.tag)) {
     switch (v.tag) {
+      case ValueTag::STRING: {
+        auto s = new std::string(*v.value.s);
+        account(ValueTag::STRING, 1, stringBytes(*s));
+        return ValuePair(ValueTag::STRING, SValue{.s = s});
+      }
       case ValueTag::VECTOR:
+        account(ValueTag::VECTOR, 1, sizeof(SVector));
         return ValuePair(ValueTag::VECTOR,
                          SValue{.vec = new SVector{v.value.vec->values}});
       case ValueTag::RANGE:
+        account(ValueTag::RANGE, 1, sizeof(SRange));
         return ValuePair(ValueTag::RANGE,
                          SValue{.range = new SRange(*v.value.range)});
       default:
@@ -61,14 +227,29 @@ ALWAYS_INLINE ValuePair copy(ValuePair v) {
   return v;
 }
 
+void dropElements(std::vector<ValuePair> &values);
+
 ALWAYS_INLINE void drop(ValuePair v) {
   if (isAllocated(v.tag)) {
     switch (v.tag) {
-      case ValueTag::VECTOR:
+      case ValueTag::STRING:
+        account(ValueTag::STRING, -1, -stringBytes(*v.value.s));
+        delete v.value.s;
+        break;
+      case ValueTag::VECTOR: {
+        // elements are owned by the vector, drop them with the last reference
+        long bytes = sizeof(SVector);
+        if (v.value.vec->values.use_count() == 1) {
+          dropElements(*v.value.vec->values);
+          bytes += bufferBytes(*v.value.vec->values);
+        }
+        account(ValueTag::VECTOR, -1, -bytes);
         v.value.vec->values.reset();
         delete v.value.vec;
         break;
+      }
       case ValueTag::RANGE:
+        account(ValueTag::RANGE, -1, -static_cast<long>(sizeof(SRange)));
         delete v.value.range;
         break;
       default:
@@ -77,6 +258,141 @@ ALWAYS_INLINE void drop(ValuePair v) {
   }
 }
 
+void dropElements(std::vector<ValuePair> &values) {
+  for (auto v : values) drop(v);
+}
+
+// Vector buffers reachable more than once from the values. Threads dropping
+// references to the same buffer can each see the reference of the other and
+// skip the elements, so the caller holds these until the threads are done and
+// then releases them with releaseShared.
+static std::vector<std::shared_ptr<std::vector<ValuePair>>> holdShared(
+    const std::vector<ValuePair> &values) {
+  // whether each buffer reached so far is held
+  std::unordered_map<const std::vector<ValuePair> *, bool> reached;
+  std::vector<std::shared_ptr<std::vector<ValuePair>>> held;
+  std::vector<const std::vector<ValuePair> *> pending = {&values};
+  while (!pending.empty()) {
+    const auto *buffer = pending.back();
+    pending.pop_back();
+    for (auto v : *buffer) {
+      if (v.tag != ValueTag::VECTOR) continue;
+      const auto &elements = v.value.vec->values;
+      auto [iter, first] = reached.insert({elements.get(), false});
+      if (first) {
+        pending.push_back(elements.get());
+      } else if (!iter->second) {
+        iter->second = true;
+        held.push_back(elements);
+      }
+    }
+  }
+  return held;
+}
+
+static void releaseShared(
+    std::vector<std::shared_ptr<std::vector<ValuePair>>> &held) {
+  for (auto &values : held) {
+    if (values.use_count() == 1) {
+      dropElements(*values);
+      account(ValueTag::VECTOR, 0, -bufferBytes(*values));
+    }
+    values.reset();
+  }
+}
+
+// copy-on-write for shared vectors, the elements are copied as they are owned
+// by the vector
+SVector *cloneVector(const std::vector<ValuePair> &values) {
+  auto clone = std::make_shared<std::vector<ValuePair>>();
+  clone->reserve(values.size());
+  for (auto v : values) clone->push_back(copy(v));
+  account(ValueTag::VECTOR, 1, sizeof(SVector) + bufferBytes(*clone));
+  if (threadMemory != nullptr) increase(threadMemory->clones, 1ul);
+  return new SVector{clone};
+}
+
+// push_back or insert into the buffer of a vector, counting its growth
+template <typename F>
+static void growVector(std::vector<ValuePair> &values, F f) {
+  long capacity = values.capacity();
+  f();
+  long grown = static_cast<long>(values.capacity()) - capacity;
+  if (grown != 0)
+    account(ValueTag::VECTOR, 0, grown * static_cast<long>(sizeof(ValuePair)));
+}
+
+// hashing and equality for memoization keys. Numbers are compared by their bit
+// pattern, so 0 and -0 are different keys and NaN arguments can still hit.
+static uint64_t numberBits(double v) {
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(double));
+  return bits;
+}
+
+size_t hashValue(ValuePair v) {
+  switch (v.tag) {
+    case ValueTag::STRING:
+      return std::hash<std::string>()(*v.value.s);
+    case ValueTag::VECTOR: {
+      size_t hash = v.value.vec->values->size();
+      for (auto elem : *v.value.vec->values) hash = hash * 31 + hashValue(elem);
+      return hash;
+    }
+    case ValueTag::RANGE:
+      return (numberBits(v.value.range->begin) * 31 +
+              numberBits(v.value.range->step)) *
+                 31 +
+             numberBits(v.value.range->end);
+    case ValueTag::NUMBER:
+      return numberBits(v.value.number);
+    case ValueTag::BOOLEAN:
+      return v.value.cond;
+    default:
+      return v.tag;
+  }
+}
+
+// small integers only differ in the high bits of the double representation,
+// mix them down before using the low bits as the cache slot. A single
+// multiply round still maps them to a few slots.
+inline size_t mixHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bool sameValue(ValuePair lhs, ValuePair rhs) {
+  if (lhs.tag != rhs.tag) return false;
+  switch (lhs.tag) {
+    case ValueTag::VECTOR: {
+      auto &l = *lhs.value.vec->values;
+      auto &r = *rhs.value.vec->values;
+      if (&l == &r) return true;
+      if (l.size() != r.size()) return false;
+      for (size_t i = 0; i < l.size(); i++)
+        if (!sameValue(l[i], r[i])) return false;
+      return true;
+    }
+    case ValueTag::RANGE:
+      return numberBits(lhs.value.range->begin) ==
+                 numberBits(rhs.value.range->begin) &&
+             numberBits(lhs.value.range->step) ==
+                 numberBits(rhs.value.range->step) &&
+             numberBits(lhs.value.range->end) ==
+                 numberBits(rhs.value.range->end);
+    case ValueTag::NUMBER:
+      return numberBits(lhs.value.number) == numberBits(rhs.value.number);
+    case ValueTag::GEOMETRY:
+      return lhs.value.geometry == rhs.value.geometry;
+    default:
+      return lhs == rhs;
+  }
+}
+
 struct ImmediatePair {
   int immediate;
   int offset;
@@ -136,41 +452,39 @@ ALWAYS_INLINE ValuePair handleUnary(ValuePair v, BuiltinUnary op) {
     drop(v);
     return ValuePair::undef();
   }
+  return ValuePair(numericUnary(v.value.number, op));
+}
+
+// binary operations on numbers without tag checks, see NumBinaryOp
+inline ALWAYS_INLINE ValuePair numericBinary(double lhs, double rhs,
+                                             BinOp op) {
   switch (op) {
-    case BuiltinUnary::NEG:
-      return ValuePair(-v.value.number);
-    case BuiltinUnary::SIN:
-      return ValuePair(std::sin(v.value.number));
-    case BuiltinUnary::COS:
-      return ValuePair(std::cos(v.value.number));
-    case BuiltinUnary::TAN:
-      return ValuePair(std::tan(v.value.number));
-    case BuiltinUnary::ASIN:
-      return ValuePair(std::asin(v.value.number));
-    case BuiltinUnary::ACOS:
-      return ValuePair(std::acos(v.value.number));
-    case BuiltinUnary::ATAN:
-      return ValuePair(std::atan(v.value.number));
-    case BuiltinUnary::ABS:
-      return ValuePair(std::abs(v.value.number));
-    case BuiltinUnary::CEIL:
-      return ValuePair(std::ceil(v.value.number));
-    case BuiltinUnary::FLOOR:
-      return ValuePair(std::floor(v.value.number));
-    case BuiltinUnary::LN:
-      return ValuePair(std::log(v.value.number));
-    case BuiltinUnary::LOG:
-      return ValuePair(std::log10(v.value.number));
-    case BuiltinUnary::ROUND:
-      return ValuePair(std::round(v.value.number));
-    case BuiltinUnary::SIGN:
-      return ValuePair(v.value.number == 0.0  ? 0.0
-                       : v.value.number > 0.0 ? 1.0
-                                              : -1.0);
-    case BuiltinUnary::SQRT:
-      return ValuePair(std::sqrt(v.value.number));
+    case BinOp::ADD:
+      return ValuePair(lhs + rhs);
+    case BinOp::SUB:
+      return ValuePair(lhs - rhs);
+    case BinOp::MUL:
+      return ValuePair(lhs * rhs);
+    case BinOp::DIV:
+      return ValuePair(lhs / rhs);
+    case BinOp::MOD:
+      return ValuePair(std::fmod(lhs, rhs));
+    case BinOp::EXP:
+      return ValuePair(std::pow(lhs, rhs));
+    case BinOp::LT:
+      return ValuePair(lhs < rhs);
+    case BinOp::LE:
+      return ValuePair(lhs <= rhs);
+    case BinOp::GT:
+      return ValuePair(lhs > rhs);
+    case BinOp::GE:
+      return ValuePair(lhs >= rhs);
+    case BinOp::EQ:
+      return ValuePair(lhs == rhs);
+    case BinOp::NEQ:
+      return ValuePair(lhs != rhs);
     default:
-      unimplemented();
+      invalid();
   }
 }
 
@@ -226,7 +540,7 @@ ALWAYS_INLINE ValuePair handleBinary(ValuePair lhs, ValuePair rhs, BinOp op) {
       bool result = lhs == rhs;
       drop(lhs);
       drop(rhs);
-      return ValuePair(result);
+      return ValuePair(op == BinOp::EQ ? result : !result);
     }
     case BinOp::AND:
     case BinOp::OR: {
@@ -245,12 +559,12 @@ ALWAYS_INLINE ValuePair handleBinary(ValuePair lhs, ValuePair rhs, BinOp op) {
         return ValuePair::undef();
       }
       if (lhs.value.vec->values.use_count() != 1) {
-        auto lhsClone = new SVector{
-            std::make_shared<std::vector<ValuePair>>(*lhs.value.vec->values)};
+        auto lhsClone = cloneVector(*lhs.value.vec->values);
         drop(lhs);
         lhs = ValuePair(ValueTag::VECTOR, SValue{.vec = lhsClone});
       }
-      lhs.value.vec->values->push_back(rhs);
+      growVector(*lhs.value.vec->values,
+                 [&]() { lhs.value.vec->values->push_back(rhs); });
       return lhs;
     case BinOp::CONCAT:
       if (lhs.tag != ValueTag::VECTOR || rhs.tag != ValueTag::VECTOR) {
@@ -259,14 +573,23 @@ ALWAYS_INLINE ValuePair handleBinary(ValuePair lhs, ValuePair rhs, BinOp op) {
         return ValuePair::undef();
       }
       if (lhs.value.vec->values.use_count() != 1) {
-        auto lhsClone = new SVector{
-            std::make_shared<std::vector<ValuePair>>(*lhs.value.vec->values)};
+        auto lhsClone = cloneVector(*lhs.value.vec->values);
         drop(lhs);
         lhs = ValuePair(ValueTag::VECTOR, SValue{.vec = lhsClone});
       }
-      lhs.value.vec->values->insert(lhs.value.vec->values->end(),
-                                    rhs.value.vec->values->begin(),
-                                    rhs.value.vec->values->end());
+      growVector(*lhs.value.vec->values, [&]() {
+        if (rhs.value.vec->values.use_count() == 1) {
+          // unique, just move the elements
+          lhs.value.vec->values->insert(lhs.value.vec->values->end(),
+                                        rhs.value.vec->values->begin(),
+                                        rhs.value.vec->values->end());
+          rhs.value.vec->values->clear();
+        } else {
+          for (auto v : *rhs.value.vec->values)
+            lhs.value.vec->values->push_back(copy(v));
+        }
+      });
+      drop(rhs);
       return lhs;
     case BinOp::INDEX: {
       if (lhs.tag != ValueTag::VECTOR || rhs.tag != ValueTag::NUMBER) {
@@ -308,272 +631,1361 @@ inline void saveTop(bool &notop, const ValuePair &top,
   valueStack.push_back(top.value);
 }
 
-ValuePair Evaluator::eval(int id) {
+// Global accesses, calls and output of a function, without following the
+// calls. Returns false for invalid bytecode.
+static bool scanFunction(const FunctionEntry &fn, std::vector<int> *reads,
+                         std::vector<int> *writes, std::vector<int> *calls,
+                         bool *echoes = nullptr) {
+  const auto &code = fn.instructions;
+  size_t pc = 0;
+  while (pc < code.size()) {
+    auto inst = static_cast<Instruction>(code[pc]);
+    switch (inst) {
+      case Instruction::GetI:
+      case Instruction::SetI:
+      case Instruction::AddI:
+      case Instruction::JumpI:
+      case Instruction::JumpFalseI:
+      case Instruction::Iter:
+      case Instruction::ConstI:
+      case Instruction::GetGlobalI:
+      case Instruction::SetGlobalI:
+      case Instruction::CallI:
+      case Instruction::TailCallI:
+      case Instruction::SpecializeI:
+      case Instruction::MapI: {
+        if (pc + 1 >= code.size()) return false;
+        int immediate = static_cast<signed char>(code[pc + 1]);
+        int offset = 2;
+        if (code[pc + 1] == 0x80) {
+          if (pc + 5 >= code.size()) return false;
+          memcpy(&immediate, code.data() + pc + 2, sizeof(int));
+          offset = 6;
+        }
+        if (inst == Instruction::GetGlobalI)
+          reads->push_back(immediate);
+        else if (inst == Instruction::SetGlobalI)
+          writes->push_back(immediate);
+        else if (inst == Instruction::CallI ||
+                 inst == Instruction::TailCallI ||
+                 inst == Instruction::SpecializeI ||
+                 inst == Instruction::MapI)
+          calls->push_back(immediate);
+        pc += offset;
+        break;
+      }
+      case Instruction::BuiltinUnaryOp:
+      case Instruction::BinaryOp:
+      case Instruction::NumUnaryOp:
+      case Instruction::NumBinaryOp:
+      case Instruction::ConstMisc:
+        pc += 2;
+        break;
+      case Instruction::ConstNum:
+        pc += sizeof(double) + 1;
+        break;
+      case Instruction::Echo:
+        if (echoes != nullptr) *echoes = true;
+        pc += 1;
+        break;
+      case Instruction::Pop:
+      case Instruction::Dup:
+      case Instruction::Ret:
+      case Instruction::MakeRange:
+      case Instruction::MakeList:
+        pc += 1;
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+const Location *FunctionEntry::location(int pc) const {
+  auto iter = std::upper_bound(
+      lines.begin(), lines.end(), pc,
+      [](int pc, const std::pair<int, Location> &entry) {
+        return pc < entry.first;
+      });
+  if (iter == lines.begin()) return nullptr;
+  return &std::prev(iter)->second;
+}
+
+Program::Program(std::vector<FunctionEntry> functions,
+                 std::vector<ValueTag> globalTags,
+                 std::vector<SValue> globalValues,
+                 std::vector<ValuePair> constants)
+    : functions(checkPurity(std::move(functions))),
+      globalTags(std::move(globalTags)),
+      globalValues(std::move(globalValues)),
+      constants(std::move(constants)),
+      writesGlobals(findGlobalWrites(this->functions)) {
+  if (this->globalTags.size() != this->globalValues.size())
+    throw std::runtime_error("global tags and values do not match");
+}
+
+Program::~Program() {
+  for (size_t i = 0; i < globalTags.size(); i++)
+    drop(ValuePair(globalTags[i], globalValues[i]));
+  for (auto v : constants) drop(v);
+}
+
+std::vector<FunctionEntry> Program::checkPurity(
+    std::vector<FunctionEntry> functions) {
+  std::vector<std::vector<int>> calls(functions.size());
+  for (size_t i = 0; i < functions.size(); i++) {
+    if (!functions[i].pure) continue;
+    std::vector<int> reads, writes;
+    bool echoes = false;
+    if (!scanFunction(functions[i], &reads, &writes, &calls[i], &echoes) ||
+        echoes || !writes.empty())
+      functions[i].pure = false;
+  }
+  // greatest fixed point, like the purity computed by the code generator
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < functions.size(); i++) {
+      if (!functions[i].pure) continue;
+      for (int callee : calls[i]) {
+        if (callee < 0 || callee >= functions.size() ||
+            !functions[callee].pure) {
+          functions[i].pure = false;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+  return functions;
+}
+
+std::vector<bool> Program::findGlobalWrites(
+    const std::vector<FunctionEntry> &functions) {
+  std::vector<bool> result(functions.size(), false);
+  std::vector<std::vector<int>> calls(functions.size());
+  for (size_t i = 0; i < functions.size(); i++) {
+    std::vector<int> reads, writes;
+    bool valid = scanFunction(functions[i], &reads, &writes, &calls[i]);
+    result[i] = !valid || !writes.empty();
+  }
+  // least fixed point, a function only writes globals if some callee does
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < functions.size(); i++) {
+      if (result[i]) continue;
+      for (int callee : calls[i]) {
+        if (callee < 0 || callee >= functions.size() || result[callee]) {
+          result[i] = true;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+  return result;
+}
+
+void Program::globalAccess(int id, std::unordered_set<int> &reads,
+                           std::unordered_set<int> &writes) const {
+  std::vector<bool> visited(functions.size(), false);
+  std::vector<int> pending{id};
+  while (!pending.empty()) {
+    int current = pending.back();
+    pending.pop_back();
+    if (current < 0 || current >= functions.size())
+      throw std::runtime_error("invalid bytecode");
+    if (visited[current]) continue;
+    visited[current] = true;
+    std::vector<int> r, w;
+    if (!scanFunction(functions[current], &r, &w, &pending))
+      throw std::runtime_error("invalid bytecode");
+    reads.insert(r.begin(), r.end());
+    writes.insert(w.begin(), w.end());
+  }
+}
+
+std::string Program::describe(int function, int pc) const {
+  std::stringstream ss;
+  if (function < 0 || function >= functions.size()) {
+    ss << "f" << function;
+    return ss.str();
+  }
+  const auto &entry = functions[function];
+  if (entry.name.empty())
+    ss << "f" << function;
+  else
+    ss << entry.name;
+  const Location *loc = nullptr;
+  if (pc >= 0)
+    loc = entry.location(pc);
+  else if (!entry.lines.empty())
+    loc = &entry.lines.front().second;
+  if (loc != nullptr) ss << " (" << loc->begin << ")";
+  return ss.str();
+}
+
+static const char *stopMessage(StopReason reason) {
+  switch (reason) {
+    case StopReason::STOPPED:
+      return "evaluation stopped";
+    case StopReason::INSTRUCTION_BUDGET:
+      return "instruction budget exceeded";
+    case StopReason::TIME_BUDGET:
+      return "time budget exceeded";
+    case StopReason::MEMORY_LIMIT:
+      return "memory limit exceeded";
+  }
+  return "evaluation interrupted";
+}
+
+EvalInterrupted::EvalInterrupted(StopReason reason)
+    : std::runtime_error(stopMessage(reason)), reason(reason) {}
+
+// frames shown in the message of an EvalError, deep recursion is elided
+constexpr size_t backtraceFrames = 32;
+
+static std::string backtraceMessage(const std::string &message,
+                                    const std::vector<StackFrame> &backtrace,
+                                    const Program &program) {
+  std::stringstream ss;
+  ss << message;
+  for (size_t i = 0; i < backtrace.size(); i++) {
+    if (i == backtraceFrames) {
+      ss << "\n  ... " << backtrace.size() - i << " more frames";
+      break;
+    }
+    ss << "\n  at " << program.describe(backtrace[i].function, backtrace[i].pc);
+  }
+  return ss.str();
+}
+
+EvalError::EvalError(const std::string &message,
+                     std::vector<StackFrame> backtrace, const Program &program)
+    : std::runtime_error(backtraceMessage(message, backtrace, program)),
+      message(message),
+      backtrace(std::move(backtrace)) {}
+
+// VM state of an evaluation, kept in the evaluator while it is suspended
+struct Evaluator::State {
+  // the evaluation takes ownership of the arguments
+  State(int id, std::vector<ValuePair> &args) {
+    for (auto arg : args) {
+      tagStack.push_back(arg.tag);
+      valueStack.push_back(arg.value);
+    }
+    args.clear();
+  }
+  // release the values of an evaluation that did not complete
+  void release() {
+    for (size_t i = 0; i < tagStack.size(); i++)
+      drop(ValuePair(tagStack[i], valueStack[i]));
+    tagStack.clear();
+    valueStack.clear();
+    if (!notop) drop(top);
+    top = ValuePair::undef();
+    notop = true;
+  }
+
   std::vector<ValueTag> tagStack;
   std::vector<SValue> valueStack;
-  std::vector<int> rpStack({id});
-  std::vector<int> spStack({0});
-  std::vector<int> pcStack({0});
-  if (id >= functions.size()) invalid();
-  const auto *fn = &functions[id];
+  std::vector<int> rpStack;
+  std::vector<int> spStack{0};
+  std::vector<int> pcStack{0};
+  // memoization state of each call frame except the entry, only maintained
+  // when memoization is enabled
+  struct MemoFrame {
+    int slot;
+    unsigned long stamp;
+  };
+  std::vector<MemoFrame> memoFrames;
+  // After a native call bails out at some depth, the nested calls are likely
+  // to bail out as well. Stay in the interpreter for a while, until we return
+  // from the bailed out call.
+  size_t nativeFrom = 0;
+  size_t bailDepth = 0;
   // note that we do not put the logical top stack element into the stack for
-  // better performance.
+  // better performance. This is the result once the evaluation completes.
   ValuePair top = ValuePair::undef();
   bool notop = true;
   int pc = 0;
+  // call tree node of the current frame when profiling, -1 before the
+  // evaluation starts
+  int profileNode = -1;
+  // the evaluation running MapI for this one, its pc is the MapI
+  const State *caller = nullptr;
+  // frames and values of the callers, for the peak stack depth
+  size_t baseFrames = 0;
+  size_t baseValues = 0;
+  // time left of the time budget while suspended
+  std::chrono::steady_clock::duration timeLeft{0};
+};
 
-  auto bufferCheck = [&](int offset) {
-    if (UNLIKELY(pc + offset >= fn->instructions.size())) invalid();
+// defined here as Jit is incomplete in the header
+Evaluator::Evaluator(std::ostream *ostream,
+                     std::shared_ptr<const Program> program)
+    : ostream(ostream),
+      program(std::move(program)),
+      globalTags(this->program->globalTags.data()),
+      globalValues(this->program->globalValues.data()),
+      memory(std::make_unique<MemoryCounters>(&nextCheck)) {}
+
+Evaluator::Evaluator(std::ostream *ostream,
+                     std::vector<FunctionEntry> functions,
+                     std::vector<ValueTag> globalTags,
+                     std::vector<SValue> globalValues,
+                     std::vector<ValuePair> constants)
+    : Evaluator(ostream, std::make_shared<const Program>(
+                             std::move(functions), std::move(globalTags),
+                             std::move(globalValues), std::move(constants))) {}
+
+Evaluator::~Evaluator() {
+  cancel();
+  dropOwnGlobals();
+  clearMemo();
+}
+
+void Evaluator::release(ValuePair value) { drop(value); }
+
+ValuePair Evaluator::getGlobal(int index) const {
+  if (index < 0 || index >= program->globalTags.size())
+    throw std::runtime_error("invalid global index");
+  return copy(ValuePair(globalTags[index], globalValues[index]));
+}
+
+void Evaluator::setGlobal(int index, ValuePair value) {
+  if (index < 0 || index >= program->globalTags.size()) {
+    drop(value);
+    throw std::runtime_error("invalid global index");
+  }
+  if (!ownGlobals) copyGlobals(globalTags, globalValues);
+  drop(ValuePair(ownGlobalTags[index], ownGlobalValues[index]));
+  ownGlobalTags[index] = value.tag;
+  ownGlobalValues[index] = value.value;
+  if (!memoCache.empty()) clearMemo();
+}
+
+void Evaluator::setGlobals(const Evaluator &other) {
+  if (&other == this) return;
+  if (other.program != program)
+    throw std::runtime_error("evaluators run different programs");
+  dropOwnGlobals();
+  // globals still shared with the program stay shared
+  if (other.ownGlobals) copyGlobals(other.globalTags, other.globalValues);
+  if (!memoCache.empty()) clearMemo();
+}
+
+void Evaluator::dropOwnGlobals() {
+  for (size_t i = 0; i < ownGlobalTags.size(); i++)
+    drop(ValuePair(ownGlobalTags[i], ownGlobalValues[i]));
+  ownGlobalTags.clear();
+  ownGlobalValues.clear();
+  globalTags = program->globalTags.data();
+  globalValues = program->globalValues.data();
+  ownGlobals = false;
+}
+
+void Evaluator::copyGlobals(const ValueTag *tags, const SValue *values) {
+  size_t count = program->globalTags.size();
+  ownGlobalTags.assign(tags, tags + count);
+  ownGlobalValues.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    ownGlobalValues.push_back(copy(ValuePair(tags[i], values[i])).value);
+  globalTags = ownGlobalTags.data();
+  globalValues = ownGlobalValues.data();
+  ownGlobals = true;
+}
+
+void Evaluator::setMemoization(size_t capacity) {
+  clearMemo();
+  size_t size = 0;
+  if (capacity > 0)
+    for (size = 1; size < capacity; size <<= 1)
+      ;
+  memoCache.resize(size);
+  memoCache.shrink_to_fit();
+  stats = MemoStats();
+}
+
+void Evaluator::setJit(int threshold) {
+  if (threshold < 0 || !Jit::supported())
+    jit.reset();
+  else
+    jit = std::make_unique<Jit>(program->functions, threshold);
+}
+
+JitStats Evaluator::jitStats() const {
+  return jit != nullptr ? jit->stats : JitStats();
+}
+
+std::vector<ValuePair> Evaluator::evalAll(const std::vector<int> &ids) {
+  std::vector<ValuePair> results(ids.size(), ValuePair::undef());
+  bool parallel = pool != nullptr && ids.size() > 1;
+  for (size_t i = 0; parallel && i < ids.size(); i++)
+    parallel = ids[i] >= 0 && ids[i] < program->functions.size() &&
+               !program->writesGlobals[ids[i]];
+  startLimits();
+  if (!parallel) {
+    try {
+      for (size_t i = 0; i < ids.size(); i++) {
+        std::vector<ValuePair> args;
+        results[i] = run(ids[i], args);
+      }
+    } catch (const EvalInterrupted &) {
+      for (auto v : results) drop(v);
+      flag.store(true, std::memory_order_relaxed);
+      throw;
+    } catch (...) {
+      for (auto v : results) drop(v);
+      throw;
+    }
+    return results;
+  }
+
+  struct Context {
+    std::stringstream output;
+    std::unique_ptr<Evaluator> evaluator;
   };
+  // the workers are released after this scope, their globals count for this
+  // evaluation like the rest of their counters
+  MemoryScope scope(memory.get());
+  std::vector<Context> contexts(pool->size());
+  std::vector<std::string> outputs(ids.size());
+  std::vector<std::exception_ptr> errors(ids.size());
+  pool->parallelFor(
+      ids.size(), 1, [&](size_t begin, size_t end, unsigned int worker) {
+        auto &context = contexts[worker];
+        if (context.evaluator == nullptr) {
+          context.evaluator =
+              std::make_unique<Evaluator>(&context.output, program);
+          context.evaluator->inheritLimits(*this);
+          MemoryScope scope(context.evaluator->memory.get());
+          context.evaluator->setGlobals(*this);
+          if (profileData != nullptr)
+            context.evaluator->profileData =
+                std::make_unique<Profile>(program);
+          context.evaluator->sampler = sampler;
+          context.evaluator->echoLocations = echoLocations;
+        }
+        for (size_t i = begin; i < end; i++) {
+          try {
+            std::vector<ValuePair> args;
+            results[i] = context.evaluator->run(ids[i], args);
+          } catch (...) {
+            errors[i] = std::current_exception();
+          }
+          outputs[i] = context.output.str();
+          context.output.str("");
+        }
+      });
+  std::vector<const MemoryCounters *> workerMemory;
+  for (auto &context : contexts) {
+    if (context.evaluator == nullptr) continue;
+    executed += context.evaluator->executed;
+    workerMemory.push_back(context.evaluator->memory.get());
+    if (profileData != nullptr)
+      profileData->merge(*context.evaluator->profileData, profileNode);
+  }
+  memory->merge(workerMemory);
+  // the output a serial evaluation would produce
+  for (size_t i = 0; i < ids.size(); i++) {
+    *ostream << outputs[i];
+    if (errors[i] != nullptr) {
+      for (auto v : results) drop(v);
+      try {
+        std::rethrow_exception(errors[i]);
+      } catch (const EvalInterrupted &) {
+        flag.store(true, std::memory_order_relaxed);
+        throw;
+      }
+    }
+  }
+  return results;
+}
 
-  long counter = 0;
-  while (true) {
-    Instruction inst = static_cast<Instruction>(fn->instructions[pc]);
-    counter++;
-    switch (inst) {
-      case Instruction::GetI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        saveTop(notop, top, tagStack, valueStack);
-        int index = spStack.back() + immediate;
-        if (index < 0 || index >= tagStack.size()) invalid();
-        top = copy(ValuePair(tagStack[index], valueStack[index]));
-        pc += offset;
+void Evaluator::setThreadPool(std::shared_ptr<ThreadPool> pool,
+                              size_t minElements) {
+  this->pool = std::move(pool);
+  parallelMin = minElements;
+}
+
+void Evaluator::setInstructionBudget(unsigned long instructions) {
+  instructionBudget = instructions;
+}
+
+void Evaluator::setTimeBudget(std::chrono::steady_clock::duration time) {
+  timeBudget = time;
+}
+
+// instructions between checks for interrupts when there is no closer limit,
+// well below a millisecond of work
+constexpr unsigned long checkInterval = 1 << 16;
+// instructions between checks for sampler ticks, a few microseconds
+constexpr unsigned long sampleInterval = 1 << 10;
+constexpr unsigned long noLimit = std::numeric_limits<unsigned long>::max();
+constexpr long noMemoryLimit = std::numeric_limits<long>::max();
+
+void Evaluator::startLimits() {
+  if (suspendedState != nullptr)
+    throw std::runtime_error("evaluator has a suspended evaluation");
+  parent = nullptr;
+  executed = 0;
+  instructionLimit = instructionBudget > 0 ? instructionBudget : noLimit;
+  deadline = timeBudget.count() > 0
+                 ? std::chrono::steady_clock::now() + timeBudget
+                 : std::chrono::steady_clock::time_point::max();
+  memory->reset(memoryLimit > 0 && memoryLimit < noMemoryLimit
+                    ? static_cast<long>(memoryLimit)
+                    : noMemoryLimit);
+  // check right away, for stops requested before the evaluation
+  nextCheck = 0;
+  profileNode = 0;
+}
+
+void Evaluator::inheritLimits(const Evaluator &other) {
+  parent = other.parent != nullptr ? other.parent : &other;
+  executed = 0;
+  instructionLimit = other.instructionLimit == noLimit ? noLimit
+                     : other.executed < other.instructionLimit
+                         ? other.instructionLimit - other.executed
+                         : 0;
+  deadline = other.deadline;
+  const long limit = other.memory->limit;
+  memory->reset(limit == noMemoryLimit
+                    ? noMemoryLimit
+                    : limit - other.memory->bytes.load(
+                                  std::memory_order_relaxed));
+  nextCheck = 0;
+}
+
+MemoryStats Evaluator::memoryStats() const { return memory->stats(); }
+
+bool Evaluator::limited() const {
+  return instructionLimit != noLimit ||
+         deadline != std::chrono::steady_clock::time_point::max();
+}
+
+COLD bool Evaluator::checkInterrupt(unsigned long counter, const State &state,
+                                   int pc, bool suspendable) {
+  executed = counter;
+  if (sampler != nullptr) {
+    unsigned long tick = sampler->ticks();
+    if (tick != sampledTick) {
+      sampledTick = tick;
+      takeSample(state, pc);
+    }
+  }
+  const Evaluator *root = parent != nullptr ? parent : this;
+  if (!root->flag.load(std::memory_order_relaxed))
+    throw EvalInterrupted(StopReason::STOPPED);
+  if (counter >= instructionLimit)
+    throw EvalInterrupted(StopReason::INSTRUCTION_BUDGET);
+  if (deadline != std::chrono::steady_clock::time_point::max() &&
+      std::chrono::steady_clock::now() >= deadline)
+    throw EvalInterrupted(StopReason::TIME_BUDGET);
+  if (memory->bytes.load(std::memory_order_relaxed) > memory->limit)
+    throw EvalInterrupted(StopReason::MEMORY_LIMIT);
+  // loops can grow the stack without calls
+  raise(memory->peakFrames, state.baseFrames + state.rpStack.size());
+  raise(memory->peakStackValues, state.baseValues + state.tagStack.size());
+  unsigned long next = std::min(checkInterval, instructionLimit - counter);
+  if (sampler != nullptr) next = std::min(next, sampleInterval);
+  if (suspendable) {
+    if (counter >= suspendAt ||
+        suspendFlag.exchange(false, std::memory_order_relaxed))
+      return true;
+    next = std::min(next, suspendAt - counter);
+  }
+  nextCheck = counter + next;
+  return false;
+}
+
+void Evaluator::setProfiling(bool enabled) {
+  if (!enabled)
+    profileData.reset();
+  else if (profileData == nullptr)
+    profileData = std::make_unique<Profile>(program);
+}
+
+void Evaluator::setSampler(std::shared_ptr<Sampler> sampler) {
+  if (sampler != nullptr && sampler->program != program)
+    throw std::runtime_error("sampler is for a different program");
+  this->sampler = std::move(sampler);
+}
+
+template <typename F>
+void Evaluator::walkFrames(const State &state, int pc, F f) {
+  for (const State *s = &state; s != nullptr; s = s->caller) {
+    if (s != &state) pc = s->pc;
+    for (size_t i = s->rpStack.size(); i-- > 0;) {
+      if (!f(s->rpStack[i], pc)) return;
+      // the call in the caller frame
+      pc = s->pcStack[i] - 1;
+    }
+  }
+}
+
+void Evaluator::takeSample(const State &state, int pc) {
+  Sampler::Sample sample;
+  walkFrames(state, pc, [&](int function, int pc) {
+    if (sample.depth == Sampler::maxFrames) {
+      sample.truncated = true;
+      return false;
+    }
+    sample.functions[sample.depth] = function;
+    sample.pcs[sample.depth] = pc;
+    sample.depth++;
+    return true;
+  });
+  sampler->add(sample);
+}
+
+void Evaluator::clearMemo() {
+  for (auto &entry : memoCache) {
+    for (auto v : entry.args) drop(v);
+    entry.args.clear();
+    drop(entry.result);
+    entry.result = ValuePair::undef();
+    entry.function = -1;
+    entry.pending = false;
+    // invalidate calls that are still waiting for this entry
+    entry.stamp = ++memoStamp;
+  }
+}
+
+ValuePair Evaluator::eval(int id) {
+  startLimits();
+  std::vector<ValuePair> args;
+  try {
+    return run(id, args);
+  } catch (const EvalInterrupted &) {
+    // the stop request is handled
+    flag.store(true, std::memory_order_relaxed);
+    throw;
+  }
+}
+
+ValuePair Evaluator::map(int id, std::vector<ValuePair> &captured,
+                         ValuePair list) {
+  std::vector<ValuePair> elements;
+  if (list.tag == ValueTag::VECTOR) {
+    elements.reserve(list.value.vec->values->size());
+    for (auto v : *list.value.vec->values) elements.push_back(copy(v));
+    drop(list);
+  } else if (list.tag == ValueTag::RANGE) {
+    auto r = *list.value.range;
+    drop(list);
+    // same as Iter
+    if (r.step > 0)
+      for (size_t i = 0; i * r.step + r.begin <= r.end; i++)
+        elements.push_back(ValuePair(i * r.step + r.begin));
+  } else {
+    elements.push_back(list);
+  }
+
+  std::vector<ValuePair> results(elements.size(), ValuePair::undef());
+  auto call = [&](Evaluator &context, size_t i) {
+    std::vector<ValuePair> args;
+    args.reserve(captured.size() + 1);
+    for (auto v : captured) args.push_back(copy(v));
+    args.push_back(elements[i]);
+    elements[i] = ValuePair::undef();
+    results[i] = context.run(id, args);
+  };
+  std::exception_ptr error;
+  if (pool != nullptr && program->functions[id].pure &&
+      elements.size() >= parallelMin) {
+    // The workers only copy values out of this evaluator, and pure functions
+    // do not write globals. Buffers shared by elements, e.g. v in
+    // [for (x = [v, v]) ...], are released here after the workers.
+    auto shared = holdShared(elements);
+    std::vector<std::unique_ptr<Evaluator>> contexts(pool->size());
+    std::vector<std::exception_ptr> errors(elements.size());
+    size_t grain = std::max<size_t>(1, elements.size() / (pool->size() * 16));
+    pool->parallelFor(
+        elements.size(), grain,
+        [&](size_t begin, size_t end, unsigned int worker) {
+          auto &context = contexts[worker];
+          if (context == nullptr) {
+            context = std::make_unique<Evaluator>(ostream, program);
+            context->inheritLimits(*this);
+            MemoryScope scope(context->memory.get());
+            context->setGlobals(*this);
+            if (profileData != nullptr)
+              context->profileData = std::make_unique<Profile>(program);
+            // the samples of the workers include the frames of this thread
+            context->sampler = sampler;
+            context->activeState = activeState;
+          }
+          // the arguments copied for the worker count for it, and are
+          // merged into this evaluation with the rest of its counters
+          MemoryScope scope(context->memory.get());
+          for (size_t i = begin; i < end; i++) {
+            try {
+              call(*context, i);
+            } catch (...) {
+              errors[i] = std::current_exception();
+            }
+          }
+        });
+    releaseShared(shared);
+    std::vector<const MemoryCounters *> workerMemory;
+    for (auto &context : contexts) {
+      if (context == nullptr) continue;
+      executed += context->executed;
+      workerMemory.push_back(context->memory.get());
+      if (profileData != nullptr)
+        profileData->merge(*context->profileData, profileNode);
+    }
+    memory->merge(workerMemory);
+    // report the same error regardless of scheduling
+    for (auto &e : errors)
+      if (e != nullptr) {
+        error = e;
         break;
       }
-      case Instruction::AddI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        if (LIKELY(top.tag == ValueTag::NUMBER))
-          top.value.number += immediate;
-        else
-          unimplemented();
-        pc += offset;
-        break;
+  } else {
+    try {
+      for (size_t i = 0; i < elements.size(); i++) call(*this, i);
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  for (auto v : captured) drop(v);
+  if (error) {
+    for (auto v : elements) drop(v);
+    for (auto v : results) drop(v);
+    std::rethrow_exception(error);
+  }
+
+  auto values = std::make_shared<std::vector<ValuePair>>();
+  for (auto v : results) {
+    if (v.tag == ValueTag::VECTOR) {
+      if (v.value.vec->values.use_count() == 1) {
+        // unique, just move the elements
+        values->insert(values->end(), v.value.vec->values->begin(),
+                       v.value.vec->values->end());
+        v.value.vec->values->clear();
+      } else {
+        for (auto elem : *v.value.vec->values) values->push_back(copy(elem));
       }
-      case Instruction::SetI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        int index = spStack.back() + immediate;
-        if (index < 0 || index >= tagStack.size()) invalid();
-        tagStack[index] = top.tag;
-        valueStack[index] = top.value;
-        top = popvalue(tagStack, valueStack);
-        pc += offset;
-        break;
+    }
+    drop(v);
+  }
+  account(ValueTag::VECTOR, 1, sizeof(SVector) + bufferBytes(*values));
+  return ValuePair(ValueTag::VECTOR, SValue{.vec = new SVector{values}});
+}
+
+void Evaluator::start(int id) {
+  startLimits();
+  std::vector<ValuePair> args;
+  suspendedState = std::make_unique<State>(id, args);
+  suspendedState->rpStack.push_back(id);
+  if (deadline != std::chrono::steady_clock::time_point::max())
+    suspendedState->timeLeft = timeBudget;
+}
+
+std::optional<ValuePair> Evaluator::resume(unsigned long quantum) {
+  if (suspendedState == nullptr)
+    throw std::runtime_error("no evaluation to resume");
+  // the state is released with any error, which ends the evaluation
+  auto state = std::move(suspendedState);
+  if (deadline != std::chrono::steady_clock::time_point::max())
+    deadline = std::chrono::steady_clock::now() + state->timeLeft;
+  suspendAt = quantum > 0 && executed < noLimit - quantum ? executed + quantum
+                                                          : noLimit;
+  nextCheck = 0;
+  bool done;
+  try {
+    done = execute(*state, true);
+  } catch (const EvalInterrupted &) {
+    flag.store(true, std::memory_order_relaxed);
+    throw;
+  }
+  if (done) return state->top;
+  if (deadline != std::chrono::steady_clock::time_point::max())
+    state->timeLeft = deadline - std::chrono::steady_clock::now();
+  suspendedState = std::move(state);
+  return std::nullopt;
+}
+
+void Evaluator::cancel() {
+  if (suspendedState == nullptr) return;
+  suspendedState->release();
+  suspendedState.reset();
+}
+
+ValuePair Evaluator::run(int id, std::vector<ValuePair> &args) {
+  State state(id, args);
+  state.rpStack.push_back(id);
+  execute(state, false);
+  return state.top;
+}
+
+bool Evaluator::execute(State &state, bool suspendable) {
+  if (UNLIKELY(profileData != nullptr))
+    return interpret<true>(state, suspendable);
+  return interpret<false>(state, suspendable);
+}
+
+template <bool profiled>
+bool Evaluator::interpret(State &state, bool suspendable) {
+  const auto &functions = program->functions;
+  const auto &constants = program->constants;
+  const size_t globalCount = program->globalTags.size();
+  auto &tagStack = state.tagStack;
+  auto &valueStack = state.valueStack;
+  auto &rpStack = state.rpStack;
+  auto &spStack = state.spStack;
+  auto &pcStack = state.pcStack;
+  auto &memoFrames = state.memoFrames;
+  using MemoFrame = State::MemoFrame;
+  // registers, stored back into the state when suspending
+  size_t nativeFrom = state.nativeFrom;
+  size_t bailDepth = state.bailDepth;
+  if (rpStack.back() >= functions.size()) invalid();
+  const auto *fn = &functions[rpStack.back()];
+  ValuePair top = state.top;
+  bool notop = state.notop;
+  int pc = state.pc;
+  // profiling registers, the cycles are attributed to the previous opcode
+  int node = 0;
+  int lastOp = -1;
+  unsigned long lastCycles = 0;
+  if constexpr (profiled) {
+    if (state.profileNode < 0) {
+      state.profileNode = profileData->child(profileNode, rpStack.back());
+      profileData->calls[rpStack.back()]++;
+    }
+    node = state.profileNode;
+    lastCycles = Profile::cycles();
+  }
+
+  auto bufferCheck = [&](int offset) {
+    if (UNLIKELY(pc + offset >= fn->instructions.size())) invalid();
+  };
+
+  // the instruction count is kept in a local and stored in `executed` when
+  // another function needs it
+  unsigned long counter = executed;
+  // store the registers when suspending before the instruction at pc, which
+  // runs again when resuming
+  auto save = [&](unsigned long count) {
+    executed = count;
+    if constexpr (profiled) state.profileNode = node;
+    state.nativeFrom = nativeFrom;
+    state.bailDepth = bailDepth;
+    state.top = top;
+    state.notop = notop;
+    state.pc = pc;
+    return false;
+  };
+  // suspend before the current instruction, which was already counted
+  auto suspend = [&]() {
+    if constexpr (profiled) {
+      profileData->opcodes[lastOp].count--;
+      profileData->nodes[node].instructions--;
+      profileData->pcCounts[rpStack.back()][pc]--;
+    }
+    return save(counter - 1);
+  };
+  // nested evaluations link to this one, for the samples and the stack depth
+  struct Activation {
+    Evaluator *evaluator;
+    State *outer;
+    ~Activation() { evaluator->activeState = outer; }
+  } activation{this, activeState};
+  MemoryScope memoryScope(memory.get());
+  state.caller = activeState;
+  if (state.caller != nullptr) {
+    state.baseFrames = state.caller->baseFrames + state.caller->rpStack.size();
+    state.baseValues = state.caller->baseValues + state.caller->tagStack.size();
+  }
+  activeState = &state;
+  if (UNLIKELY(counter >= nextCheck) &&
+      checkInterrupt(counter, state, pc, suspendable))
+    return save(counter);
+  // native code only checks the stop flag, it cannot count instructions or
+  // suspend
+  const bool interruptible = limited() || suspendable;
+  const std::atomic<bool> *running = parent != nullptr ? &parent->flag : &flag;
+  try {
+    while (true) {
+      Instruction inst = static_cast<Instruction>(fn->instructions[pc]);
+      counter++;
+      if constexpr (profiled) {
+        auto now = Profile::cycles();
+        if (lastOp >= 0)
+          profileData->opcodes[lastOp].cycles += now - lastCycles;
+        lastCycles = now;
+        lastOp = static_cast<int>(inst);
+        profileData->opcodes[lastOp].count++;
+        profileData->nodes[node].instructions++;
+        profileData->pcCounts[rpStack.back()][pc]++;
       }
-      case Instruction::JumpI:
-      case Instruction::JumpFalseI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        int target = pc + immediate;
-        if (target < 0 || target >= fn->instructions.size()) invalid();
-        if (inst == Instruction::JumpFalseI) {
-          // boolean cast
-          if (top.tag != ValueTag::BOOLEAN) unimplemented();
-          if (top.value.cond) target = pc + offset;
+      switch (inst) {
+        case Instruction::GetI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          saveTop(notop, top, tagStack, valueStack);
+          int index = spStack.back() + immediate;
+          if (index < 0 || index >= tagStack.size()) invalid();
+          top = copy(ValuePair(tagStack[index], valueStack[index]));
+          pc += offset;
+          break;
+        }
+        case Instruction::AddI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (LIKELY(top.tag == ValueTag::NUMBER))
+            top.value.number += immediate;
+          else
+            unimplemented();
+          pc += offset;
+          break;
+        }
+        case Instruction::SetI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          int index = spStack.back() + immediate;
+          if (index < 0 || index >= tagStack.size()) invalid();
+          tagStack[index] = top.tag;
+          valueStack[index] = top.value;
           top = popvalue(tagStack, valueStack);
+          pc += offset;
+          break;
         }
-        pc = target;
-        break;
-      }
-      case Instruction::Iter: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        int target = pc + immediate;
-        if (target < 0 || target >= fn->instructions.size()) invalid();
-        if (tagStack.empty() || valueStack.empty()) invalid();
-        if (top.tag != ValueTag::NUMBER) invalid();
-        top.value.number += 1;
-        if (tagStack.back() == ValueTag::VECTOR) {
-          if (valueStack.back().vec->values->size() <= top.value.number) {
-            drop(popvalue(tagStack, valueStack));
+        case Instruction::JumpI:
+        case Instruction::JumpFalseI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          int target = pc + immediate;
+          if (target < 0 || target >= fn->instructions.size()) invalid();
+          // loops always jump backward
+          if (immediate <= 0 && UNLIKELY(counter >= nextCheck) &&
+              checkInterrupt(counter, state, pc, suspendable))
+            return suspend();
+          if (inst == Instruction::JumpFalseI) {
+            // boolean cast
+            if (top.tag != ValueTag::BOOLEAN) unimplemented();
+            if (top.value.cond) target = pc + offset;
             top = popvalue(tagStack, valueStack);
-          } else {
-            auto elem =
-                copy(valueStack.back().vec->values->at(top.value.number));
-            saveTop(notop, top, tagStack, valueStack);
-            top = elem;
-            target = pc + offset;
           }
-        } else if (tagStack.back() == ValueTag::RANGE) {
-          auto r = *valueStack.back().range;
-          auto newValue = top.value.number * r.step + r.begin;
-          if (newValue > r.end) {
-            drop(popvalue(tagStack, valueStack));
-            top = popvalue(tagStack, valueStack);
+          pc = target;
+          break;
+        }
+        case Instruction::Iter: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          int target = pc + immediate;
+          if (target < 0 || target >= fn->instructions.size()) invalid();
+          if (tagStack.empty() || valueStack.empty()) invalid();
+          if (top.tag != ValueTag::NUMBER) invalid();
+          top.value.number += 1;
+          if (tagStack.back() == ValueTag::VECTOR) {
+            if (valueStack.back().vec->values->size() <= top.value.number) {
+              drop(popvalue(tagStack, valueStack));
+              top = popvalue(tagStack, valueStack);
+            } else {
+              auto elem =
+                  copy(valueStack.back().vec->values->at(top.value.number));
+              saveTop(notop, top, tagStack, valueStack);
+              top = elem;
+              target = pc + offset;
+            }
+          } else if (tagStack.back() == ValueTag::RANGE) {
+            auto r = *valueStack.back().range;
+            auto newValue = top.value.number * r.step + r.begin;
+            // a step that never reaches the end gives nothing, like OpenSCAD
+            if (!(r.step > 0) || newValue > r.end) {
+              drop(popvalue(tagStack, valueStack));
+              top = popvalue(tagStack, valueStack);
+            } else {
+              saveTop(notop, top, tagStack, valueStack);
+              top = ValuePair(newValue);
+              target = pc + offset;
+            }
           } else {
-            saveTop(notop, top, tagStack, valueStack);
-            top = ValuePair(newValue);
-            target = pc + offset;
+            invalid();
           }
-        } else {
-          invalid();
+          pc = target;
+          break;
         }
-        pc = target;
-        break;
-      }
-      case Instruction::Pop: {
-        drop(top);
-        top = popvalue(tagStack, valueStack);
-        pc += 1;
-        break;
-      }
-      case Instruction::Dup: {
-        saveTop(notop, top, tagStack, valueStack);
-        top = copy(top);
-        pc += 1;
-        break;
-      }
-      case Instruction::BuiltinUnaryOp: {
-        bufferCheck(1);
-        BuiltinUnary op = static_cast<BuiltinUnary>(fn->instructions[pc + 1]);
-        top = handleUnary(top, op);
-        pc += 2;
-        break;
-      }
-      case Instruction::BinaryOp: {
-        bufferCheck(1);
-        BinOp op = static_cast<BinOp>(fn->instructions[pc + 1]);
-        if (tagStack.empty() || valueStack.empty()) invalid();
-        top = handleBinary(popvalue(tagStack, valueStack), top, op);
-        pc += 2;
-        break;
-      }
-      case Instruction::ConstNum: {
-        bufferCheck(1 + sizeof(double));
-        double v;
-        memcpy(&v, fn->instructions.data() + pc + 1, sizeof(double));
-        saveTop(notop, top, tagStack, valueStack);
-        top = ValuePair(v);
-        pc += sizeof(double) + 1;
-        break;
-      }
-      case Instruction::ConstMisc: {
-        bufferCheck(1);
-        saveTop(notop, top, tagStack, valueStack);
-        switch (fn->instructions[pc + 1]) {
-          case 0:
-            top = ValuePair(false);
-            break;
-          case 1:
-            top = ValuePair(true);
-            break;
-          default:
-            top = ValuePair::undef();
+        case Instruction::MapI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (immediate < 0 || immediate >= functions.size()) invalid();
+          if (notop) invalid();
+          int start = valueStack.size() - functions[immediate].parameters + 1;
+          if (start < spStack.back() || start > valueStack.size()) invalid();
+          std::vector<ValuePair> captured;
+          for (int i = start; i < valueStack.size(); i++)
+            captured.push_back(ValuePair(tagStack[i], valueStack[i]));
+          tagStack.resize(start);
+          valueStack.resize(start);
+          // map owns the list, and counts instructions from `executed`
+          auto list = top;
+          top = ValuePair::undef();
+          executed = counter;
+          state.pc = pc;
+          if constexpr (profiled) profileNode = node;
+          top = map(immediate, captured, list);
+          counter = executed;
+          pc += offset;
+          break;
         }
-        pc += 2;
-        break;
-      }
-      case Instruction::GetGlobalI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        saveTop(notop, top, tagStack, valueStack);
-        if (immediate < 0 || immediate >= globalTags.size()) invalid();
-        top = copy(ValuePair(globalTags[immediate], globalValues[immediate]));
-        pc += offset;
-        break;
-      }
-      case Instruction::SetGlobalI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        if (immediate < 0 || immediate >= globalTags.size()) invalid();
-        globalTags[immediate] = top.tag;
-        globalValues[immediate] = top.value;
-        top = popvalue(tagStack, valueStack);
-        pc += offset;
-        break;
-      }
-      case Instruction::CallI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        if (immediate >= functions.size()) invalid();
-        fn = &functions[immediate];
-        saveTop(notop, top, tagStack, valueStack);
-        pcStack.push_back(pc + offset);
-        rpStack.push_back(immediate);
-        spStack.push_back(valueStack.size() - fn->parameters);
-        pc = 0;
-        notop = true;
-        break;
-      }
-      case Instruction::TailCallI: {
-        auto [immediate, offset] = getImmediate(fn, pc);
-        if (immediate >= functions.size()) invalid();
-        fn = &functions[immediate];
-        saveTop(notop, top, tagStack, valueStack);
-
-        int sp = spStack.back();
-        int params = fn->parameters;
-        int stackEnd = valueStack.size() - params;
-        for (int i = sp; i < stackEnd; i++) {
-          drop(ValuePair(tagStack[i], valueStack[i]));
+        case Instruction::Pop: {
+          drop(top);
+          top = popvalue(tagStack, valueStack);
+          pc += 1;
+          break;
         }
-        for (int i = 0; i < params; i++) {
-          tagStack[sp + i] = tagStack[stackEnd + i];
-          valueStack[sp + i] = valueStack[stackEnd + i];
+        case Instruction::Dup: {
+          saveTop(notop, top, tagStack, valueStack);
+          top = copy(top);
+          pc += 1;
+          break;
         }
-        tagStack.resize(sp + params);
-        valueStack.resize(sp + params);
-        rpStack.back() = immediate;
-        pc = 0;
-        notop = true;
-        break;
-      }
-      case Instruction::Ret: {
-        // this is undefined behavior
-        if (notop) invalid();
-        rpStack.pop_back();
-        int sp = spStack.back();
-        spStack.pop_back();
-        for (int i = sp; i < valueStack.size(); i++) {
-          drop(ValuePair(tagStack[i], valueStack[i]));
+        case Instruction::BuiltinUnaryOp: {
+          bufferCheck(1);
+          BuiltinUnary op = static_cast<BuiltinUnary>(fn->instructions[pc + 1]);
+          top = handleUnary(top, op);
+          pc += 2;
+          break;
         }
-        tagStack.resize(sp + 1);
-        valueStack.resize(sp + 1);
-        if (pcStack.size() == 1) {
-          // *ostream << "instructions executed: " << counter << std::endl;
-          return top;
+        case Instruction::BinaryOp: {
+          bufferCheck(1);
+          BinOp op = static_cast<BinOp>(fn->instructions[pc + 1]);
+          if (tagStack.empty() || valueStack.empty()) invalid();
+          top = handleBinary(popvalue(tagStack, valueStack), top, op);
+          pc += 2;
+          break;
         }
-        fn = &functions[rpStack.back()];
-        pc = pcStack.back();
-        pcStack.pop_back();
-        break;
-      }
-      case Instruction::MakeRange: {
-        if (tagStack.size() <= 1 || valueStack.size() <= 1) invalid();
-        auto step = popvalue(tagStack, valueStack);
-        auto start = popvalue(tagStack, valueStack);
-        auto end = top;
-        if (start.tag != ValueTag::NUMBER || step.tag != ValueTag::NUMBER ||
-            end.tag != ValueTag::NUMBER) {
-          drop(start);
-          drop(step);
-          drop(end);
-          top = ValuePair::undef();
-        } else {
+        case Instruction::NumUnaryOp: {
+          bufferCheck(1);
+          BuiltinUnary op = static_cast<BuiltinUnary>(fn->instructions[pc + 1]);
+          top.value.number = numericUnary(top.value.number, op);
+          pc += 2;
+          break;
+        }
+        case Instruction::NumBinaryOp: {
+          bufferCheck(1);
+          BinOp op = static_cast<BinOp>(fn->instructions[pc + 1]);
+          if (tagStack.empty() || valueStack.empty()) invalid();
+          double lhs = valueStack.back().number;
+          tagStack.pop_back();
+          valueStack.pop_back();
+          top = numericBinary(lhs, top.value.number, op);
+          pc += 2;
+          break;
+        }
+        case Instruction::ConstNum: {
+          bufferCheck(1 + sizeof(double));
+          double v;
+          memcpy(&v, fn->instructions.data() + pc + 1, sizeof(double));
+          saveTop(notop, top, tagStack, valueStack);
+          top = ValuePair(v);
+          pc += sizeof(double) + 1;
+          break;
+        }
+        case Instruction::ConstMisc: {
+          bufferCheck(1);
+          saveTop(notop, top, tagStack, valueStack);
+          switch (fn->instructions[pc + 1]) {
+            case 0:
+              top = ValuePair(false);
+              break;
+            case 1:
+              top = ValuePair(true);
+              break;
+            default:
+              top = ValuePair::undef();
+          }
+          pc += 2;
+          break;
+        }
+        case Instruction::ConstI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          saveTop(notop, top, tagStack, valueStack);
+          if (immediate < 0 || immediate >= constants.size()) invalid();
+          top = copy(constants[immediate]);
+          pc += offset;
+          break;
+        }
+        case Instruction::GetGlobalI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          saveTop(notop, top, tagStack, valueStack);
+          if (immediate < 0 || immediate >= globalCount) invalid();
+          top = copy(ValuePair(globalTags[immediate], globalValues[immediate]));
+          pc += offset;
+          break;
+        }
+        case Instruction::SetGlobalI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (immediate < 0 || immediate >= globalCount) invalid();
+          if (UNLIKELY(!ownGlobals)) copyGlobals(globalTags, globalValues);
+          drop(ValuePair(ownGlobalTags[immediate], ownGlobalValues[immediate]));
+          // memoized results may depend on the old value
+          if (UNLIKELY(!memoCache.empty())) clearMemo();
+          ownGlobalTags[immediate] = top.tag;
+          ownGlobalValues[immediate] = top.value;
+          top = popvalue(tagStack, valueStack);
+          pc += offset;
+          break;
+        }
+        case Instruction::CallI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (immediate >= functions.size()) invalid();
+          const auto *callee = &functions[immediate];
+          if (UNLIKELY(counter >= nextCheck) &&
+              checkInterrupt(counter, state, pc, suspendable))
+            return suspend();
+          saveTop(notop, top, tagStack, valueStack);
+          if (UNLIKELY(jit != nullptr) && !interruptible && !profiled &&
+              pcStack.size() >= nativeFrom) {
+            const auto *native = jit->enter(immediate);
+            int argStart = valueStack.size() - callee->parameters;
+            bool numbers = native != nullptr && argStart >= spStack.back();
+            for (int i = argStart; numbers && i < tagStack.size(); i++)
+              numbers = tagStack[i] == ValueTag::NUMBER;
+            if (numbers) {
+              static_assert(sizeof(SValue) == sizeof(double));
+              auto result =
+                  native->code(reinterpret_cast<const double *>(
+                                   valueStack.data() + argStart),
+                               0, running);
+              if (LIKELY(result.status == 0)) {
+                jit->stats.nativeCalls++;
+                // numbers do not need to be dropped
+                tagStack.resize(argStart);
+                valueStack.resize(argStart);
+                if (native->result == ValueTag::NUMBER) {
+                  top = ValuePair(result.value);
+                } else {
+                  uint64_t bits;
+                  memcpy(&bits, &result.value, sizeof(double));
+                  top = ValuePair(bits != 0);
+                }
+                pc += offset;
+                break;
+              }
+              jit->stats.bailouts++;
+              bailDepth = pcStack.size();
+              nativeFrom = bailDepth + Jit::maxDepth / 2;
+              // it may have been stopped
+              nextCheck = counter;
+            }
+          }
+          if (UNLIKELY(!memoCache.empty())) {
+            MemoFrame frame{-1, 0};
+            if (callee->pure) {
+              int argStart = valueStack.size() - callee->parameters;
+              if (argStart < 0) invalid();
+              size_t hash = immediate;
+              for (int i = argStart; i < valueStack.size(); i++)
+                hash = hash * 31 +
+                       hashValue(ValuePair(tagStack[i], valueStack[i]));
+              hash = mixHash(hash);
+              int slot = hash & (memoCache.size() - 1);
+              auto &entry = memoCache[slot];
+              bool hit = entry.function == immediate && !entry.pending &&
+                         entry.hash == hash;
+              for (int i = 0; hit && i < callee->parameters; i++)
+                hit = sameValue(entry.args[i],
+                                ValuePair(tagStack[argStart + i],
+                                          valueStack[argStart + i]));
+              if (hit) {
+                stats.hits++;
+                for (int i = argStart; i < valueStack.size(); i++)
+                  drop(ValuePair(tagStack[i], valueStack[i]));
+                tagStack.resize(argStart);
+                valueStack.resize(argStart);
+                top = copy(entry.result);
+                pc += offset;
+                break;
+              }
+              stats.misses++;
+              // evict the old entry and wait for the result
+              for (auto v : entry.args) drop(v);
+              entry.args.clear();
+              drop(entry.result);
+              entry.result = ValuePair::undef();
+              for (int i = argStart; i < valueStack.size(); i++)
+                entry.args.push_back(
+                    copy(ValuePair(tagStack[i], valueStack[i])));
+              entry.function = immediate;
+              entry.pending = true;
+              entry.stamp = ++memoStamp;
+              entry.hash = hash;
+              frame = MemoFrame{slot, entry.stamp};
+            }
+            memoFrames.push_back(frame);
+          }
+          if constexpr (profiled) {
+            node = profileData->child(node, immediate);
+            profileData->calls[immediate]++;
+          }
+          fn = callee;
+          pcStack.push_back(pc + offset);
+          rpStack.push_back(immediate);
+          spStack.push_back(valueStack.size() - fn->parameters);
+          raise(memory->peakFrames, state.baseFrames + rpStack.size());
+          raise(memory->peakStackValues, state.baseValues + tagStack.size());
+          pc = 0;
+          notop = true;
+          break;
+        }
+        case Instruction::TailCallI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (immediate >= functions.size()) invalid();
+          if (UNLIKELY(counter >= nextCheck) &&
+              checkInterrupt(counter, state, pc, suspendable))
+            return suspend();
+          fn = &functions[immediate];
+          saveTop(notop, top, tagStack, valueStack);
+          if constexpr (profiled) {
+            node = profileData->child(profileData->nodes[node].parent,
+                                      immediate);
+            profileData->calls[immediate]++;
+          }
+
+          int sp = spStack.back();
+          int params = fn->parameters;
+          int stackEnd = valueStack.size() - params;
+          for (int i = sp; i < stackEnd; i++) {
+            drop(ValuePair(tagStack[i], valueStack[i]));
+          }
+          for (int i = 0; i < params; i++) {
+            tagStack[sp + i] = tagStack[stackEnd + i];
+            valueStack[sp + i] = valueStack[stackEnd + i];
+          }
+          tagStack.resize(sp + params);
+          valueStack.resize(sp + params);
+          rpStack.back() = immediate;
+          pc = 0;
+          notop = true;
+          break;
+        }
+        case Instruction::SpecializeI: {
+          auto [immediate, offset] = getImmediate(fn, pc);
+          if (immediate >= functions.size()) invalid();
+          int sp = spStack.back();
+          if (sp + fn->parameters > tagStack.size()) invalid();
+          bool numbers = true;
+          for (int i = sp; numbers && i < sp + fn->parameters; i++)
+            numbers = tagStack[i] == ValueTag::NUMBER;
+          if (numbers) {
+            fn = &functions[immediate];
+            rpStack.back() = immediate;
+            pc = 0;
+            if constexpr (profiled)
+              node = profileData->child(profileData->nodes[node].parent,
+                                        immediate);
+          } else {
+            pc += offset;
+          }
+          break;
+        }
+        case Instruction::Ret: {
+          // this is undefined behavior
+          if (notop) invalid();
+          rpStack.pop_back();
+          int sp = spStack.back();
+          spStack.pop_back();
+          for (int i = sp; i < valueStack.size(); i++) {
+            drop(ValuePair(tagStack[i], valueStack[i]));
+          }
+          tagStack.resize(sp);
+          valueStack.resize(sp);
+          if (pcStack.size() == 1) {
+            if constexpr (profiled)
+              profileData->opcodes[lastOp].cycles +=
+                  Profile::cycles() - lastCycles;
+            executed = counter;
+            state.top = top;
+            state.notop = false;
+            return true;
+          }
+          if (UNLIKELY(!memoCache.empty())) {
+            // tail calls keep the frame, the result is still the result of the
+            // original call
+            auto frame = memoFrames.back();
+            memoFrames.pop_back();
+            if (frame.slot >= 0 && memoCache[frame.slot].stamp == frame.stamp) {
+              memoCache[frame.slot].result = copy(top);
+              memoCache[frame.slot].pending = false;
+            }
+          }
+          if constexpr (profiled) node = profileData->nodes[node].parent;
+          fn = &functions[rpStack.back()];
+          pc = pcStack.back();
+          pcStack.pop_back();
+          if (UNLIKELY(pcStack.size() <= bailDepth)) nativeFrom = bailDepth = 0;
+          break;
+        }
+        case Instruction::MakeRange: {
+          if (tagStack.size() <= 1 || valueStack.size() <= 1) invalid();
+          auto step = popvalue(tagStack, valueStack);
+          auto start = popvalue(tagStack, valueStack);
+          auto end = top;
+          if (start.tag != ValueTag::NUMBER || step.tag != ValueTag::NUMBER ||
+              end.tag != ValueTag::NUMBER) {
+            drop(start);
+            drop(step);
+            drop(end);
+            top = ValuePair::undef();
+          } else {
+            account(ValueTag::RANGE, 1, sizeof(SRange));
+            top = ValuePair(
+                ValueTag::RANGE,
+                SValue{.range = new SRange{start.value.number,
+                                           step.value.number,
+                                           end.value.number}});
+          }
+          pc += 1;
+          break;
+        }
+        case Instruction::MakeList: {
+          saveTop(notop, top, tagStack, valueStack);
+          account(ValueTag::VECTOR, 1,
+                  sizeof(SVector) + sizeof(std::vector<ValuePair>));
           top = ValuePair(
-              ValueTag::RANGE,
-              SValue{.range = new SRange{start.value.number, step.value.number,
-                                         end.value.number}});
+              ValueTag::VECTOR,
+              SValue{.vec = new SVector{
+                         std::make_shared<std::vector<ValuePair>>()}});
+          pc += 1;
+          break;
         }
-        pc += 1;
-      }
-      case Instruction::MakeList: {
-        saveTop(notop, top, tagStack, valueStack);
-        top =
-            ValuePair(ValueTag::VECTOR,
-                      SValue{.vec = new SVector{
-                                 std::make_shared<std::vector<ValuePair>>()}});
-        pc += 1;
-      }
-      case Instruction::Echo: {
-        if (top.tag != ValueTag::NUMBER) unimplemented();
-        *ostream << top.value.number << std::endl;
-        pc += 1;
-        break;
+        case Instruction::Echo: {
+          if (top.tag != ValueTag::NUMBER) unimplemented();
+          const Location *loc = echoLocations ? fn->location(pc) : nullptr;
+          if (loc != nullptr) *ostream << loc->begin << ": ";
+          *ostream << top.value.number << std::endl;
+          pc += 1;
+          break;
+        }
+        default:
+          throw std::runtime_error("unknown bytecode "s +
+                                   toHex(fn->instructions[pc]));
       }
-      default:
-        throw std::runtime_error("unknown bytecode "s +
-                                 toHex(fn->instructions[pc]));
     }
+  } catch (const EvalInterrupted &) {
+    state.top = top;
+    state.notop = notop;
+    state.release();
+    throw;
+  } catch (const EvalError &) {
+    // from a nested evaluation, which has the whole backtrace
+    state.top = top;
+    state.notop = notop;
+    state.release();
+    throw;
+  } catch (const std::runtime_error &e) {
+    std::vector<StackFrame> backtrace;
+    walkFrames(state, pc, [&](int function, int pc) {
+      backtrace.push_back({function, pc});
+      return true;
+    });
+    state.top = top;
+    state.notop = notop;
+    state.release();
+    throw EvalError(e.what(), std::move(backtrace), *program);
   }
-  if (!flag.load(std::memory_order_relaxed)) {
-    *ostream << "instructions executed: " << counter << std::endl;
-    return ValuePair(ValueTag::UNDEF, SValue());
-  }
-  throw std::runtime_error("evaluator stuck");
 }
 }  // namespace sscad
@@ -15,8 +15,16 @@
  */
 #pragma once
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
+#include "location.h"
 #include "values.h"
 
 namespace sscad {
@@ -24,25 +32,358 @@ struct FunctionEntry {
   std::vector<unsigned char> instructions;
   int parameters;
   bool isModule;
+  // does not read config variables or produce output, and only calls pure
+  // functions. The result only depends on the arguments and can be memoized.
+  // Program clears it for functions that echo or write globals, directly or
+  // in a callee.
+  bool pure = false;
+  // Line table, the source location of the instructions from each pc up to
+  // the next entry, sorted by pc. Empty for hand-written bytecode.
+  std::vector<std::pair<int, Location>> lines;
+  // name of the declaration, empty for hand-written bytecode
+  std::string name;
+
+  // location of the instruction at pc, nullptr if unknown
+  const Location *location(int pc) const;
+};
+
+struct MemoStats {
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+struct JitStats {
+  // functions compiled to native code, and functions that were not supported
+  size_t compiled = 0;
+  size_t rejected = 0;
+  size_t nativeCalls = 0;
+  // native calls that gave up and were redone by the interpreter
+  size_t bailouts = 0;
+};
+
+// Values allocated by an evaluation, see Evaluator::memoryStats. Bytes are
+// estimates of the objects and their buffers, vectors count each value
+// referring to a buffer and the buffer once.
+struct AllocationStats {
+  long count = 0;
+  long peakCount = 0;
+  long bytes = 0;
+  long peakBytes = 0;
+};
+
+struct MemoryStats {
+  AllocationStats strings;
+  AllocationStats vectors;
+  AllocationStats ranges;
+  // all of the above
+  long bytes = 0;
+  long peakBytes = 0;
+  // copies of shared vectors made by APPEND and CONCAT before modifying them
+  unsigned long clones = 0;
+  // deepest VM stack, in call frames and values, measured at calls and at the
+  // interrupt checks
+  size_t peakFrames = 0;
+  size_t peakStackValues = 0;
+};
+
+// why an evaluation was interrupted, see EvalInterrupted
+enum class StopReason {
+  // Evaluator::stop() was called
+  STOPPED,
+  INSTRUCTION_BUDGET,
+  TIME_BUDGET,
+  MEMORY_LIMIT,
+};
+
+// Thrown by the evaluator when an evaluation is interrupted. The values of the
+// interrupted evaluation are released, so the evaluator can be used again.
+class EvalInterrupted : public std::runtime_error {
+ public:
+  EvalInterrupted(StopReason reason);
+  StopReason reason;
 };
 
+struct Program;
+
+// a frame of a VM backtrace, pc is the instruction running in the function
+struct StackFrame {
+  int function;
+  int pc;
+};
+
+// Thrown by the evaluator for errors in the evaluated program, e.g. invalid
+// bytecode or unsupported operations. what() is the message followed by the
+// backtrace, see Program::describe.
+class EvalError : public std::runtime_error {
+ public:
+  EvalError(const std::string &message, std::vector<StackFrame> backtrace,
+            const Program &program);
+  std::string message;
+  // from the innermost frame, including the frames of the evaluations that
+  // started a parallel worker
+  std::vector<StackFrame> backtrace;
+};
+
+class Jit;
+struct MemoryCounters;
+class Profile;
+class Sampler;
+class ThreadPool;
+
+/**
+ * A compiled program: the functions, the constant pool and the initial values
+ * of the globals. It is immutable once constructed, so a single program can be
+ * shared by evaluators running on different threads.
+ *
+ * Evaluators only copy values out of the program. Vectors are shared by
+ * reference counting and the program keeps its own reference, so an evaluator
+ * modifying a vector always works on a copy.
+ */
+struct Program {
+  // the program takes ownership of the allocated global values and constants
+  Program(std::vector<FunctionEntry> functions,
+          std::vector<ValueTag> globalTags, std::vector<SValue> globalValues,
+          std::vector<ValuePair> constants = {});
+  Program(const Program &) = delete;
+  Program &operator=(const Program &) = delete;
+  ~Program();
+
+  // Globals read and written by a function and the functions it calls.
+  // Throws std::runtime_error for invalid bytecode.
+  void globalAccess(int id, std::unordered_set<int> &reads,
+                    std::unordered_set<int> &writes) const;
+  // Name of a function for reports, or f<id> if it has none, with the source
+  // position of the instruction at pc, e.g. "foo (0:3:12)". A negative pc
+  // gives the position of the function.
+  std::string describe(int function, int pc = -1) const;
+
+  const std::vector<FunctionEntry> functions;
+  const std::vector<ValueTag> globalTags;
+  const std::vector<SValue> globalValues;
+  const std::vector<ValuePair> constants;
+  // whether each function writes globals, directly or in the functions it
+  // calls. Functions with invalid bytecode are assumed to write globals.
+  const std::vector<bool> writesGlobals;
+
+ private:
+  static std::vector<FunctionEntry> checkPurity(
+      std::vector<FunctionEntry> functions);
+  static std::vector<bool> findGlobalWrites(
+      const std::vector<FunctionEntry> &functions);
+};
+
+/**
+ * Execution context for a program. An evaluator is not thread-safe, but it is
+ * cheap to create: the globals are read from the program until the first
+ * write, which copies them into the evaluator.
+ */
 class Evaluator {
  public:
+  Evaluator(std::ostream *ostream, std::shared_ptr<const Program> program);
+  // the evaluator takes ownership of the allocated global values and constants
   Evaluator(std::ostream *ostream, std::vector<FunctionEntry> functions,
-            std::vector<ValueTag> globalTags, std::vector<SValue> globalValues)
-      : ostream(ostream),
-        functions(functions),
-        globalTags(globalTags),
-        globalValues(globalValues) {}
+            std::vector<ValueTag> globalTags, std::vector<SValue> globalValues,
+            std::vector<ValuePair> constants = {});
+  ~Evaluator();
 
   ValuePair eval(int id);
+  // Interrupt the running evaluation, which throws EvalInterrupted with
+  // StopReason::STOPPED. Can be called from any thread. The evaluation only
+  // checks for this every few thousand instructions, at backward jumps and
+  // calls, and native code from the JIT at every loop and call. Stopping an
+  // idle evaluator interrupts its next evaluation.
   void stop() { flag.store(false, std::memory_order_relaxed); }
 
+  // Limit each call to eval or evalAll to a number of instructions, or to some
+  // wall-clock time. Exceeding a limit throws EvalInterrupted. Zero disables
+  // the limit, which is the default. The limits are checked like stop(), and
+  // evaluations with limits do not run native code from the JIT, as it only
+  // checks the stop flag. Parallel workers share the deadline but each of
+  // them gets the remaining instructions, so they can exceed the instruction
+  // budget.
+  void setInstructionBudget(unsigned long instructions);
+  void setTimeBudget(std::chrono::steady_clock::duration time);
+  // instructions executed by the last evaluation, including parallel workers
+  unsigned long instructionsExecuted() const { return executed; }
+
+  // Values allocated by the last evaluation. Counts are relative to the start
+  // of the evaluation, so freeing values it did not allocate, e.g. globals,
+  // makes them negative, and releasing the result afterwards is not counted.
+  // Can be read from any thread while the evaluation runs, parallel workers
+  // are added when they finish, as if they reached their peaks together.
+  MemoryStats memoryStats() const;
+  // Interrupt evaluations allocating more than `bytes` at a time with
+  // EvalInterrupted, 0 disables the limit, which is the default. This is
+  // checked like the budgets, soon after the allocation that exceeds it.
+  // Parallel workers each get the remaining memory, so they can exceed it.
+  void setMemoryLimit(size_t bytes) { memoryLimit = bytes; }
+
+  // Resumable evaluation, e.g. to run many evaluations on a few threads.
+  // start sets up an evaluation of a function without running it, and resume
+  // runs it until it returns or suspends. It suspends after about `quantum`
+  // instructions (0 for no limit), or when suspend() is called, at the points
+  // where stop() is checked. Only the outermost function suspends, so calls
+  // running on the thread pool finish first. Like evaluations with limits,
+  // resumed evaluations do not run native code from the JIT.
+  //
+  // The stacks of a suspended evaluation are kept in the evaluator, which can
+  // be resumed from another thread. Budgets count over all the resumes, and
+  // the time budget only counts the time spent running. resume returns the
+  // result once the evaluation completes, and throws like eval, which ends
+  // the evaluation. eval, evalAll and start throw std::runtime_error while an
+  // evaluation is suspended, cancel releases it.
+  void start(int id);
+  std::optional<ValuePair> resume(unsigned long quantum = 0);
+  // Can be called from any thread. Suspending an idle evaluator suspends the
+  // next resume right away.
+  void suspend() { suspendFlag.store(true, std::memory_order_relaxed); }
+  bool suspended() const { return suspendedState != nullptr; }
+  void cancel();
+  // release a value returned by the evaluator
+  static void release(ValuePair value);
+
+  // Copy of the current value of a global, owned by the caller.
+  ValuePair getGlobal(int index) const;
+  // Replace the value of a global, the evaluator takes ownership of it.
+  void setGlobal(int index, ValuePair value);
+  // Replace all the globals with a copy of the globals of another evaluator
+  // running the same program.
+  void setGlobals(const Evaluator &other);
+
+
+  // Cache the results of pure function calls, keyed on the function and the
+  // argument values. The cache is direct mapped with `capacity` entries
+  // (rounded up to a power of two), so newer calls evict older ones.
+  // Passing 0 disables memoization, which is the default.
+  void setMemoization(size_t capacity);
+  MemoStats memoStats() const { return stats; }
+
+  // Evaluate independent calls, e.g. the children of a module, returning the
+  // results in the order of the ids. With a thread pool the calls run in
+  // parallel, each in its own evaluator, unless one of them writes globals.
+  // Their output is still written in the order of the ids. If calls fail,
+  // the output up to the first failed call is written and its exception is
+  // rethrown.
+  std::vector<ValuePair> evalAll(const std::vector<int> &ids);
+
+  // Compile functions to native code after `threshold` calls, see jit.h.
+  // A negative threshold disables the JIT, which is the default. This does
+  // nothing on unsupported platforms.
+  void setJit(int threshold);
+  JitStats jitStats() const;
+
+  // Run MapI over pure functions on the pool when there are at least
+  // `minElements` elements, e.g. for list comprehensions, and evalAll. Each
+  // worker runs in its own evaluator with a copy of the globals. Passing
+  // nullptr disables this, which is the default.
+  void setThreadPool(std::shared_ptr<ThreadPool> pool, size_t minElements = 64);
+
+  // Profile every instruction of the following evaluations, see profile.h.
+  // This is much slower than normal evaluation, and profiled evaluations do
+  // not run native code from the JIT. The profile accumulates over the
+  // evaluations until profiling is disabled, and includes the parallel
+  // workers.
+  void setProfiling(bool enabled);
+  // nullptr if profiling is disabled
+  const Profile *profile() const { return profileData.get(); }
+
+  // Prefix the output of echo with its source position, which is off by
+  // default.
+  void setEchoLocations(bool enabled) { echoLocations = enabled; }
+
+  // Take samples of the call stack of the following evaluations, including
+  // the parallel workers, see sampler.h. Unlike setProfiling, this is cheap
+  // enough to leave on. The sampler must be for the same program, nullptr
+  // disables sampling.
+  void setSampler(std::shared_ptr<Sampler> sampler);
+
  private:
   std::ostream *ostream;
-  std::vector<FunctionEntry> functions;
-  std::vector<ValueTag> globalTags;
-  std::vector<SValue> globalValues;
+  std::shared_ptr<const Program> program;
+  // the globals of the program, or ownGlobalTags and ownGlobalValues after the
+  // first write
+  const ValueTag *globalTags;
+  const SValue *globalValues;
+  bool ownGlobals = false;
+  std::vector<ValueTag> ownGlobalTags;
+  std::vector<SValue> ownGlobalValues;
+  void copyGlobals(const ValueTag *tags, const SValue *values);
+  void dropOwnGlobals();
   std::atomic<bool> flag = true;
+
+  // limits of the current evaluation. Worker contexts get the remaining
+  // limits of the evaluator that started them, and check its stop flag.
+  const Evaluator *parent = nullptr;
+  unsigned long instructionBudget = 0;
+  std::chrono::steady_clock::duration timeBudget{0};
+  size_t memoryLimit = 0;
+  // written by the thread running the evaluation, see memoryStats
+  std::unique_ptr<MemoryCounters> memory;
+  unsigned long executed = 0;
+  unsigned long instructionLimit = 0;
+  std::chrono::steady_clock::time_point deadline;
+  // the instruction count at which execute calls checkInterrupt
+  unsigned long nextCheck = 0;
+  void startLimits();
+  void inheritLimits(const Evaluator &other);
+  bool limited() const;
+  struct State;
+  // Throws EvalInterrupted, or returns whether a suspendable evaluation should
+  // suspend. Sets nextCheck otherwise. Also takes the samples, pc is the
+  // instruction running in the innermost frame of the state.
+  bool checkInterrupt(unsigned long counter, const State &state, int pc,
+                      bool suspendable);
+
+  std::atomic<bool> suspendFlag = false;
+  // instruction count at which the resumed evaluation suspends
+  unsigned long suspendAt = 0;
+  std::unique_ptr<State> suspendedState;
+  // state of the innermost running evaluation, MapI runs nested evaluations
+  State *activeState = nullptr;
+
+  // run a function, the evaluator takes ownership of the arguments
+  ValuePair run(int id, std::vector<ValuePair> &args);
+  // Returns false if the evaluation suspended, the result is left in the state
+  // otherwise.
+  bool execute(State &state, bool suspendable);
+  // the interpreter, with or without profiling
+  template <bool profiled>
+  bool interpret(State &state, bool suspendable);
+  ValuePair map(int id, std::vector<ValuePair> &captured, ValuePair list);
+  std::shared_ptr<ThreadPool> pool;
+  size_t parallelMin = 0;
+
+  struct MemoEntry {
+    // -1 for empty entries
+    int function = -1;
+    // pending entries get their result when the call returns, unless the
+    // entry is evicted in the meantime, which changes the stamp
+    bool pending = false;
+    unsigned long stamp = 0;
+    size_t hash = 0;
+    std::vector<ValuePair> args;
+    ValuePair result = ValuePair::undef();
+  };
+  void clearMemo();
+
+  std::vector<MemoEntry> memoCache;
+  unsigned long memoStamp = 0;
+  MemoStats stats;
+
+  std::unique_ptr<Jit> jit;
+
+  std::unique_ptr<Profile> profileData;
+  // call tree node of the current frame, for nested runs
+  int profileNode = 0;
+
+  std::shared_ptr<Sampler> sampler;
+  unsigned long sampledTick = 0;
+  void takeSample(const State &state, int pc);
+  // calls f(function, pc) for the frames of a state from the innermost, then
+  // for the frames of the states running MapI for it, until f returns false
+  template <typename F>
+  static void walkFrames(const State &state, int pc, F f);
+
+  bool echoLocations = false;
 };
 }  // namespace sscad
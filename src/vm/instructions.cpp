@@ -21,8 +21,9 @@
 #include "utils/ast_printer.h"
 
 namespace sscad {
+int immSize(int imm) { return (imm > -128 && imm <= 127) ? 1 : 5; }
 void addImm(std::vector<unsigned char> &instructions, int imm) {
-  if (imm > -128 && imm <= 127)
+  if (immSize(imm) == 1)
     instructions.push_back(static_cast<char>(imm));
   else {
     instructions.push_back(0x80);
@@ -51,6 +52,15 @@ void addUnaryOp(std::vector<unsigned char> &instructions, BuiltinUnary op) {
   instructions.push_back(static_cast<unsigned char>(op));
 }
 
+void addNumBinOp(std::vector<unsigned char> &instructions, BinOp op) {
+  addInst(instructions, Instruction::NumBinaryOp);
+  instructions.push_back(static_cast<unsigned char>(op));
+}
+void addNumUnaryOp(std::vector<unsigned char> &instructions, BuiltinUnary op) {
+  addInst(instructions, Instruction::NumUnaryOp);
+  instructions.push_back(static_cast<unsigned char>(op));
+}
+
 static std::pair<int, int> getImmediate(
     const std::vector<unsigned char> &instructions, int currentPC) {
   if (currentPC + 1 >= instructions.size())
@@ -87,14 +97,22 @@ std::string getInstName(Instruction inst) {
       return "CallI";
     case Instruction::TailCallI:
       return "TailCallI";
+    case Instruction::SpecializeI:
+      return "SpecializeI";
     case Instruction::BuiltinUnaryOp:
       return "BuiltinUnaryOp";
     case Instruction::BinaryOp:
       return "BinaryOp";
+    case Instruction::NumUnaryOp:
+      return "NumUnaryOp";
+    case Instruction::NumBinaryOp:
+      return "NumBinaryOp";
     case Instruction::ConstNum:
       return "ConstNum";
     case Instruction::ConstMisc:
       return "ConstMisc";
+    case Instruction::ConstI:
+      return "ConstI";
     case Instruction::Pop:
       return "Pop";
     case Instruction::Dup:
@@ -107,6 +125,8 @@ std::string getInstName(Instruction inst) {
       return "MakeList";
     case Instruction::Iter:
       return "Iter";
+    case Instruction::MapI:
+      return "MapI";
     case Instruction::Echo:
       return "Echo";
   }
@@ -192,8 +212,11 @@ void print(std::ostream &ostream,
         case Instruction::SetI:
         case Instruction::GetGlobalI:
         case Instruction::SetGlobalI:
+        case Instruction::ConstI:
         case Instruction::CallI:
-        case Instruction::TailCallI: {
+        case Instruction::TailCallI:
+        case Instruction::SpecializeI:
+        case Instruction::MapI: {
           auto [_, offset] = getImmediate(instructions, pc);
           pc += offset;
           break;
@@ -208,6 +231,8 @@ void print(std::ostream &ostream,
         }
         case Instruction::BuiltinUnaryOp:
         case Instruction::BinaryOp:
+        case Instruction::NumUnaryOp:
+        case Instruction::NumBinaryOp:
         case Instruction::ConstMisc: {
           pc += 2;
           break;
@@ -245,8 +270,11 @@ void print(std::ostream &ostream,
       case Instruction::SetI:
       case Instruction::GetGlobalI:
       case Instruction::SetGlobalI:
+      case Instruction::ConstI:
       case Instruction::CallI:
-      case Instruction::TailCallI: {
+      case Instruction::TailCallI:
+      case Instruction::SpecializeI:
+      case Instruction::MapI: {
         auto [immediate, offset] = getImmediate(instructions, pc);
         ostream << getInstName(inst) << " " << immediate << std::endl;
         pc += offset;
@@ -267,13 +295,15 @@ void print(std::ostream &ostream,
         pc += offset;
         break;
       }
-      case Instruction::BuiltinUnaryOp: {
+      case Instruction::BuiltinUnaryOp:
+      case Instruction::NumUnaryOp: {
         ostream << getInstName(inst) << " "
                 << static_cast<BuiltinUnary>(instructions[pc + 1]) << std::endl;
         pc += 2;
         break;
       }
-      case Instruction::BinaryOp: {
+      case Instruction::BinaryOp:
+      case Instruction::NumBinaryOp: {
         ostream << getInstName(inst) << " "
                 << static_cast<BinOp>(instructions[pc + 1]) << std::endl;
         pc += 2;
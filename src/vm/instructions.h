@@ -52,6 +52,13 @@ enum class Instruction : unsigned char {
   // pop the list and the integer from the list, and
   // jump n bytes relative to the current instruction
   Iter,
+  // Expects the values captured by function i and a list at the top of the
+  // stack, and pops them. Calls the function once for each element of the
+  // list with the captured values followed by the element as arguments, and
+  // pushes the concatenation of the results. Ranges are iterated like lists,
+  // other values are a single element. Results that are not lists are
+  // skipped.
+  MapI,
   // pop and discard the value in the top of the stack
   Pop,
   // duplicate and push the value in the top of the stack
@@ -62,6 +69,12 @@ enum class Instruction : unsigned char {
   // rhs = stack.pop(), stack.top() = stack.top() OP rhs.
   // the next char is the binary operation.
   BinaryOp,
+  // BuiltinUnaryOp without the tag check, the operand must be a number and the
+  // operation must be numerical.
+  NumUnaryOp,
+  // BinaryOp without the tag checks, both operands must be numbers and the
+  // operation must be arithmetic or comparison (ADD to NEQ).
+  NumBinaryOp,
   // push a constant double to the top of the stack.
   // the next 8 bytes in machine endian represents the double.
   // next instruction index: current + 9
@@ -70,6 +83,9 @@ enum class Instruction : unsigned char {
   // true if the next byte is 1, and false if the next byte is 0.
   // next instruction index: current + 2
   ConstMisc,
+  // copy and push the i-th entry of the constant pool to the top of the stack.
+  // vectors in the pool are shared, so this is cheap even for large lists.
+  ConstI,
   // copy and push the i-th global to the top of the stack.
   GetGlobalI,
   // pop and set the i-th global as the top of the stack.
@@ -78,6 +94,10 @@ enum class Instruction : unsigned char {
   CallI,
   // call the function with ID i
   TailCallI,
+  // function entry guard: if all parameters of the current function are
+  // numbers, continue in the number specialized function with ID i using the
+  // same frame. Otherwise go to the next instruction.
+  SpecializeI,
   // return the top value of the stack
   Ret,
   // start, step, end, END_OF_STACK
@@ -103,12 +123,16 @@ enum class BuiltinUnary : unsigned char {
 };
 // clang-format on
 
+// number of bytes used to encode the immediate value
+int immSize(int imm);
 void addImm(std::vector<unsigned char> &instructions, int imm);
 void addInst(std::vector<unsigned char> &instructions, Instruction i);
 void addInst(std::vector<unsigned char> &instructions, Instruction i, int imm);
 void addDouble(std::vector<unsigned char> &instructions, double value);
 void addBinOp(std::vector<unsigned char> &instructions, BinOp op);
 void addUnaryOp(std::vector<unsigned char> &instructions, BuiltinUnary op);
+void addNumBinOp(std::vector<unsigned char> &instructions, BinOp op);
+void addNumUnaryOp(std::vector<unsigned char> &instructions, BuiltinUnary op);
 
 void print(std::ostream &ostream,
            const std::vector<unsigned char> &instructions, bool labels = true);
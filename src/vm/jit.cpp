@@ -0,0 +1,660 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "jit.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+
+#include "instructions.h"
+#include "numeric.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define SSCAD_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace sscad {
+Jit::Jit(const std::vector<FunctionEntry> &functions, int threshold)
+    : functions(functions), states(functions.size()), threshold(threshold) {}
+
+Jit::~Jit() {
+#ifdef SSCAD_JIT_X86_64
+  for (auto [ptr, size] : regions) munmap(ptr, size);
+#endif
+}
+
+bool Jit::supported() {
+#ifdef SSCAD_JIT_X86_64
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool Jit::compile(int id) {
+  if (id < 0 || id >= states.size()) return false;
+  if (states[id].entry.code != nullptr) return true;
+  if (states[id].rejected || states[id].compiling) return false;
+  states[id].compiling = true;
+  // recursive calls need the result type before we know it, try both
+  bool ok = tryCompile(id, ValueTag::NUMBER) ||
+            tryCompile(id, ValueTag::BOOLEAN);
+  states[id].compiling = false;
+  if (ok) {
+    stats.compiled++;
+  } else {
+    states[id].rejected = true;
+    stats.rejected++;
+  }
+  return ok;
+}
+
+#ifndef SSCAD_JIT_X86_64
+bool Jit::tryCompile(int id, ValueTag assumedResult) { return false; }
+#else
+namespace {
+double jitUnary(double v, long op) {
+  return numericUnary(v, static_cast<BuiltinUnary>(op));
+}
+
+double jitBinary(double lhs, double rhs, long op) {
+  return static_cast<BinOp>(op) == BinOp::MOD ? std::fmod(lhs, rhs)
+                                              : std::pow(lhs, rhs);
+}
+
+struct Decoded {
+  Instruction inst;
+  int pc;
+  // the immediate, or the operation for unary and binary operations
+  int imm = 0;
+  double number = 0;
+  int next = 0;
+};
+
+// decode the whole function, nullopt for unsupported instructions or
+// truncated bytecode
+std::optional<std::vector<Decoded>> decode(
+    const std::vector<unsigned char> &code) {
+  std::vector<Decoded> result;
+  int pc = 0;
+  while (pc < code.size()) {
+    Decoded d{static_cast<Instruction>(code[pc]), pc};
+    switch (d.inst) {
+      case Instruction::GetI:
+      case Instruction::SetI:
+      case Instruction::AddI:
+      case Instruction::JumpI:
+      case Instruction::JumpFalseI:
+      case Instruction::CallI:
+      case Instruction::TailCallI:
+      case Instruction::SpecializeI:
+        if (pc + 1 >= code.size()) return std::nullopt;
+        if (code[pc + 1] != 0x80) {
+          d.imm = static_cast<signed char>(code[pc + 1]);
+          d.next = pc + 2;
+        } else {
+          if (pc + 5 >= code.size()) return std::nullopt;
+          memcpy(&d.imm, code.data() + pc + 2, sizeof(int));
+          d.next = pc + 6;
+        }
+        break;
+      case Instruction::BuiltinUnaryOp:
+      case Instruction::NumUnaryOp:
+      case Instruction::BinaryOp:
+      case Instruction::NumBinaryOp:
+      case Instruction::ConstMisc:
+        if (pc + 1 >= code.size()) return std::nullopt;
+        d.imm = code[pc + 1];
+        d.next = pc + 2;
+        break;
+      case Instruction::ConstNum:
+        if (pc + 1 + sizeof(double) >= code.size()) return std::nullopt;
+        memcpy(&d.number, code.data() + pc + 1, sizeof(double));
+        d.next = pc + 1 + sizeof(double);
+        break;
+      case Instruction::Pop:
+      case Instruction::Dup:
+      case Instruction::Ret:
+        d.next = pc + 1;
+        break;
+      default:
+        return std::nullopt;
+    }
+    result.push_back(d);
+    pc = d.next;
+  }
+  return result;
+}
+
+// types of the logical stack of the current frame, including the top.
+// notop mirrors the interpreter, it is only set at the function entry.
+struct StackState {
+  std::vector<ValueTag> types;
+  bool notop;
+
+  bool operator==(const StackState &other) const {
+    return types == other.types && notop == other.notop;
+  }
+};
+
+// x86-64 encoder for the few instruction forms we need. Memory operands are
+// always [rbp + disp32].
+struct Assembler {
+  std::vector<unsigned char> code;
+
+  void emit(std::initializer_list<unsigned char> bytes) {
+    code.insert(code.end(), bytes);
+  }
+  void imm32(int32_t v) {
+    code.resize(code.size() + 4);
+    memcpy(code.data() + code.size() - 4, &v, 4);
+  }
+  void imm64(uint64_t v) {
+    code.resize(code.size() + 8);
+    memcpy(code.data() + code.size() - 8, &v, 8);
+  }
+  void rbp(std::initializer_list<unsigned char> op, int reg, int32_t disp) {
+    emit(op);
+    code.push_back(0x85 | (reg << 3));
+    imm32(disp);
+  }
+  // mov rax, [rbp + disp]
+  void load(int32_t disp) { rbp({0x48, 0x8B}, 0, disp); }
+  // mov [rbp + disp], rax
+  void store(int32_t disp) { rbp({0x48, 0x89}, 0, disp); }
+  // movsd xmm, [rbp + disp]
+  void loadsd(int xmm, int32_t disp) { rbp({0xF2, 0x0F, 0x10}, xmm, disp); }
+  // movsd [rbp + disp], xmm
+  void storesd(int xmm, int32_t disp) { rbp({0xF2, 0x0F, 0x11}, xmm, disp); }
+  // movabs rax, imm64
+  void movabs(uint64_t v) {
+    emit({0x48, 0xB8});
+    imm64(v);
+  }
+  // call rax
+  void callRax() { emit({0xFF, 0xD0}); }
+  // jmp/jcc rel32, returns the position of the offset for patching
+  int jump(std::initializer_list<unsigned char> op) {
+    emit(op);
+    imm32(0);
+    return code.size() - 4;
+  }
+  void patch(int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(code.data() + at, &rel, 4);
+  }
+};
+
+uint64_t bits(double v) {
+  uint64_t result;
+  memcpy(&result, &v, sizeof(double));
+  return result;
+}
+}  // namespace
+
+bool Jit::tryCompile(int id, ValueTag assumedResult) {
+  const auto &fn = functions[id];
+  if (fn.isModule || fn.parameters < 0) return false;
+  auto decoded = decode(fn.instructions);
+  if (!decoded) return false;
+  const auto &insts = *decoded;
+  const int params = fn.parameters;
+  std::unordered_map<int, int> indexOf;
+  for (int i = 0; i < insts.size(); i++) indexOf[insts[i].pc] = i;
+  auto jumpTarget = [&](int i) {
+    auto iter = indexOf.find(insts[i].pc + insts[i].imm);
+    return iter == indexOf.end() ? -1 : iter->second;
+  };
+
+  // abstract interpretation over the stack types
+  std::vector<std::optional<StackState>> in(insts.size());
+  std::vector<int> worklist;
+  std::optional<ValueTag> result;
+  size_t stackSize = params;
+  auto flow = [&](int to, const StackState &s) {
+    if (to < 0 || to >= insts.size()) return false;
+    if (!in[to]) {
+      in[to] = s;
+      stackSize = std::max(stackSize, s.types.size());
+      worklist.push_back(to);
+      return true;
+    }
+    return *in[to] == s;
+  };
+  auto ret = [&](ValueTag tag) {
+    if (result && *result != tag) return false;
+    result = tag;
+    return true;
+  };
+  // pops the arguments and returns the result type of the callee
+  auto call = [&](int callee, StackState &s) -> std::optional<ValueTag> {
+    if (callee < 0 || callee >= functions.size()) return std::nullopt;
+    int n = functions[callee].parameters;
+    if (n < 0 || n > s.types.size()) return std::nullopt;
+    for (int i = s.types.size() - n; i < s.types.size(); i++)
+      if (s.types[i] != ValueTag::NUMBER) return std::nullopt;
+    ValueTag tag = assumedResult;
+    if (callee != id) {
+      if (!compile(callee)) return std::nullopt;
+      tag = states[callee].entry.result;
+    }
+    s.types.resize(s.types.size() - n);
+    return tag;
+  };
+
+  flow(0, StackState{std::vector<ValueTag>(params, ValueTag::NUMBER), true});
+  while (!worklist.empty()) {
+    int i = worklist.back();
+    worklist.pop_back();
+    StackState s = *in[i];
+    auto &types = s.types;
+    const auto &d = insts[i];
+    // instructions using the top of the stack, and popping it without
+    // leaving the frame empty
+    const bool hasTop = !s.notop && !types.empty();
+    const bool canPop = hasTop && types.size() >= 2;
+    bool ok = false;
+    switch (d.inst) {
+      case Instruction::GetI:
+        if (d.imm < 0 || d.imm >= types.size()) break;
+        types.push_back(types[d.imm]);
+        s.notop = false;
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::SetI:
+        if (!canPop || d.imm < 0 || d.imm >= types.size() - 1) break;
+        types[d.imm] = types.back();
+        types.pop_back();
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::AddI:
+        if (!hasTop || types.back() != ValueTag::NUMBER) break;
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::JumpI:
+        ok = flow(jumpTarget(i), s);
+        break;
+      case Instruction::JumpFalseI:
+        if (!canPop || types.back() != ValueTag::BOOLEAN) break;
+        types.pop_back();
+        ok = flow(i + 1, s) && flow(jumpTarget(i), s);
+        break;
+      case Instruction::Pop:
+        if (!canPop) break;
+        types.pop_back();
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::Dup:
+        if (!hasTop) break;
+        types.push_back(types.back());
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::BuiltinUnaryOp:
+      case Instruction::NumUnaryOp: {
+        if (!hasTop) break;
+        auto op = static_cast<BuiltinUnary>(d.imm);
+        if (op == BuiltinUnary::NOT) {
+          if (d.inst == Instruction::NumUnaryOp ||
+              types.back() != ValueTag::BOOLEAN)
+            break;
+        } else if (!isNumericUnary(op) || types.back() != ValueTag::NUMBER) {
+          break;
+        }
+        ok = flow(i + 1, s);
+        break;
+      }
+      case Instruction::BinaryOp:
+      case Instruction::NumBinaryOp: {
+        if (!canPop) break;
+        auto op = static_cast<BinOp>(d.imm);
+        auto lhs = types[types.size() - 2];
+        auto rhs = types.back();
+        types.pop_back();
+        if (lhs == ValueTag::NUMBER && rhs == ValueTag::NUMBER &&
+            op <= BinOp::NEQ) {
+          types.back() = op <= BinOp::EXP ? ValueTag::NUMBER
+                                          : ValueTag::BOOLEAN;
+        } else if (d.inst == Instruction::BinaryOp &&
+                   lhs == ValueTag::BOOLEAN && rhs == ValueTag::BOOLEAN &&
+                   op >= BinOp::EQ && op <= BinOp::OR) {
+          types.back() = ValueTag::BOOLEAN;
+        } else {
+          break;
+        }
+        ok = flow(i + 1, s);
+        break;
+      }
+      case Instruction::ConstNum:
+        types.push_back(ValueTag::NUMBER);
+        s.notop = false;
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::ConstMisc:
+        if (d.imm != 0 && d.imm != 1) break;
+        types.push_back(ValueTag::BOOLEAN);
+        s.notop = false;
+        ok = flow(i + 1, s);
+        break;
+      case Instruction::CallI: {
+        auto tag = call(d.imm, s);
+        if (!tag) break;
+        types.push_back(*tag);
+        s.notop = false;
+        ok = flow(i + 1, s);
+        break;
+      }
+      case Instruction::SpecializeI:
+        // we know the parameters are numbers, so this always continues in
+        // the specialized function, which is just a tail call at the entry
+        if (!s.notop || types.size() != params || d.imm < 0 ||
+            d.imm >= functions.size() ||
+            functions[d.imm].parameters != params)
+          break;
+        [[fallthrough]];
+      case Instruction::TailCallI: {
+        auto tag = call(d.imm, s);
+        ok = tag && ret(*tag);
+        break;
+      }
+      case Instruction::Ret:
+        ok = hasTop && ret(types.back());
+        break;
+      default:
+        break;
+    }
+    if (!ok) return false;
+  }
+  if (!result || *result != assumedResult) return false;
+
+  // code generation, the stack slot k is at [rbp + 8k - frameSize], the
+  // recursion depth is saved at [rbp - 8] and the stop flag at [rbp - 16]
+  const int frameSize = ((stackSize + 2) * 8 + 15) / 16 * 16;
+  auto slot = [&](int k) { return 8 * k - frameSize; };
+  Assembler a;
+  std::vector<int> labels(insts.size(), -1);
+  // (patch position, instruction index)
+  std::vector<std::pair<int, int>> jumps;
+  std::vector<int> bails;
+
+  // push rbp; mov rbp, rsp; sub rsp, frameSize
+  a.emit({0x55, 0x48, 0x89, 0xE5, 0x48, 0x81, 0xEC});
+  a.imm32(frameSize);
+  // cmp rsi, maxDepth; jg bail
+  a.emit({0x48, 0x81, 0xFE});
+  a.imm32(maxDepth);
+  bails.push_back(a.jump({0x0F, 0x8F}));
+  // mov [rbp - 8], rsi; mov [rbp - 16], rdx
+  a.rbp({0x48, 0x89}, 6, -8);
+  a.rbp({0x48, 0x89}, 2, -16);
+  for (int k = 0; k < params; k++) {
+    // mov rax, [rdi + 8k]
+    a.emit({0x48, 0x8B, 0x87});
+    a.imm32(8 * k);
+    a.store(slot(k));
+  }
+  // bail out if the evaluation was stopped, at the entry and before loops
+  auto emitStopCheck = [&]() {
+    // mov rax, [rbp - 16]; cmp byte [rax], 0; je bail
+    a.rbp({0x48, 0x8B}, 0, -16);
+    a.emit({0x80, 0x38, 0x00});
+    bails.push_back(a.jump({0x0F, 0x84}));
+  };
+  // self tail calls jump here, so they check the flag as well
+  const int body = a.code.size();
+  emitStopCheck();
+
+  auto emitCall = [&](int callee, int argStart) {
+    // lea rdi, [rbp + slot]; mov rsi, [rbp - 8]; add rsi, 1;
+    // mov rdx, [rbp - 16]
+    a.rbp({0x48, 0x8D}, 7, slot(argStart));
+    a.rbp({0x48, 0x8B}, 6, -8);
+    a.emit({0x48, 0x83, 0xC6, 0x01});
+    a.rbp({0x48, 0x8B}, 2, -16);
+    if (callee == id) {
+      a.patch(a.jump({0xE8}), 0);
+    } else {
+      a.movabs(reinterpret_cast<uint64_t>(states[callee].entry.code));
+      a.callRax();
+    }
+    // test rax, rax; jnz bail
+    a.emit({0x48, 0x85, 0xC0});
+    bails.push_back(a.jump({0x0F, 0x85}));
+  };
+  auto emitRet = [&]() {
+    // xor eax, eax; leave; ret
+    a.emit({0x31, 0xC0, 0xC9, 0xC3});
+  };
+
+  for (int i = 0; i < insts.size(); i++) {
+    if (!in[i]) continue;
+    labels[i] = a.code.size();
+    const auto &d = insts[i];
+    const int depth = in[i]->types.size();
+    const int top = slot(depth - 1);
+    switch (d.inst) {
+      case Instruction::GetI:
+        a.load(slot(d.imm));
+        a.store(slot(depth));
+        break;
+      case Instruction::SetI:
+        a.load(top);
+        a.store(slot(d.imm));
+        break;
+      case Instruction::AddI:
+        a.loadsd(0, top);
+        a.movabs(bits(static_cast<double>(d.imm)));
+        // movq xmm1, rax; addsd xmm0, xmm1
+        a.emit({0x66, 0x48, 0x0F, 0x6E, 0xC8, 0xF2, 0x0F, 0x58, 0xC1});
+        a.storesd(0, top);
+        break;
+      case Instruction::JumpI:
+        if (d.imm <= 0) emitStopCheck();
+        jumps.push_back({a.jump({0xE9}), jumpTarget(i)});
+        break;
+      case Instruction::JumpFalseI:
+        if (d.imm <= 0) emitStopCheck();
+        // test rax, rax; jz target
+        a.load(top);
+        a.emit({0x48, 0x85, 0xC0});
+        jumps.push_back({a.jump({0x0F, 0x84}), jumpTarget(i)});
+        break;
+      case Instruction::Pop:
+        break;
+      case Instruction::Dup:
+        a.load(top);
+        a.store(slot(depth));
+        break;
+      case Instruction::BuiltinUnaryOp:
+      case Instruction::NumUnaryOp:
+        switch (static_cast<BuiltinUnary>(d.imm)) {
+          case BuiltinUnary::NOT:
+            // xor qword [top], 1
+            a.rbp({0x48, 0x83}, 6, top);
+            a.code.push_back(1);
+            break;
+          case BuiltinUnary::NEG:
+          case BuiltinUnary::ABS:
+            // btc/btr rax, 63 flips/clears the sign bit
+            a.load(top);
+            a.emit({0x48, 0x0F, 0xBA,
+                    static_cast<unsigned char>(
+                        static_cast<BuiltinUnary>(d.imm) == BuiltinUnary::NEG
+                            ? 0xF8
+                            : 0xF0),
+                    0x3F});
+            a.store(top);
+            break;
+          case BuiltinUnary::SQRT:
+            // sqrtsd xmm0, [top]
+            a.rbp({0xF2, 0x0F, 0x51}, 0, top);
+            a.storesd(0, top);
+            break;
+          default:
+            a.loadsd(0, top);
+            // mov edi, op
+            a.emit({0xBF});
+            a.imm32(d.imm);
+            a.movabs(reinterpret_cast<uint64_t>(&jitUnary));
+            a.callRax();
+            a.storesd(0, top);
+            break;
+        }
+        break;
+      case Instruction::BinaryOp:
+      case Instruction::NumBinaryOp: {
+        const int lhs = slot(depth - 2);
+        const int rhs = top;
+        const auto op = static_cast<BinOp>(d.imm);
+        if (in[i]->types.back() == ValueTag::BOOLEAN) {
+          a.load(lhs);
+          if (op == BinOp::AND || op == BinOp::OR) {
+            // and/or rax, [rhs]
+            a.rbp({0x48, static_cast<unsigned char>(
+                             op == BinOp::AND ? 0x23 : 0x0B)},
+                  0, rhs);
+          } else {
+            // cmp rax, [rhs]; sete/setne al; movzx eax, al
+            a.rbp({0x48, 0x3B}, 0, rhs);
+            a.emit({0x0F, static_cast<unsigned char>(
+                              op == BinOp::EQ ? 0x94 : 0x95),
+                    0xC0, 0x0F, 0xB6, 0xC0});
+          }
+          a.store(lhs);
+          break;
+        }
+        switch (op) {
+          case BinOp::ADD:
+          case BinOp::SUB:
+          case BinOp::MUL:
+          case BinOp::DIV: {
+            const unsigned char opcode = op == BinOp::ADD   ? 0x58
+                                         : op == BinOp::SUB ? 0x5C
+                                         : op == BinOp::MUL ? 0x59
+                                                            : 0x5E;
+            a.loadsd(0, lhs);
+            a.rbp({0xF2, 0x0F, opcode}, 0, rhs);
+            a.storesd(0, lhs);
+            break;
+          }
+          case BinOp::MOD:
+          case BinOp::EXP:
+            a.loadsd(0, lhs);
+            a.loadsd(1, rhs);
+            a.emit({0xBF});
+            a.imm32(d.imm);
+            a.movabs(reinterpret_cast<uint64_t>(&jitBinary));
+            a.callRax();
+            a.storesd(0, lhs);
+            break;
+          default: {
+            // ucomisd sets CF and ZF for unordered operands, so seta and
+            // setae are false for NaN like the interpreter
+            bool swap = op == BinOp::LT || op == BinOp::LE;
+            a.loadsd(0, swap ? rhs : lhs);
+            a.rbp({0x66, 0x0F, 0x2E}, 0, swap ? lhs : rhs);
+            switch (op) {
+              case BinOp::LT:
+              case BinOp::GT:
+                // seta al
+                a.emit({0x0F, 0x97, 0xC0});
+                break;
+              case BinOp::LE:
+              case BinOp::GE:
+                // setae al
+                a.emit({0x0F, 0x93, 0xC0});
+                break;
+              case BinOp::EQ:
+                // sete al; setnp cl; and al, cl
+                a.emit({0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8});
+                break;
+              default:
+                // setne al; setp cl; or al, cl
+                a.emit({0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8});
+                break;
+            }
+            // movzx eax, al
+            a.emit({0x0F, 0xB6, 0xC0});
+            a.store(lhs);
+            break;
+          }
+        }
+        break;
+      }
+      case Instruction::ConstNum:
+        a.movabs(bits(d.number));
+        a.store(slot(depth));
+        break;
+      case Instruction::ConstMisc:
+        a.movabs(d.imm);
+        a.store(slot(depth));
+        break;
+      case Instruction::CallI: {
+        const int n = functions[d.imm].parameters;
+        emitCall(d.imm, depth - n);
+        a.storesd(0, slot(depth - n));
+        break;
+      }
+      case Instruction::SpecializeI:
+      case Instruction::TailCallI: {
+        const int n = functions[d.imm].parameters;
+        if (d.imm == id) {
+          // reuse the frame
+          for (int k = 0; k < n; k++) {
+            a.load(slot(depth - n + k));
+            a.store(slot(k));
+          }
+          a.patch(a.jump({0xE9}), body);
+        } else {
+          // the result is already in xmm0 and rax is 0
+          emitCall(d.imm, depth - n);
+          a.emit({0xC9, 0xC3});
+        }
+        break;
+      }
+      case Instruction::Ret:
+        a.loadsd(0, top);
+        emitRet();
+        break;
+      default:
+        return false;
+    }
+  }
+  for (auto [at, target] : jumps) a.patch(at, labels[target]);
+  const int bail = a.code.size();
+  // mov eax, 1; leave; ret
+  a.emit({0xB8, 0x01, 0x00, 0x00, 0x00, 0xC9, 0xC3});
+  for (int at : bails) a.patch(at, bail);
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t size = (a.code.size() + page - 1) / page * page;
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return false;
+  memcpy(memory, a.code.data(), a.code.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+  regions.push_back({memory, size});
+  states[id].entry = Entry{reinterpret_cast<JitFunction>(memory), *result};
+  return true;
+}
+#endif
+}  // namespace sscad
@@ -0,0 +1,102 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <atomic>
+#include <vector>
+
+#include "evaluator.h"
+
+namespace sscad {
+// Result of a compiled function. With the System V ABI this is returned in
+// xmm0 and rax.
+struct JitResult {
+  double value;
+  // non-zero when the native code gave up, e.g. the recursion is too deep or
+  // the evaluation was stopped. Compiled functions have no side effects, so
+  // the interpreter can simply redo the call.
+  long status;
+};
+
+// the arguments are the parameters of the function, which must all be numbers.
+// running is the stop flag of the evaluation, checked at every call and loop.
+using JitFunction = JitResult (*)(const double *args, long depth,
+                                  const std::atomic<bool> *running);
+
+/**
+ * Baseline template JIT for x86-64.
+ *
+ * Hot functions are translated instruction by instruction into machine code,
+ * with the operand stack mapped to fixed slots in the native stack frame.
+ * Only functions working purely on numbers and booleans are compiled: the
+ * type of every stack slot is determined statically, assuming the parameters
+ * are numbers, and functions using any other instruction or type are
+ * rejected and stay in the interpreter. Calls to other functions are only
+ * allowed if the callee can be compiled as well.
+ *
+ * The interpreter enters compiled code at CallI when all the arguments are
+ * numbers.
+ */
+class Jit {
+ public:
+  struct Entry {
+    JitFunction code;
+    // NUMBER or BOOLEAN
+    ValueTag result;
+  };
+
+  // functions are compiled after `threshold` calls
+  Jit(const std::vector<FunctionEntry> &functions, int threshold);
+  ~Jit();
+
+  // Count a call to the function, compiling it when it becomes hot.
+  // Returns nullptr if the function is not compiled.
+  const Entry *enter(int id) {
+    auto &state = states[id];
+    if (state.entry.code != nullptr) return &state.entry;
+    if (state.rejected || ++state.calls < threshold) return nullptr;
+    return compile(id) ? &state.entry : nullptr;
+  }
+
+  // compile the function now, returns false if it is not supported
+  bool compile(int id);
+
+  // whether the JIT can run on this platform
+  static bool supported();
+
+  // native recursion depth before bailing out to the interpreter, which keeps
+  // its stacks on the heap
+  static constexpr int maxDepth = 1000;
+
+  JitStats stats;
+
+ private:
+  struct State {
+    Entry entry = {nullptr, ValueTag::UNDEF};
+    int calls = 0;
+    bool rejected = false;
+    // for detecting cycles between different functions
+    bool compiling = false;
+  };
+
+  bool tryCompile(int id, ValueTag assumedResult);
+
+  const std::vector<FunctionEntry> &functions;
+  std::vector<State> states;
+  // executable memory regions and their sizes
+  std::vector<std::pair<void *, size_t>> regions;
+  int threshold;
+};
+}  // namespace sscad
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <cmath>
+#include <stdexcept>
+
+#include "instructions.h"
+
+namespace sscad {
+// whether numericUnary supports the builtin
+constexpr bool isNumericUnary(BuiltinUnary op) {
+  return op >= BuiltinUnary::NEG && op <= BuiltinUnary::SQRT;
+}
+
+// numerical builtins on a number operand, shared by the interpreter and the
+// JIT helpers so they produce bit identical results
+inline double numericUnary(double v, BuiltinUnary op) {
+  switch (op) {
+    case BuiltinUnary::NEG:
+      return -v;
+    case BuiltinUnary::SIN:
+      return std::sin(v);
+    case BuiltinUnary::COS:
+      return std::cos(v);
+    case BuiltinUnary::TAN:
+      return std::tan(v);
+    case BuiltinUnary::ASIN:
+      return std::asin(v);
+    case BuiltinUnary::ACOS:
+      return std::acos(v);
+    case BuiltinUnary::ATAN:
+      return std::atan(v);
+    case BuiltinUnary::ABS:
+      return std::abs(v);
+    case BuiltinUnary::CEIL:
+      return std::ceil(v);
+    case BuiltinUnary::FLOOR:
+      return std::floor(v);
+    case BuiltinUnary::LN:
+      return std::log(v);
+    case BuiltinUnary::LOG:
+      return std::log10(v);
+    case BuiltinUnary::ROUND:
+      return std::round(v);
+    case BuiltinUnary::SIGN:
+      return v == 0.0 ? 0.0 : v > 0.0 ? 1.0 : -1.0;
+    case BuiltinUnary::SQRT:
+      return std::sqrt(v);
+    default:
+      throw std::runtime_error("unimplemented");
+  }
+}
+}  // namespace sscad
@@ -0,0 +1,212 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "profile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <tuple>
+
+#include "evaluator.h"
+#include "instructions.h"
+
+namespace sscad {
+Profile::Profile(std::shared_ptr<const Program> program)
+    : program(std::move(program)) {
+  const auto &functions = this->program->functions;
+  calls.resize(functions.size());
+  pcCounts.resize(functions.size());
+  for (size_t i = 0; i < functions.size(); i++)
+    pcCounts[i].resize(functions[i].instructions.size());
+  nodes.push_back(CallNode{-1, -1});
+}
+
+int Profile::child(int node, int function) {
+  auto iter = nodes[node].children.find(function);
+  if (iter != nodes[node].children.end()) return iter->second;
+  int id = nodes.size();
+  nodes[node].children.insert({function, id});
+  nodes.push_back(CallNode{function, node});
+  return id;
+}
+
+void Profile::merge(const Profile &other, int node) {
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    opcodes[i].count += other.opcodes[i].count;
+    opcodes[i].cycles += other.opcodes[i].cycles;
+  }
+  for (size_t i = 0; i < calls.size(); i++) {
+    calls[i] += other.calls[i];
+    for (size_t pc = 0; pc < pcCounts[i].size(); pc++)
+      pcCounts[i][pc] += other.pcCounts[i][pc];
+  }
+  // (node in other, node here)
+  std::vector<std::pair<int, int>> pending{{0, node}};
+  while (!pending.empty()) {
+    auto [from, to] = pending.back();
+    pending.pop_back();
+    nodes[to].instructions += other.nodes[from].instructions;
+    for (auto [function, next] : other.nodes[from].children)
+      pending.push_back({next, child(to, function)});
+  }
+}
+
+std::vector<Profile::FunctionStats> Profile::functionStats() const {
+  std::vector<FunctionStats> stats(calls.size());
+  for (size_t i = 0; i < calls.size(); i++) {
+    stats[i].calls = calls[i];
+    for (auto count : pcCounts[i]) stats[i].exclusive += count;
+  }
+  // children are created after their parents
+  std::vector<unsigned long> subtree(nodes.size());
+  for (size_t i = nodes.size(); i-- > 1;) {
+    subtree[i] += nodes[i].instructions;
+    subtree[nodes[i].parent] += subtree[i];
+  }
+  // recursive calls are only counted at the outermost call
+  std::vector<int> onStack(calls.size());
+  std::vector<std::pair<int, bool>> pending;
+  for (auto [function, node] : nodes[0].children)
+    pending.push_back({node, true});
+  while (!pending.empty()) {
+    auto [node, enter] = pending.back();
+    pending.pop_back();
+    int function = nodes[node].function;
+    if (!enter) {
+      onStack[function]--;
+      continue;
+    }
+    if (onStack[function]++ == 0) stats[function].inclusive += subtree[node];
+    pending.push_back({node, false});
+    for (auto [callee, next] : nodes[node].children)
+      pending.push_back({next, true});
+  }
+  return stats;
+}
+
+static double percent(unsigned long count, unsigned long total) {
+  return total == 0 ? 0 : 100.0 * count / total;
+}
+
+void Profile::report(std::ostream &os, size_t limit) const {
+  unsigned long total = 0;
+  unsigned long totalCycles = 0;
+  std::vector<int> ops;
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    total += opcodes[i].count;
+    totalCycles += opcodes[i].cycles;
+    if (opcodes[i].count > 0) ops.push_back(i);
+  }
+  os << "instructions: " << total << ", cycles: " << totalCycles << std::endl;
+  auto flags = os.flags();
+  os << std::fixed << std::setprecision(1);
+
+  std::sort(ops.begin(), ops.end(), [&](int a, int b) {
+    return opcodes[a].count > opcodes[b].count;
+  });
+  if (ops.size() > limit) ops.resize(limit);
+  os << std::endl
+     << std::left << std::setw(16) << "opcode" << std::right << std::setw(14)
+     << "count" << std::setw(8) << "%" << std::setw(14) << "cycles/op"
+     << std::endl;
+  for (int op : ops)
+    os << std::left << std::setw(16)
+       << getInstName(static_cast<Instruction>(op)) << std::right
+       << std::setw(14) << opcodes[op].count << std::setw(8)
+       << percent(opcodes[op].count, total) << std::setw(14)
+       << static_cast<double>(opcodes[op].cycles) / opcodes[op].count
+       << std::endl;
+
+  auto stats = functionStats();
+  std::vector<int> functions;
+  for (size_t i = 0; i < stats.size(); i++)
+    if (stats[i].calls > 0 || stats[i].exclusive > 0) functions.push_back(i);
+  std::sort(functions.begin(), functions.end(), [&](int a, int b) {
+    return stats[a].inclusive > stats[b].inclusive;
+  });
+  if (functions.size() > limit) functions.resize(limit);
+  os << std::endl
+     << std::left << std::setw(32) << "function" << std::right << std::setw(12)
+     << "calls" << std::setw(14) << "inclusive" << std::setw(8) << "%"
+     << std::setw(14) << "exclusive" << std::setw(8) << "%" << std::endl;
+  for (int f : functions)
+    os << std::left << std::setw(32) << program->describe(f) << std::right
+       << std::setw(12) << stats[f].calls << std::setw(14)
+       << stats[f].inclusive << std::setw(8)
+       << percent(stats[f].inclusive, total) << std::setw(14)
+       << stats[f].exclusive << std::setw(8)
+       << percent(stats[f].exclusive, total) << std::endl;
+
+  // (file, line) of the instructions, instructions without a location are
+  // reported as unknown
+  std::map<std::tuple<FileHandle, uint32_t, int>, unsigned long> byLine;
+  unsigned long unknown = 0;
+  for (size_t f = 0; f < pcCounts.size(); f++) {
+    const auto &fn = program->functions[f];
+    for (size_t pc = 0; pc < pcCounts[f].size(); pc++) {
+      if (pcCounts[f][pc] == 0) continue;
+      const Location *loc = fn.location(pc);
+      if (loc == nullptr)
+        unknown += pcCounts[f][pc];
+      else
+        byLine[{loc->begin.src, loc->begin.include, loc->begin.line}] +=
+            pcCounts[f][pc];
+    }
+  }
+  std::vector<std::pair<std::tuple<FileHandle, uint32_t, int>, unsigned long>>
+      lines(byLine.begin(), byLine.end());
+  std::sort(lines.begin(), lines.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  if (lines.size() > limit) lines.resize(limit);
+  os << std::endl
+     << std::left << std::setw(32) << "line" << std::right << std::setw(14)
+     << "instructions" << std::setw(8) << "%" << std::endl;
+  for (auto &[key, count] : lines) {
+    std::stringstream ss;
+    auto [src, include, line] = key;
+    ss << src << ":" << line;
+    if (include != 0) ss << " (include " << include << ")";
+    os << std::left << std::setw(32) << ss.str() << std::right
+       << std::setw(14) << count << std::setw(8) << percent(count, total)
+       << std::endl;
+  }
+  if (unknown > 0)
+    os << std::left << std::setw(32) << "unknown" << std::right
+       << std::setw(14) << unknown << std::setw(8) << percent(unknown, total)
+       << std::endl;
+  os.flags(flags);
+}
+
+void Profile::collapsedStacks(std::ostream &os) const {
+  // (node, length of the stack string of its parent)
+  std::string stack;
+  std::vector<std::pair<int, size_t>> pending;
+  for (auto [function, node] : nodes[0].children)
+    pending.push_back({node, 0});
+  while (!pending.empty()) {
+    auto [node, length] = pending.back();
+    pending.pop_back();
+    stack.resize(length);
+    if (length > 0) stack += ";";
+    stack += program->describe(nodes[node].function);
+    if (nodes[node].instructions > 0)
+      os << stack << " " << nodes[node].instructions << "\n";
+    for (auto [function, next] : nodes[node].children)
+      pending.push_back({next, stack.size()});
+  }
+  os.flush();
+}
+}  // namespace sscad
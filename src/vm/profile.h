@@ -0,0 +1,103 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <array>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+namespace sscad {
+struct Program;
+
+/**
+ * Instruction level profile of the evaluations of an evaluator, see
+ * Evaluator::setProfiling.
+ *
+ * Every executed instruction is counted by opcode, by function and pc, and by
+ * call stack. Source lines come from the line tables of the functions. Cycles
+ * are read from the time stamp counter where there is one, and from a
+ * nanosecond clock otherwise. They include the overhead of profiling, so they
+ * are only good for comparing opcodes with each other.
+ */
+class Profile {
+ public:
+  struct OpcodeStats {
+    unsigned long count = 0;
+    unsigned long cycles = 0;
+  };
+  struct FunctionStats {
+    // entering a number specialized clone from the guard of the generic
+    // function does not count as a call
+    unsigned long calls = 0;
+    // instructions in the function itself, and including the callees
+    unsigned long exclusive = 0;
+    unsigned long inclusive = 0;
+  };
+  // Node of the call tree, one for each distinct call stack. Node 0 is the
+  // root, the caller of the evaluated functions.
+  struct CallNode {
+    int function;
+    int parent;
+    unsigned long instructions = 0;
+    std::map<int, int> children;
+  };
+
+  Profile(std::shared_ptr<const Program> program);
+
+  static unsigned long cycles() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  // node for a call to `function` from `node`, created on the first call
+  int child(int node, int function);
+  // add the counts of another profile of the same program, with its root
+  // at `node`
+  void merge(const Profile &other, int node);
+
+  // indexed by function
+  std::vector<FunctionStats> functionStats() const;
+  // The opcodes, functions and source lines with the most instructions, at
+  // most `limit` of each.
+  void report(std::ostream &os, size_t limit = 20) const;
+  // One line per call stack with the instructions executed in its innermost
+  // function, for flame graph tools.
+  void collapsedStacks(std::ostream &os) const;
+
+  // indexed by opcode
+  std::array<OpcodeStats, 256> opcodes;
+  // calls of each function, including the evaluated functions
+  std::vector<unsigned long> calls;
+  // instructions executed at each pc of each function
+  std::vector<std::vector<unsigned long>> pcCounts;
+  std::vector<CallNode> nodes;
+
+ private:
+  std::shared_ptr<const Program> program;
+};
+}  // namespace sscad
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sampler.h"
+
+#include <map>
+#include <sstream>
+
+#include "evaluator.h"
+
+namespace sscad {
+static size_t roundUp(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size <<= 1;
+  return size;
+}
+
+Sampler::Sampler(std::shared_ptr<const Program> program,
+                 std::chrono::microseconds period, size_t capacity)
+    : program(std::move(program)),
+      slots(new Slot[roundUp(capacity)]),
+      mask(roundUp(capacity) - 1) {
+  for (size_t i = 0; i <= mask; i++)
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  timer = std::thread([this, period]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wakeup.wait_for(lock, period, [this]() { return stopping; }))
+      tick.fetch_add(1, std::memory_order_relaxed);
+  });
+}
+
+Sampler::~Sampler() {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  timer.join();
+}
+
+void Sampler::add(const Sample &sample) {
+  size_t pos = head.load(std::memory_order_relaxed);
+  while (true) {
+    Slot &slot = slots[pos & mask];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence == pos) {
+      if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (sequence < pos) {
+      // the slot still holds the sample from the previous round
+      lost.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+  Slot &slot = slots[pos & mask];
+  slot.sample = sample;
+  slot.sequence.store(pos + 1, std::memory_order_release);
+}
+
+size_t Sampler::drain(std::vector<Sample> &samples) {
+  size_t count = 0;
+  size_t pos = tail.load(std::memory_order_relaxed);
+  while (true) {
+    Slot &slot = slots[pos & mask];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence == pos + 1) {
+      if (!tail.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed))
+        continue;
+      samples.push_back(slot.sample);
+      slot.sequence.store(pos + mask + 1, std::memory_order_release);
+      pos++;
+      count++;
+    } else if (sequence < pos + 1) {
+      // empty, or a sample that is still being written
+      return count;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void Sampler::collapsedStacks(const std::vector<Sample> &samples,
+                              std::ostream &os) const {
+  std::map<std::string, size_t> stacks;
+  for (const auto &sample : samples) {
+    std::stringstream ss;
+    if (sample.truncated) ss << "...;";
+    for (int i = sample.depth - 1; i >= 0; i--) {
+      ss << program->describe(sample.functions[i], sample.pcs[i]);
+      if (i > 0) ss << ";";
+    }
+    stacks[ss.str()]++;
+  }
+  for (auto &[stack, count] : stacks) os << stack << " " << count << "\n";
+  os.flush();
+}
+}  // namespace sscad
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace sscad {
+struct Program;
+
+/**
+ * Low overhead sampling profiler for evaluators running a program, see
+ * Evaluator::setSampler.
+ *
+ * A timer thread ticks every period. Each evaluator using the sampler checks
+ * for a new tick every thousand instructions or so, at the points where it
+ * checks for interrupts, and takes one sample of its call stack per tick. The
+ * sample goes into a bounded lock-free buffer shared by all the evaluators,
+ * samples are dropped when it is full. The evaluators never block and only
+ * touch their own stacks, so this can stay enabled in production.
+ *
+ * Samples are only taken between instructions, so the time spent in an
+ * instruction is attributed to the next check point, and native code from
+ * the JIT is never sampled.
+ */
+class Sampler {
+ public:
+  static constexpr int maxFrames = 64;
+  struct Sample {
+    // frames from the innermost, the pc is in the instruction running in
+    // the frame, e.g. the call
+    int depth = 0;
+    bool truncated = false;
+    std::array<int, maxFrames> functions;
+    std::array<int, maxFrames> pcs;
+  };
+
+  Sampler(std::shared_ptr<const Program> program,
+          std::chrono::microseconds period = std::chrono::milliseconds(1),
+          size_t capacity = 4096);
+  Sampler(const Sampler &) = delete;
+  Sampler &operator=(const Sampler &) = delete;
+  ~Sampler();
+
+  // Move the buffered samples into `samples`, returns how many there were.
+  // Can be called while evaluators are adding samples.
+  size_t drain(std::vector<Sample> &samples);
+  // samples lost because the buffer was full
+  size_t dropped() const { return lost.load(std::memory_order_relaxed); }
+  // One line per distinct stack with its number of samples, for flame graph
+  // tools. Frames are functions with the source position of their pc, see
+  // Program::describe.
+  void collapsedStacks(const std::vector<Sample> &samples,
+                       std::ostream &os) const;
+
+  const std::shared_ptr<const Program> program;
+
+  // for the evaluators
+  unsigned long ticks() const { return tick.load(std::memory_order_relaxed); }
+  void add(const Sample &sample);
+
+ private:
+  // bounded multi-producer queue, each slot has a sequence number telling
+  // whether it is free for the enqueue at that position or holds the sample
+  // for the dequeue at that position
+  struct Slot {
+    std::atomic<size_t> sequence;
+    Sample sample;
+  };
+  std::unique_ptr<Slot[]> slots;
+  const size_t mask;
+  std::atomic<size_t> head = 0;
+  std::atomic<size_t> tail = 0;
+  std::atomic<size_t> lost = 0;
+
+  std::atomic<unsigned long> tick = 0;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  bool stopping = false;
+  std::thread timer;
+};
+}  // namespace sscad
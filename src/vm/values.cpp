@@ -20,7 +20,7 @@ bool ValuePair::operator==(ValuePair rhs) const {
   if (tag != rhs.tag) return false;
   switch (tag) {
     case ValueTag::STRING:
-      return value.s == rhs.value.s;
+      return *value.s == *rhs.value.s;
     case ValueTag::VECTOR:
       if (value.vec->values->size() != rhs.value.vec->values->size())
         return false;
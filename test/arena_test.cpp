@@ -0,0 +1,137 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Allocates small, over-aligned and large objects from an arena, including
+// objects larger than a block, and checks their alignment, that they do not
+// overlap, that large objects do not waste the current block, and that shared
+// objects keep their arena alive. Run it with AddressSanitizer to catch writes
+// out of the blocks.
+// Usage: arenaTest
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "utils/arena.h"
+
+using namespace sscad;
+
+static int failures = 0;
+
+static void expect(bool cond, const std::string &what) {
+  if (cond) return;
+  std::cout << what << std::endl;
+  failures++;
+}
+
+struct Allocation {
+  char *ptr;
+  size_t size;
+};
+
+// allocate and fill, the contents are checked at the end
+static char *allocate(Arena &arena, std::vector<Allocation> &allocations,
+                      size_t size, size_t align) {
+  auto ptr = static_cast<char *>(arena.allocate(size, align));
+  expect(reinterpret_cast<uintptr_t>(ptr) % align == 0,
+         "misaligned allocation of " + std::to_string(size) + " bytes");
+  memset(ptr, static_cast<int>(allocations.size() & 0xff), size);
+  allocations.push_back({ptr, size});
+  return ptr;
+}
+
+struct alignas(64) CacheLine {
+  char bytes[64];
+};
+
+int main() {
+  constexpr size_t block = Arena::blockSize;
+  std::vector<Allocation> allocations;
+  {
+    // the first allocation can be a large one
+    Arena arena;
+    allocate(arena, allocations, 2 * block, 16);
+    expect(arena.reserved() >= 2 * block && arena.reserved() < 3 * block,
+           "large first allocation");
+    allocate(arena, allocations, 8, 8);
+  }
+
+  allocations.clear();
+  auto owner = std::make_shared<Arena>();
+  Arena &arena = *owner;
+  char *first = allocate(arena, allocations, 24, 8);
+  expect(arena.reserved() == block, "small allocation reserved a block");
+  // objects that do not fit in the current block, larger than a block
+  for (size_t size : {3 * block + 1, block})
+    allocate(arena, allocations, size, 16);
+  // the large objects got their own blocks, the current one is still used
+  char *next = allocate(arena, allocations, 24, 8);
+  expect(next == first + 24, "large allocations wasted the current block");
+  // large objects that fit still go to the current block
+  char *fits = allocate(arena, allocations, block / 2, 16);
+  expect(fits >= next + 24 && fits < next + 40,
+         "large allocation is not in the current block");
+  // over-aligned objects, at an odd offset in the block
+  allocate(arena, allocations, 1, 1);
+  for (size_t align : {32, 64, 256, 4096}) {
+    allocate(arena, allocations, align, align);
+    allocate(arena, allocations, 1, 1);
+  }
+  // fill the rest of the block with small objects, then start a new one
+  size_t reserved = arena.reserved();
+  while (arena.reserved() == reserved) allocate(arena, allocations, 100, 4);
+  expect(arena.reserved() == reserved + block, "small objects after a block");
+
+  // allocate_shared through the allocator, with the control block
+  ArenaAllocator<char> allocator(owner);
+  auto big = std::allocate_shared<std::array<double, block>>(allocator);
+  big->fill(1.5);
+  expect(reinterpret_cast<uintptr_t>(big.get()) % alignof(double) == 0,
+         "misaligned shared array");
+  auto line = std::allocate_shared<CacheLine>(allocator);
+  expect(reinterpret_cast<uintptr_t>(line.get()) % 64 == 0,
+         "misaligned shared cache line");
+
+  // nothing was overwritten by a later allocation
+  for (size_t i = 0; i < allocations.size(); i++) {
+    auto &allocation = allocations[i];
+    for (size_t j = 0; j < allocation.size; j++)
+      if (allocation.ptr[j] != static_cast<char>(i & 0xff)) {
+        expect(false, "allocation " + std::to_string(i) + " overwritten");
+        break;
+      }
+  }
+  for (double v : *big)
+    if (v != 1.5) {
+      expect(false, "shared array overwritten");
+      break;
+    }
+
+  // objects keep their arena alive
+  std::shared_ptr<CacheLine> survivor;
+  {
+    auto temporary = std::make_shared<Arena>();
+    survivor = std::allocate_shared<CacheLine>(ArenaAllocator<char>(temporary));
+  }
+  std::memset(survivor.get(), 1, sizeof(CacheLine));
+  survivor.reset();
+
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,200 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Folds constant function bodies and checks the kind of the folded
+// expressions, then runs every function with and without folding. Both must
+// return the same value, or both must fail. Constant lists must be loaded from
+// the constant pool, and a later unit must not get the constants of an earlier
+// one.
+// Usage: constEvalTest
+
+#include <iostream>
+#include <sstream>
+
+#include "codegen/bytecode_gen.h"
+#include "codegen/const_eval.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+
+using namespace sscad;
+
+static Location loc{};
+static Expr num(double v) { return std::make_shared<NumberNode>(v, loc); }
+static Expr boolean(bool v) { return std::make_shared<BoolNode>(v, loc); }
+static Expr bin(Expr lhs, Expr rhs, BinOp op) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, loc);
+}
+static Expr unary(Expr operand, UnaryOp op) {
+  return std::make_shared<UnaryOpNode>(operand, op, loc);
+}
+static Expr call(std::string name, Expr arg) {
+  std::vector<AssignNode> args;
+  args.emplace_back("", arg, loc);
+  return std::make_shared<CallNode>(std::make_shared<IdentNode>(name, loc),
+                                    args, loc);
+}
+static Expr ifExpr(Expr cond, Expr ifthen, Expr ifelse) {
+  return std::make_shared<IfExprNode>(cond, ifthen, ifelse, loc);
+}
+static Expr list(std::vector<Expr> elements) {
+  std::vector<std::pair<Expr, bool>> pairs;
+  for (auto &elem : elements) pairs.emplace_back(elem, false);
+  return std::make_shared<ListExprNode>(pairs, loc);
+}
+
+struct Case {
+  std::string source;
+  Expr body;
+  NodeKind folded;
+};
+
+static std::vector<Case> cases() {
+  return {
+      {"1 + 2 * 3", bin(num(1), bin(num(2), num(3), BinOp::MUL), BinOp::ADD),
+       NodeKind::NUMBER},
+      {"sqrt(16)", call("sqrt", num(16)), NodeKind::NUMBER},
+      {"sin(1)", call("sin", num(1)), NodeKind::NUMBER},
+      {"-sqrt(2)", unary(call("sqrt", num(2)), UnaryOp::NEG),
+       NodeKind::NUMBER},
+      {"len([1, 2, 3])", call("len", list({num(1), num(2), num(3)})),
+       NodeKind::NUMBER},
+      {"[1, 2, 3][1]",
+       std::make_shared<ListIndexNode>(list({num(1), num(2), num(3)}), num(1),
+                                       loc),
+       NodeKind::NUMBER},
+      {"2 < 3", bin(num(2), num(3), BinOp::LT), NodeKind::BOOL},
+      {"true && false", bin(boolean(true), boolean(false), BinOp::AND),
+       NodeKind::BOOL},
+      {"false || true", bin(boolean(false), boolean(true), BinOp::OR),
+       NodeKind::BOOL},
+      {"1 && true", bin(num(1), boolean(true), BinOp::AND),
+       NodeKind::BINARY_OP},
+      {"!true", unary(boolean(true), UnaryOp::NOT), NodeKind::BOOL},
+      {"!1", unary(num(1), UnaryOp::NOT), NodeKind::UNARY_OP},
+      {"true ? 2 : 3", ifExpr(boolean(true), num(2), num(3)),
+       NodeKind::NUMBER},
+      {"1 ? 2 : 3", ifExpr(num(1), num(2), num(3)), NodeKind::IF_EXPR},
+      {"[1, 2, [3]]", list({num(1), num(2), list({num(3)})}),
+       NodeKind::LIST_EXPR},
+  };
+}
+
+// function f<i>(x) = <case i>;
+// the entry functions calling f<i>(0) are the last functions of the program
+static std::shared_ptr<const Program> compile(bool fold,
+                                              std::vector<Expr> &bodies) {
+  TranslationUnit unit(0);
+  int i = 0;
+  for (auto &c : cases()) {
+    std::vector<AssignNode> params;
+    params.emplace_back("x", nullptr, loc);
+    unit.functions.emplace_back("f" + std::to_string(i++), params, c.body,
+                                loc);
+  }
+  if (fold) {
+    ConstEvaluator eval;
+    eval.visit(unit);
+  }
+  for (auto &fun : unit.functions) bodies.push_back(fun.body);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  for (int j = 0; j < i; j++) {
+    std::vector<unsigned char> entry;
+    addDouble(entry, 0);
+    addInst(entry, Instruction::CallI, j);
+    addInst(entry, Instruction::Ret);
+    functions.push_back({entry, 0, false});
+  }
+  return std::make_shared<const Program>(functions,
+                                         std::vector<ValueTag>{},
+                                         std::vector<SValue>{}, gen.constants);
+}
+
+// runs the entry of case i, returns the error message if it fails
+static std::string run(const Program &program, Evaluator &evaluator, int i,
+                       ValuePair &value) {
+  try {
+    value = evaluator.eval(program.functions.size() - cases().size() + i);
+    return "";
+  } catch (std::runtime_error &e) {
+    return e.what();
+  }
+}
+
+int main() {
+  std::vector<Expr> foldedBodies, plainBodies;
+  auto folded = compile(true, foldedBodies);
+  auto plain = compile(false, plainBodies);
+  std::stringstream output;
+  Evaluator foldedEval(&output, folded);
+  Evaluator plainEval(&output, plain);
+  const auto all = cases();
+  int failures = 0;
+  for (int i = 0; i < all.size(); i++) {
+    if (foldedBodies[i]->kind != all[i].folded) {
+      std::cout << all[i].source << ": unexpected folded node" << std::endl;
+      failures++;
+    }
+    ValuePair expected(ValueTag::UNDEF, {0});
+    ValuePair actual(ValueTag::UNDEF, {0});
+    auto expectedError = run(*plain, plainEval, i, expected);
+    auto actualError = run(*folded, foldedEval, i, actual);
+    if (expectedError.empty() != actualError.empty() ||
+        (expectedError.empty() && expected != actual)) {
+      std::cout << all[i].source << ": folded result differs" << std::endl;
+      failures++;
+    }
+    if (expectedError.empty()) Evaluator::release(expected);
+    if (actualError.empty()) Evaluator::release(actual);
+  }
+
+  // [1, 2, [3]] is a single constant load, the nested list is inlined
+  auto &instructions = folded->functions[all.size() - 1].instructions;
+  if (folded->constants.size() != 1 ||
+      instructions.front() != static_cast<unsigned char>(Instruction::ConstI)) {
+    std::cout << "constant list is not in the constant pool" << std::endl;
+    failures++;
+  }
+  // a later unit can reuse the node addresses of an earlier one, which must
+  // not give it the earlier constants
+  BytecodeGen gen;
+  for (int file = 0; file < 2; file++) {
+    TranslationUnit unit(file);
+    unit.functions.emplace_back(
+        "s", std::vector<AssignNode>{},
+        std::make_shared<StringNode>(std::to_string(file), loc), loc);
+    gen.visit(unit);
+  }
+  auto functions = gen.functions;
+  std::vector<unsigned char> entry;
+  addInst(entry, Instruction::CallI, 1);
+  addInst(entry, Instruction::Ret);
+  functions.push_back({entry, 0, false});
+  auto strings = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{},
+      gen.constants);
+  Evaluator stringEval(&output, strings);
+  auto second = stringEval.eval(functions.size() - 1);
+  if (second.tag != ValueTag::STRING || *second.value.s != "1") {
+    std::cout << "constant of an earlier unit reused" << std::endl;
+    failures++;
+  }
+  Evaluator::release(second);
+
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,123 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Removes the dead code of a small program and checks the declarations that
+// are left. Unused globals are removed unless their initializer may have side
+// effects, directly or in the functions it calls. The grammar has no echo
+// expression yet, so those are added to the parsed AST.
+// Usage: deadCodeTest
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "codegen/dead_code_elim.h"
+#include "frontend.h"
+
+using namespace sscad;
+
+const std::vector<std::string> sources = {
+    "use<1>\n"
+    "function inc(x) = x + 1;\n"
+    "function loud(x) = x;\n"
+    "function even(n) = n == 0 ? true : odd(n - 1);\n"
+    "function odd(n) = n == 0 ? false : even(n - 1);\n"
+    "function ping(n) = n > 0 ? pong(n - 1) : 0;\n"
+    "function pong(n) = ping(n) + loud(n);\n"
+    "function dead(x) = x;\n"
+    "f = function(x) x;\n"
+    "used = inc(1);\n"
+    "unused = inc(2);\n"
+    "recursive = even(10);\n"
+    "builtin = sqrt(2);\n"
+    "fromUse = lib(1);\n"
+    "lambda = function(x) loud(x);\n"
+    "valueCall = f(1);\n"
+    "indirect = loud(1);\n"
+    "cycle = ping(3);\n"
+    "$fn = 10;\n"
+    "cube(used);\n",
+
+    "function lib(x) = x * 2;\n",
+};
+
+static std::vector<std::string> names(const std::vector<FunctionDecl> &decls) {
+  std::vector<std::string> result;
+  for (auto &decl : decls) result.push_back(decl.name);
+  return result;
+}
+
+static std::vector<std::string> names(const std::vector<AssignNode> &decls) {
+  std::vector<std::string> result;
+  for (auto &decl : decls) result.push_back(decl.ident);
+  return result;
+}
+
+static std::string join(const std::vector<std::string> &strs) {
+  std::stringstream ss;
+  for (auto &str : strs) ss << str << " ";
+  return ss.str();
+}
+
+static int check(bool lazy) {
+  Frontend frontend(
+      [](std::string name, FileHandle) { return std::stoi(name); },
+      [](FileHandle file) {
+        return std::make_shared<std::stringstream>(sources.at(file));
+      });
+  frontend.setLazyBodies(lazy);
+  auto &unit = frontend.parse(0);
+  Location loc{};
+  auto echo = [&](std::string arg) {
+    std::vector<AssignNode> args;
+    args.emplace_back("", std::make_shared<IdentNode>(arg, loc), loc);
+    return std::make_shared<CallNode>(std::make_shared<IdentNode>("echo", loc),
+                                      args, loc);
+  };
+  // function loud(x) = echo(x);
+  for (auto &fun : unit.functions)
+    if (fun.name == "loud") {
+      frontend.parseBody(unit, fun);
+      fun.body = echo("x");
+    }
+  // echoed = echo(used);
+  unit.assignments.emplace_back("echoed", echo("used"), loc);
+
+  DeadCodeElim elim;
+  auto stats = elim.run(frontend, 0);
+  int failures = 0;
+  auto expect = [&](std::string what, std::string expected,
+                    std::string actual) {
+    if (expected == actual) return;
+    std::cout << (lazy ? "lazy " : "") << what << ": expected " << expected
+              << "got " << actual << std::endl;
+    failures++;
+  };
+  expect("functions", "inc loud ping pong ", join(names(unit.functions)));
+  expect("globals", "f used valueCall indirect cycle $fn echoed ",
+         join(names(unit.assignments)));
+  expect("used functions", "", join(names(frontend.units.at(1).functions)));
+  expect("removed", "4 5 ",
+         join({std::to_string(stats.functions),
+               std::to_string(stats.assignments)}));
+  return failures;
+}
+
+int main() {
+  int failures = check(false) + check(true);
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
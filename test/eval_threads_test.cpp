@@ -0,0 +1,751 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs one program on many threads, each thread with its own evaluators. The
+// program appends to a global vector, every evaluator must see only its own
+// writes and the program must be left untouched. Then runs a batch of
+// parameter variants, with an init function that can and one that cannot be
+// shared by the variants, and a parsed parameter after constant folding.
+// Then evaluates list comprehensions and independent calls on a thread pool
+// and compares them with a serial evaluation, ranges whose step does not reach
+// the end, a parsed comprehension that outlives its frontend, and one whose
+// elements share a vector. Finally interrupts infinite loops with budgets and
+// from another thread, also in native code, multiplexes suspended evaluations
+// on the threads, and checks the memory statistics and limit.
+// Usage: evalThreadsTest [threads] [iterations]
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "codegen/bytecode_gen.h"
+#include "codegen/const_eval.h"
+#include "frontend.h"
+#include "utils/thread_pool.h"
+#include "vm/batch.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+#include "vm/jit.h"
+
+using namespace sscad;
+
+static Location loc{};
+static Expr num(double v) { return std::make_shared<NumberNode>(v, loc); }
+static Expr ident(std::string name) {
+  return std::make_shared<IdentNode>(name, loc);
+}
+static Expr bin(Expr lhs, Expr rhs, BinOp op) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, loc);
+}
+static Expr range(Expr end) {
+  return std::make_shared<RangeNode>(num(0), num(1), end, loc);
+}
+static Expr list(std::vector<std::pair<Expr, bool>> elements) {
+  return std::make_shared<ListExprNode>(elements, loc);
+}
+static Expr comprehension(
+    std::vector<std::pair<std::string, Expr>> vars,
+    std::vector<std::tuple<Expr, Expr, bool>> generators) {
+  std::vector<AssignNode> assigns;
+  for (auto &[name, expr] : vars) assigns.emplace_back(name, expr, loc);
+  return list({{std::make_shared<ListCompNode>(assigns, generators, loc),
+                true}});
+}
+static std::vector<AssignNode> params(std::vector<std::string> names) {
+  std::vector<AssignNode> assigns;
+  for (auto &name : names) assigns.emplace_back(name, nullptr, loc);
+  return assigns;
+}
+
+// run every entry function with and without a thread pool
+static int comprehensions(unsigned int threads) {
+  /**
+   * function sq(x) = x * x;
+   * function evens(n, k) = [for (i = [0:n]) if (i % 2 == 0) sq(i) + k];
+   * function pairs(n) = [for (i = [0:n], j = [0:i]) if (i == j) i else [i, j]];
+   */
+  TranslationUnit unit(0);
+  unit.functions.emplace_back("sq", params({"x"}),
+                              bin(ident("x"), ident("x"), BinOp::MUL), loc);
+  std::vector<AssignNode> sqArgs;
+  sqArgs.emplace_back("", ident("i"), loc);
+  auto sq = std::make_shared<CallNode>(ident("sq"), sqArgs, loc);
+  unit.functions.emplace_back(
+      "evens", params({"n", "k"}),
+      comprehension(
+          {{"i", range(ident("n"))}},
+          {{bin(bin(ident("i"), num(2), BinOp::MOD), num(0), BinOp::EQ),
+            bin(sq, ident("k"), BinOp::ADD), false}}),
+      loc);
+  unit.functions.emplace_back(
+      "pairs", params({"n"}),
+      comprehension({{"i", range(ident("n"))}, {"j", range(ident("i"))}},
+                    {{bin(ident("i"), ident("j"), BinOp::EQ), ident("i"), false},
+                     {num(1), list({{ident("i"), false}, {ident("j"), false}}),
+                      false}}),
+      loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  int entries = functions.size();
+  for (auto [function, args] :
+       std::vector<std::pair<int, std::vector<double>>>{
+           {1, {100000, 0.5}}, {1, {-1, 0}}, {2, {300}}}) {
+    std::vector<unsigned char> entry;
+    for (double arg : args) addDouble(entry, arg);
+    addInst(entry, Instruction::CallI, function);
+    addInst(entry, Instruction::Ret);
+    functions.push_back({entry, 0, false});
+  }
+
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{},
+      gen.constants);
+  Evaluator serial(&std::cout, program);
+  Evaluator parallel(&std::cout, program);
+  parallel.setThreadPool(std::make_shared<ThreadPool>(threads), 1);
+  int failures = 0;
+  for (int i = entries; i < functions.size(); i++) {
+    auto expected = serial.eval(i);
+    auto actual = parallel.eval(i);
+    if (expected.tag != ValueTag::VECTOR || expected != actual) failures++;
+    Evaluator::release(expected);
+    Evaluator::release(actual);
+  }
+  return failures;
+}
+
+// a range whose step does not reach the end is empty, in a comprehension
+// with and without a thread pool, and in an Iter loop
+static int steppedRanges(unsigned int threads) {
+  /**
+   * function stepped(s) = [for (i = [0:s:3]) i];
+   */
+  TranslationUnit unit(0);
+  std::vector<AssignNode> vars;
+  vars.emplace_back(
+      "i", std::make_shared<RangeNode>(num(0), ident("s"), num(3), loc), loc);
+  unit.functions.emplace_back(
+      "stepped", params({"s"}),
+      list({{std::make_shared<ListCompNode>(
+                 vars,
+                 std::vector<std::tuple<Expr, Expr, bool>>{
+                     {num(1), ident("i"), false}},
+                 loc),
+             true}}),
+      loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  // counts the elements of [0:s:3] with Iter
+  std::vector<unsigned char> count;
+  addDouble(count, 0);
+  addDouble(count, 0);
+  addInst(count, Instruction::GetI, 0);
+  addDouble(count, 3);
+  addInst(count, Instruction::MakeRange);
+  addDouble(count, -1);
+  int loop = count.size();
+  addInst(count, Instruction::Iter, 11);
+  addInst(count, Instruction::Pop);
+  addInst(count, Instruction::GetI, 1);
+  addInst(count, Instruction::AddI, 1);
+  addInst(count, Instruction::SetI, 1);
+  addInst(count, Instruction::JumpI, loop - static_cast<int>(count.size()));
+  addInst(count, Instruction::Ret);
+  const int counter = functions.size();
+  functions.push_back({count, 1, false, true});
+  const std::vector<double> steps{1, 2, 0, -1, NAN};
+  const std::vector<size_t> sizes{4, 2, 0, 0, 0};
+  const int entries = functions.size();
+  for (double step : steps)
+    for (int function : {0, counter}) {
+      std::vector<unsigned char> entry;
+      addDouble(entry, step);
+      addInst(entry, Instruction::CallI, function);
+      addInst(entry, Instruction::Ret);
+      functions.push_back({entry, 0, false});
+    }
+
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{},
+      gen.constants);
+  Evaluator serial(&std::cout, program);
+  Evaluator parallel(&std::cout, program);
+  parallel.setThreadPool(std::make_shared<ThreadPool>(threads), 1);
+  int failures = 0;
+  // the loop must end
+  serial.setInstructionBudget(100000);
+  for (size_t i = 0; i < steps.size(); i++) {
+    try {
+      auto expected = serial.eval(entries + i * 2);
+      auto actual = parallel.eval(entries + i * 2);
+      if (expected.tag != ValueTag::VECTOR ||
+          expected.value.vec->values->size() != sizes[i] || expected != actual)
+        failures++;
+      Evaluator::release(expected);
+      Evaluator::release(actual);
+      auto counted = serial.eval(entries + i * 2 + 1);
+      if (counted.tag != ValueTag::NUMBER || counted.value.number != sizes[i])
+        failures++;
+    } catch (const EvalInterrupted &) {
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// the comprehension is parsed into the arena of a frontend, which is gone
+// before the generator and the program
+static int parsedComprehension(unsigned int threads) {
+  auto gen = std::make_unique<BytecodeGen>();
+  {
+    Frontend frontend([](std::string, FileHandle) { return 0; },
+                      [](FileHandle) {
+                        return std::make_shared<std::stringstream>(
+                            "function f(n) = [for (i = [0:n], j = [0:1]) "
+                            "if (i % 3 == 0) i * 2 + j];\n");
+                      });
+    gen->visit(frontend.parse(0));
+  }
+  auto functions = gen->functions;
+  auto constants = gen->constants;
+  gen.reset();
+  int entry = functions.size();
+  std::vector<unsigned char> code;
+  addDouble(code, 1000);
+  addInst(code, Instruction::CallI, 0);
+  addInst(code, Instruction::Ret);
+  functions.push_back({code, 0, false});
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{}, constants);
+  Evaluator evaluator(&std::cout, program);
+  evaluator.setThreadPool(std::make_shared<ThreadPool>(threads), 1);
+  auto result = evaluator.eval(entry);
+  int failures = 0;
+  if (result.tag != ValueTag::VECTOR ||
+      result.value.vec->values->size() != 2 * 334 ||
+      result.value.vec->values->back().value.number != 1999)
+    failures++;
+  Evaluator::release(result);
+  return failures;
+}
+
+// Every vector of the comprehension is shared by two elements, which workers
+// can release at the same time.
+static int sharedElements(unsigned int threads) {
+  // function body(x) = [1];
+  std::vector<unsigned char> body;
+  addInst(body, Instruction::MakeList);
+  addDouble(body, 1);
+  addBinOp(body, BinOp::APPEND);
+  addInst(body, Instruction::Ret);
+  // function wrap(i) = [[i]];
+  std::vector<unsigned char> wrap;
+  addInst(wrap, Instruction::MakeList);
+  addInst(wrap, Instruction::MakeList);
+  addInst(wrap, Instruction::GetI, 0);
+  addBinOp(wrap, BinOp::APPEND);
+  addBinOp(wrap, BinOp::APPEND);
+  addInst(wrap, Instruction::Ret);
+  // function twice(l) = concat(l, l);
+  std::vector<unsigned char> twice;
+  addInst(twice, Instruction::GetI, 0);
+  addInst(twice, Instruction::GetI, 0);
+  addBinOp(twice, BinOp::CONCAT);
+  addInst(twice, Instruction::Ret);
+  // [for (x = twice([for (i = [0:999]) wrap(i)])) body(x)]
+  std::vector<unsigned char> entry;
+  addDouble(entry, 0);
+  addDouble(entry, 1);
+  addDouble(entry, 999);
+  addInst(entry, Instruction::MakeRange);
+  addInst(entry, Instruction::MapI, 1);
+  addInst(entry, Instruction::CallI, 2);
+  addInst(entry, Instruction::MapI, 0);
+  addInst(entry, Instruction::Ret);
+  auto program = std::make_shared<const Program>(
+      std::vector<FunctionEntry>{{body, 1, false, true},
+                                 {wrap, 1, false, true},
+                                 {twice, 1, false},
+                                 {entry, 0, false}},
+      std::vector<ValueTag>{}, std::vector<SValue>{});
+  auto pool = std::make_shared<ThreadPool>(threads);
+  int failures = 0;
+  for (int i = 0; i < 100; i++) {
+    Evaluator evaluator(&std::cout, program);
+    evaluator.setThreadPool(pool, 1);
+    auto result = evaluator.eval(3);
+    // only the result is left, every shared vector is released once
+    auto stats = evaluator.memoryStats();
+    long bytes = sizeof(SVector) + sizeof(std::vector<ValuePair>) +
+                 result.value.vec->values->capacity() * sizeof(ValuePair);
+    if (result.value.vec->values->size() != 2000 ||
+        stats.vectors.count != 1 || stats.bytes != bytes)
+      failures++;
+    Evaluator::release(result);
+  }
+  return failures;
+}
+
+// a parsed customizer parameter swept by a batch, after constant folding
+static int parsedSweep(unsigned int threads, int iterations) {
+  TranslationUnit unit(0);
+  {
+    Frontend frontend([](std::string, FileHandle) { return 0; },
+                      [](FileHandle) {
+                        return std::make_shared<std::stringstream>(
+                            "width = 10;\n"
+                            "depth = 2;\n"
+                            "function area() = width * depth;\n");
+                      });
+    unit = frontend.parse(0);
+  }
+  ConstEvaluator constEval;
+  constEval.setOverridable({"width"});
+  constEval.visit(unit);
+  BytecodeGen gen;
+  gen.visit(unit);
+  int width = gen.globalIndex(0, "width");
+  if (width < 0) return 1;
+  std::vector<ValueTag> tags(gen.globalCount(), ValueTag::UNDEF);
+  std::vector<SValue> values(gen.globalCount());
+  tags[width] = ValueTag::NUMBER;
+  values[width].number = 10;
+  auto functions = gen.functions;
+  int entry = functions.size();
+  std::vector<unsigned char> code;
+  addInst(code, Instruction::CallI, 0);
+  addInst(code, Instruction::Ret);
+  functions.push_back({code, 0, false});
+  auto program =
+      std::make_shared<const Program>(functions, tags, values, gen.constants);
+
+  std::stringstream output;
+  BatchEvaluator batch(&output, program, threads);
+  std::vector<GlobalOverrides> variants;
+  for (int i = 0; i < iterations; i++)
+    variants.push_back({{width, ValuePair(static_cast<double>(i))}});
+  auto results = batch.eval(entry, std::move(variants));
+  int failures = 0;
+  for (int i = 0; i < iterations; i++)
+    if (results[i].tag != ValueTag::NUMBER || results[i].value.number != i * 2)
+      failures++;
+  return failures;
+}
+
+// children that echo their index, the output must stay in order
+static int independentCalls(unsigned int threads) {
+  std::vector<FunctionEntry> functions;
+  std::vector<int> ids;
+  std::stringstream expectedOutput;
+  for (int i = 0; i < 100; i++) {
+    std::vector<unsigned char> child;
+    addDouble(child, i);
+    addInst(child, Instruction::Echo);
+    addInst(child, Instruction::Ret);
+    functions.push_back({child, 0, true});
+    ids.push_back(i);
+    expectedOutput << i << std::endl;
+  }
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{});
+  std::stringstream output;
+  Evaluator evaluator(&output, program);
+  evaluator.setThreadPool(std::make_shared<ThreadPool>(threads));
+  auto results = evaluator.evalAll(ids);
+  int failures = 0;
+  for (int i = 0; i < 100; i++)
+    if (results[i].tag != ValueTag::NUMBER || results[i].value.number != i)
+      failures++;
+  if (output.str() != expectedOutput.str()) failures++;
+  return failures;
+}
+
+// an infinite loop holding a list, interrupted in different ways
+static int interrupts(unsigned int threads) {
+  std::vector<unsigned char> loop;
+  addInst(loop, Instruction::MakeList);
+  addInst(loop, Instruction::JumpI, 0);
+  std::vector<unsigned char> one;
+  addDouble(one, 1);
+  addInst(one, Instruction::Ret);
+  auto program = std::make_shared<const Program>(
+      std::vector<FunctionEntry>{{loop, 0, false, true}, {one, 0, false, true}},
+      std::vector<ValueTag>{}, std::vector<SValue>{});
+  Evaluator evaluator(&std::cout, program);
+  int failures = 0;
+  unsigned long executed = 0;
+  auto expect = [&](StopReason reason, auto run) {
+    try {
+      run();
+      failures++;
+    } catch (const EvalInterrupted &e) {
+      if (e.reason != reason) failures++;
+    }
+    executed = evaluator.instructionsExecuted();
+    // the evaluator is still usable
+    if (evaluator.eval(1).value.number != 1) failures++;
+  };
+
+  evaluator.setInstructionBudget(1000000);
+  expect(StopReason::INSTRUCTION_BUDGET, [&]() { evaluator.eval(0); });
+  if (executed != 1000000) failures++;
+  evaluator.setInstructionBudget(0);
+
+  evaluator.setTimeBudget(std::chrono::milliseconds(20));
+  expect(StopReason::TIME_BUDGET, [&]() { evaluator.eval(0); });
+  evaluator.setThreadPool(std::make_shared<ThreadPool>(threads));
+  expect(StopReason::TIME_BUDGET, [&]() { evaluator.evalAll({0, 1, 0}); });
+  evaluator.setTimeBudget(std::chrono::steady_clock::duration::zero());
+
+  std::thread stopper([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    evaluator.stop();
+  });
+  expect(StopReason::STOPPED, [&]() { evaluator.evalAll({1, 0, 0}); });
+  stopper.join();
+  return failures;
+}
+
+// a tail-recursive loop with the JIT, stopped from another thread and
+// suspended
+static int nativeStop() {
+  // function spin(x) = spin(x + 1);
+  std::vector<unsigned char> spin;
+  addInst(spin, Instruction::GetI, 0);
+  addInst(spin, Instruction::AddI, 1);
+  addInst(spin, Instruction::TailCallI, 0);
+  std::vector<unsigned char> entry;
+  addDouble(entry, 0);
+  addInst(entry, Instruction::CallI, 0);
+  addInst(entry, Instruction::Ret);
+  auto program = std::make_shared<const Program>(
+      std::vector<FunctionEntry>{{spin, 1, false, true}, {entry, 0, false}},
+      std::vector<ValueTag>{}, std::vector<SValue>{});
+  Evaluator evaluator(&std::cout, program);
+  evaluator.setJit(0);
+  std::thread stopper([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    evaluator.stop();
+  });
+  int failures = 0;
+  try {
+    evaluator.eval(1);
+    failures++;
+  } catch (const EvalInterrupted &e) {
+    if (e.reason != StopReason::STOPPED) failures++;
+  }
+  stopper.join();
+  // the native code bailed out when it saw the flag
+  if (Jit::supported() && evaluator.jitStats().bailouts == 0) failures++;
+
+  // the quantum and suspend() preempt the loop with the JIT enabled
+  evaluator.start(1);
+  for (int i = 0; i < 10; i++)
+    if (evaluator.resume(1000).has_value()) failures++;
+  std::thread suspender([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    evaluator.suspend();
+  });
+  if (evaluator.resume().has_value()) failures++;
+  suspender.join();
+  evaluator.cancel();
+  return failures;
+}
+
+// evaluations of a counting loop resumed by whichever thread is free
+static int resumable(unsigned int threads) {
+  std::vector<unsigned char> count;
+  addInst(count, Instruction::MakeList);
+  addDouble(count, 0);
+  // loop: x < 100000
+  addInst(count, Instruction::Dup);
+  addDouble(count, 100000);
+  addNumBinOp(count, BinOp::LT);
+  addInst(count, Instruction::JumpFalseI, 6);
+  addInst(count, Instruction::AddI, 1);
+  addInst(count, Instruction::JumpI, -16);
+  addInst(count, Instruction::Ret);
+  auto program = std::make_shared<const Program>(
+      std::vector<FunctionEntry>{{count, 0, false, true}},
+      std::vector<ValueTag>{}, std::vector<SValue>{});
+
+  Evaluator serial(&std::cout, program);
+  if (serial.eval(0).value.number != 100000) return 1;
+  unsigned long expectedCount = serial.instructionsExecuted();
+
+  std::vector<std::unique_ptr<Evaluator>> evaluators;
+  std::vector<Evaluator *> queue;
+  for (int i = 0; i < 16; i++) {
+    evaluators.push_back(std::make_unique<Evaluator>(&std::cout, program));
+    evaluators.back()->start(0);
+    queue.push_back(evaluators.back().get());
+  }
+  // the stacks of a cancelled evaluation are released
+  evaluators[0]->resume(1000);
+  evaluators[0]->cancel();
+  queue.erase(queue.begin());
+
+  std::mutex mutex;
+  std::atomic<int> failures = 0;
+  std::atomic<int> suspensions = 0;
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < threads; i++) {
+    workers.emplace_back([&]() {
+      while (true) {
+        Evaluator *evaluator;
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          if (queue.empty()) return;
+          evaluator = queue.front();
+          queue.erase(queue.begin());
+        }
+        auto result = evaluator->resume(1000);
+        if (!result) {
+          suspensions++;
+          std::lock_guard<std::mutex> guard(mutex);
+          queue.push_back(evaluator);
+        } else if (result->value.number != 100000 ||
+                   evaluator->instructionsExecuted() != expectedCount) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  if (suspensions < 15 * 100) failures++;
+  for (auto &evaluator : evaluators)
+    if (evaluator->suspended()) failures++;
+  return failures;
+}
+
+// allocation counters of serial and parallel evaluations, and the memory limit
+static int memoryUse(unsigned int threads) {
+  // function lists(n) = [for (i = [0:n]) [i, i]];
+  TranslationUnit unit(0);
+  unit.functions.emplace_back(
+      "lists", params({"n"}),
+      comprehension({{"i", range(ident("n"))}},
+                    {{num(1), list({{ident("i"), false}, {ident("i"), false}}),
+                      false}}),
+      loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  const int lists = functions.size();
+  std::vector<unsigned char> entry;
+  addDouble(entry, 9999);
+  addInst(entry, Instruction::CallI, 0);
+  addInst(entry, Instruction::Ret);
+  // append to a list that is still on the stack
+  std::vector<unsigned char> shared;
+  addInst(shared, Instruction::MakeList);
+  addInst(shared, Instruction::Dup);
+  addDouble(shared, 1);
+  addBinOp(shared, BinOp::APPEND);
+  addInst(shared, Instruction::Ret);
+  // a list growing forever
+  std::vector<unsigned char> grow;
+  addInst(grow, Instruction::MakeList);
+  int start = grow.size();
+  addDouble(grow, 1);
+  addBinOp(grow, BinOp::APPEND);
+  addInst(grow, Instruction::JumpI, start - static_cast<int>(grow.size()));
+  functions.push_back({entry, 0, false});
+  functions.push_back({shared, 0, false});
+  functions.push_back({grow, 0, false});
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{},
+      gen.constants);
+
+  Evaluator serial(&std::cout, program);
+  Evaluator parallel(&std::cout, program);
+  parallel.setThreadPool(std::make_shared<ThreadPool>(threads), 1);
+  int failures = 0;
+  for (auto *evaluator : {&serial, &parallel}) {
+    auto result = evaluator->eval(lists);
+    // only the result and its lists are left, and the comprehension ran in a
+    // nested frame
+    auto stats = evaluator->memoryStats();
+    if (stats.vectors.count != 10001 || stats.strings.peakCount != 0 ||
+        stats.bytes < 20000 * static_cast<long>(sizeof(ValuePair)) ||
+        stats.peakBytes < stats.bytes || stats.peakFrames < 3)
+      failures++;
+    Evaluator::release(result);
+    Evaluator::release(evaluator->eval(lists + 1));
+    if (evaluator->memoryStats().clones != 1) failures++;
+  }
+
+  serial.setMemoryLimit(1 << 20);
+  std::atomic<bool> done = false;
+  long seen = 0;
+  std::thread reader([&]() {
+    while (!done) seen = std::max(seen, serial.memoryStats().bytes);
+  });
+  try {
+    serial.eval(lists + 2);
+    failures++;
+  } catch (const EvalInterrupted &e) {
+    if (e.reason != StopReason::MEMORY_LIMIT) failures++;
+  }
+  done = true;
+  reader.join();
+  auto stats = serial.memoryStats();
+  if (stats.peakBytes <= 1 << 20 || stats.bytes >= 1 << 20 ||
+      seen > stats.peakBytes)
+    failures++;
+  // the workers stop too
+  parallel.setMemoryLimit(1 << 16);
+  try {
+    Evaluator::release(parallel.eval(lists));
+    failures++;
+  } catch (const EvalInterrupted &e) {
+    if (e.reason != StopReason::MEMORY_LIMIT) failures++;
+  }
+  parallel.setMemoryLimit(0);
+  auto result = parallel.eval(lists);
+  if (result.tag != ValueTag::VECTOR) failures++;
+  Evaluator::release(result);
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  unsigned int threads =
+      argc > 1 ? std::stoi(argv[1]) : std::thread::hardware_concurrency();
+  int iterations = argc > 2 ? std::stoi(argv[2]) : 1000;
+  if (threads < 2) threads = 2;
+
+  /**
+   * v = [1, 2, 3];
+   * p = 1;
+   * function bump(x) = (v = concat(v, [x]), len(v));
+   * function entry() = bump(7);
+   * function init() = (d = len(v) * 10, undef);
+   * function variant() = echo(p + d);
+   */
+  std::vector<unsigned char> bump;
+  addInst(bump, Instruction::GetGlobalI, 0);
+  addInst(bump, Instruction::GetI, 0);
+  addBinOp(bump, BinOp::APPEND);
+  addInst(bump, Instruction::SetGlobalI, 0);
+  addInst(bump, Instruction::GetGlobalI, 0);
+  addUnaryOp(bump, BuiltinUnary::LEN);
+  addInst(bump, Instruction::Ret);
+
+  std::vector<unsigned char> entry;
+  addDouble(entry, 7);
+  addInst(entry, Instruction::CallI, 0);
+  addInst(entry, Instruction::Ret);
+
+  std::vector<unsigned char> init;
+  addInst(init, Instruction::ConstMisc, 2);
+  addInst(init, Instruction::GetGlobalI, 0);
+  addUnaryOp(init, BuiltinUnary::LEN);
+  addDouble(init, 10);
+  addBinOp(init, BinOp::MUL);
+  addInst(init, Instruction::SetGlobalI, 2);
+  addInst(init, Instruction::Ret);
+
+  std::vector<unsigned char> variant;
+  addInst(variant, Instruction::GetGlobalI, 1);
+  addInst(variant, Instruction::GetGlobalI, 2);
+  addBinOp(variant, BinOp::ADD);
+  addInst(variant, Instruction::Echo);
+  addInst(variant, Instruction::Ret);
+
+  auto v = std::make_shared<std::vector<ValuePair>>(
+      std::vector<ValuePair>{ValuePair(1.0), ValuePair(2.0), ValuePair(3.0)});
+  auto program = std::make_shared<const Program>(
+      std::vector<FunctionEntry>{{bump, 1, false},
+                                 {entry, 0, false},
+                                 {init, 0, false},
+                                 {variant, 0, false}},
+      std::vector<ValueTag>{ValueTag::VECTOR, ValueTag::NUMBER,
+                            ValueTag::UNDEF},
+      std::vector<SValue>{SValue{.vec = new SVector{v}}, SValue{.number = 1},
+                          SValue{}});
+
+  std::atomic<int> failures = 0;
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < threads; i++) {
+    workers.emplace_back([&]() {
+      // a few calls per evaluator, then start over with a fresh one
+      for (int j = 0; j < iterations; j++) {
+        Evaluator evaluator(&std::cout, program);
+        for (int k = 1; k <= 4; k++) {
+          auto result = evaluator.eval(1);
+          if (result.tag != ValueTag::NUMBER || result.value.number != 3 + k)
+            failures++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  if (v->size() != 3) failures++;
+
+  // overriding p, init only runs once
+  std::stringstream output;
+  BatchEvaluator batch(&output, program, threads);
+  batch.setInit(2);
+  std::vector<GlobalOverrides> variants;
+  std::stringstream expectedOutput;
+  for (int i = 0; i < iterations; i++) {
+    variants.push_back({{1, ValuePair(static_cast<double>(i))}});
+    expectedOutput << i + 30 << std::endl;
+  }
+  auto results = batch.eval(3, std::move(variants));
+  for (int i = 0; i < iterations; i++)
+    if (results[i].tag != ValueTag::NUMBER || results[i].value.number != i + 30)
+      failures++;
+  if (output.str() != expectedOutput.str()) failures++;
+  if (batch.batchStats().initRuns != 1) failures++;
+
+  // overriding v, init runs for every variant
+  variants.clear();
+  for (int i = 0; i < iterations; i++) {
+    auto values = std::make_shared<std::vector<ValuePair>>(i, ValuePair(0.0));
+    variants.push_back(
+        {{0, ValuePair(ValueTag::VECTOR, SValue{.vec = new SVector{values}})}});
+  }
+  results = batch.eval(3, std::move(variants));
+  for (int i = 0; i < iterations; i++)
+    if (results[i].value.number != 1 + i * 10) failures++;
+  if (batch.batchStats().initRuns != 1 + iterations) failures++;
+
+  failures += parsedSweep(threads, iterations);
+  failures += comprehensions(threads);
+  failures += steppedRanges(threads);
+  failures += parsedComprehension(threads);
+  failures += sharedElements(threads);
+  failures += independentCalls(threads);
+  failures += interrupts(threads);
+  failures += nativeStop();
+  failures += resumable(threads);
+  failures += memoryUse(threads);
+  // bump, and entry through it, write globals
+  if (program->writesGlobals != std::vector<bool>{true, true, true, false})
+    failures++;
+
+  std::cout << threads << " threads, " << iterations
+            << " iterations: " << failures << " failures" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parses nested includes, with and without lazy bodies, and checks the
+// location of every declaration and the include statements leading to it.
+// Usage: includeTest
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "frontend.h"
+
+using namespace sscad;
+
+const std::vector<std::string> sources = {
+    "a = 1;\n"
+    "include<1>\n"
+    "b = 2;\n"
+    "include<2>\n",
+
+    "c = 3;\n"
+    "  include<2>\n"
+    "d = 4;\n",
+
+    "e = 5;\n"
+    "function f() = e;\n",
+};
+
+// src:line:column of a position followed by its include chain
+static std::string describe(const TranslationUnit &unit,
+                            const Location::Position &pos) {
+  std::stringstream ss;
+  ss << pos.src << ":" << pos.line << ":" << pos.column;
+  for (auto &site : unit.includeChain(pos))
+    ss << " <- " << site.begin.src << ":" << site.begin.line << ":"
+       << site.begin.column;
+  return ss.str();
+}
+
+static int check(bool lazy) {
+  Frontend frontend(
+      [](std::string name, FileHandle) { return std::stoi(name); },
+      [](FileHandle file) {
+        return std::make_shared<std::stringstream>(sources.at(file));
+      });
+  frontend.setLazyBodies(lazy);
+  auto &unit = frontend.parse(0);
+  if (lazy) frontend.parseBodies();
+
+  std::vector<std::string> expected = {
+      "a 0:1:1",
+      "c 1:1:1 <- 0:2:1",
+      "e 2:1:1 <- 1:2:3 <- 0:2:1",
+      "d 1:3:1 <- 0:2:1",
+      "b 0:3:1",
+      "e 2:1:1 <- 0:4:1",
+  };
+  std::vector<std::string> actual;
+  for (auto &assign : unit.assignments)
+    actual.push_back(assign.ident + " " + describe(unit, assign.loc.begin));
+  // f is declared by both includes of file 2, its body is in the same place
+  expected.push_back("f 2:2:1 <- 1:2:3 <- 0:2:1");
+  expected.push_back("body 2:2:16 <- 1:2:3 <- 0:2:1");
+  expected.push_back("f 2:2:1 <- 0:4:1");
+  expected.push_back("body 2:2:16 <- 0:4:1");
+  for (auto &fun : unit.functions) {
+    actual.push_back(fun.name + " " + describe(unit, fun.loc.begin));
+    actual.push_back("body " + describe(unit, fun.body->loc.begin));
+  }
+
+  int failures = 0;
+  for (size_t i = 0; i < std::max(expected.size(), actual.size()); i++) {
+    std::string e = i < expected.size() ? expected[i] : "nothing";
+    std::string a = i < actual.size() ? actual[i] : "nothing";
+    if (e == a) continue;
+    std::cout << (lazy ? "lazy: " : "") << "expected " << e << ", got " << a
+              << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+int main() {
+  int failures = check(false) + check(true);
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
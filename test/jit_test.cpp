@@ -0,0 +1,217 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include "codegen/bytecode_gen.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+#include "vm/jit.h"
+
+using namespace sscad;
+
+// Differential test: every entry is evaluated by the interpreter and with the
+// JIT compiling on the first call, and the results must be bit identical.
+
+static Location loc{};
+static Expr num(double v) { return std::make_shared<NumberNode>(v, loc); }
+static Expr ident(std::string name) {
+  return std::make_shared<IdentNode>(name, loc);
+}
+static Expr bin(Expr lhs, Expr rhs, BinOp op) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, loc);
+}
+static Expr call(std::string name, std::vector<Expr> args) {
+  std::vector<AssignNode> assigns;
+  for (auto &arg : args) assigns.emplace_back("", arg, loc);
+  return std::make_shared<CallNode>(ident(name), assigns, loc);
+}
+static std::vector<AssignNode> params(std::vector<std::string> names) {
+  std::vector<AssignNode> assigns;
+  for (auto &name : names) assigns.emplace_back(name, nullptr, loc);
+  return assigns;
+}
+
+static bool same(ValuePair a, ValuePair b) {
+  if (a.tag != b.tag) return false;
+  if (a.tag == ValueTag::NUMBER)
+    return memcmp(&a.value.number, &b.value.number, sizeof(double)) == 0;
+  return a == b;
+}
+
+static std::ostream &operator<<(std::ostream &os, ValuePair v) {
+  if (v.tag == ValueTag::NUMBER) return os << v.value.number;
+  if (v.tag == ValueTag::BOOLEAN) return os << (v.value.cond ? "true" : "false");
+  return os << "<tag " << static_cast<int>(v.tag) << ">";
+}
+
+int main() {
+  if (!Jit::supported()) {
+    std::cout << "JIT not supported on this platform" << std::endl;
+    return 0;
+  }
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+
+  /**
+   * function fib(n) = n < 2 ? n : fib(n - 1) + fib(n - 2);
+   * function poly(x, y) = (x * x - y / 3) % 7 + abs(-x) ^ 0.5 + sin(y);
+   * function cmp(x, y) = x < y == (y > x) ? (x <= y ? 1 : 2) : 3;
+   * function sum(n) = n <= 0 ? 0 : n + sum(n - 1);
+   */
+  TranslationUnit unit(0);
+  unit.functions.emplace_back(
+      "fib", params({"n"}),
+      std::make_shared<IfExprNode>(
+          bin(ident("n"), num(2), BinOp::LT), ident("n"),
+          bin(call("fib", {bin(ident("n"), num(1), BinOp::SUB)}),
+              call("fib", {bin(ident("n"), num(2), BinOp::SUB)}), BinOp::ADD),
+          loc),
+      loc);
+  unit.functions.emplace_back(
+      "poly", params({"x", "y"}),
+      bin(bin(bin(bin(bin(ident("x"), ident("x"), BinOp::MUL),
+                      bin(ident("y"), num(3), BinOp::DIV), BinOp::SUB),
+                  num(7), BinOp::MOD),
+              bin(call("abs", {std::make_shared<UnaryOpNode>(
+                                  ident("x"), UnaryOp::NEG, loc)}),
+                  num(0.5), BinOp::EXP),
+              BinOp::ADD),
+          call("sin", {ident("y")}), BinOp::ADD),
+      loc);
+  unit.functions.emplace_back(
+      "cmp", params({"x", "y"}),
+      std::make_shared<IfExprNode>(
+          bin(bin(ident("x"), ident("y"), BinOp::LT),
+              bin(ident("y"), ident("x"), BinOp::GT), BinOp::EQ),
+          std::make_shared<IfExprNode>(bin(ident("x"), ident("y"), BinOp::LE),
+                                       num(1), num(2), loc),
+          num(3), loc),
+      loc);
+  unit.functions.emplace_back(
+      "sum", params({"n"}),
+      std::make_shared<IfExprNode>(
+          bin(ident("n"), num(0), BinOp::LE), num(0),
+          bin(ident("n"), call("sum", {bin(ident("n"), num(1), BinOp::SUB)}),
+              BinOp::ADD),
+          loc),
+      loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+
+  /**
+   * function loop(a, b) = a <= 0 ? b : loop(a - 1, b + 2);
+   * with a tail call, and a function on booleans
+   * function isPositive(x) = let (c = x > 0) (!c != c) && (c || !c);
+   */
+  std::vector<unsigned char> loop;
+  addInst(loop, Instruction::GetI, 0);
+  addInst(loop, Instruction::Dup);
+  addDouble(loop, 0);
+  addBinOp(loop, BinOp::GT);
+  addInst(loop, Instruction::JumpFalseI, 10);
+  addInst(loop, Instruction::AddI, -1);
+  addInst(loop, Instruction::GetI, 1);
+  addInst(loop, Instruction::AddI, 2);
+  addInst(loop, Instruction::TailCallI, functions.size());
+  addInst(loop, Instruction::GetI, 1);
+  addInst(loop, Instruction::Ret);
+  functions.push_back({loop, 2, false});
+
+  std::vector<unsigned char> isPositive;
+  addInst(isPositive, Instruction::GetI, 0);
+  addDouble(isPositive, 0);
+  addBinOp(isPositive, BinOp::GT);
+  addInst(isPositive, Instruction::Dup);
+  addUnaryOp(isPositive, BuiltinUnary::NOT);
+  addInst(isPositive, Instruction::GetI, 1);
+  addBinOp(isPositive, BinOp::NEQ);
+  addInst(isPositive, Instruction::GetI, 1);
+  addInst(isPositive, Instruction::GetI, 1);
+  addUnaryOp(isPositive, BuiltinUnary::NOT);
+  addBinOp(isPositive, BinOp::OR);
+  addBinOp(isPositive, BinOp::AND);
+  addInst(isPositive, Instruction::Ret);
+  functions.push_back({isPositive, 1, false});
+
+  auto id = [&](const std::string &name) {
+    for (int i = 0; i < unit.functions.size(); i++)
+      if (unit.functions[i].name == name) return i;
+    return -1;
+  };
+  struct Case {
+    int function;
+    std::vector<double> args;
+  };
+  std::vector<Case> cases = {
+      {id("fib"), {20}},
+      {id("fib"), {-3.5}},
+      {id("poly"), {3, 4}},
+      {id("poly"), {-2.25, 1e10}},
+      {id("poly"), {nan, 1}},
+      {id("poly"), {0, -0.0}},
+      {id("cmp"), {1, 2}},
+      {id("cmp"), {2, 2}},
+      {id("cmp"), {nan, 2}},
+      {id("cmp"), {-0.0, 0}},
+      {id("sum"), {100}},
+      // deeper than the native recursion limit
+      {id("sum"), {5000}},
+      {static_cast<int>(functions.size()) - 2, {100000, 0}},
+      {static_cast<int>(functions.size()) - 1, {1}},
+      {static_cast<int>(functions.size()) - 1, {nan}},
+  };
+  // one entry function per case
+  const int entries = functions.size();
+  for (auto &c : cases) {
+    std::vector<unsigned char> entry;
+    for (double arg : c.args) addDouble(entry, arg);
+    addInst(entry, Instruction::CallI, c.function);
+    addInst(entry, Instruction::Ret);
+    functions.push_back({entry, 0, false});
+  }
+
+  // none of the functions use the constant pool
+  Evaluator interpreter(&std::cout, functions, {}, {}, {});
+  Evaluator jit(&std::cout, functions, {}, {}, {});
+  jit.setJit(0);
+  int failures = 0;
+  for (int i = 0; i < cases.size(); i++) {
+    // run twice so the second run starts with everything compiled
+    for (int j = 0; j < 2; j++) {
+      auto expected = interpreter.eval(entries + i);
+      auto actual = jit.eval(entries + i);
+      if (!same(expected, actual)) {
+        std::cout << "case " << i << ": expected " << expected << ", got "
+                  << actual << std::endl;
+        failures++;
+      }
+    }
+  }
+  auto stats = jit.jitStats();
+  std::cout << "compiled: " << stats.compiled
+            << ", rejected: " << stats.rejected
+            << ", native calls: " << stats.nativeCalls
+            << ", bailouts: " << stats.bailouts << std::endl;
+  if (stats.nativeCalls == 0) {
+    std::cout << "nothing was executed natively" << std::endl;
+    failures++;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Lexer throughput over a large generated file, mostly ASCII with strings,
+// comments and use statements, plus a few non-ASCII identifiers. The source is
+// read both from a std::stringstream and from a SourceStream. Then compares
+// grapheme counting with the ASCII fast path and with ICU, which must agree on
+// every line and word of the file and on a few tricky strings.
+// Usage: lexerBench [repetitions] [iterations]
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "frontend.h"
+#include "parser.h"
+#include "parsing/scanner.h"
+#include "source_stream.h"
+
+using namespace sscad;
+
+std::string generate(int repetitions) {
+  std::stringstream ss;
+  for (int i = 0; i < repetitions; i++) {
+    ss << "use <lib/shapes_" << i % 16 << ".scad>\n"
+       << "/* block comment describing module part_" << i << ",\n"
+       << " * spanning a few lines like real code does */\n"
+       << "module part_" << i << "(size = [10, 20, 30], center = false) {\n"
+       << "  // translate the part into position\n"
+       << "  translate([" << i << ", " << i * 0.5 << ", 1.25e2])\n"
+       << "    cube(size, center = center);\n"
+       << "  echo(\"part " << i << " has size\", size, \"\\tdone\\n\");\n"
+       << "}\n"
+       << "function area_" << i << "(w, h) = w * h + " << i << ";\n"
+       << "values_" << i << " = [for (j = [0:1:10]) if (j % 2 == 0) j * j];\n";
+    if (i % 64 == 0)
+      ss << "largeur_é" << i << " = \"naïve ünïcödé\";  // accentué\n";
+  }
+  return ss.str();
+}
+
+int main(int argc, char **argv) {
+  int repetitions = argc > 1 ? std::stoi(argv[1]) : 20000;
+  int iterations = argc > 2 ? std::stoi(argv[2]) : 10;
+  const std::string source = generate(repetitions);
+
+  auto resolver = [](std::string, FileHandle) { return 1; };
+  Frontend::FileProvider stringStream = [&](FileHandle) {
+    return std::make_shared<std::stringstream>(source);
+  };
+  Frontend::FileProvider sourceStream = [&](FileHandle) {
+    return std::make_shared<SourceStream>(source.data(), source.size());
+  };
+  std::cout << "input: " << source.size() / 1e6 << " MB" << std::endl;
+
+  for (auto [name, provider] : {std::make_pair("stringstream", stringStream),
+                                std::make_pair("SourceStream", sourceStream)}) {
+    Frontend frontend(resolver, provider, 1);
+    size_t tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      TranslationUnit unit(0);
+      Scanner scanner(frontend, unit, provider(0));
+      while (scanner.getNextToken().kind() != Parser::symbol_kind::S_YYEOF)
+        tokens++;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double megabytes = source.size() * iterations / 1e6;
+
+    std::cout << name << ": " << tokens / iterations << " tokens, "
+              << seconds / iterations * 1000 << " ms/iteration, "
+              << megabytes / seconds << " MB/s, " << tokens / seconds / 1e6
+              << " Mtokens/s" << std::endl;
+  }
+
+  std::vector<std::string> strs = {
+      "", "_", "a1", "1a", "a b", "\r\n", "a\r\nb", "\n\r", "tab\t",
+      "naïve", "e\u0301", "_\u0301x", "ünïcödé", "日本語", "👍🏽", "a👍🏽",
+  };
+  std::istringstream lines(source);
+  for (std::string line; std::getline(lines, line);) {
+    std::istringstream words(line);
+    for (std::string word; words >> word;) strs.push_back(word);
+    strs.push_back(std::move(line));
+  }
+  TranslationUnit unit(0);
+  Frontend frontend(resolver, stringStream, 1);
+  Scanner scanner(frontend, unit, stringStream(0));
+  int failures = 0;
+  for (auto &str : strs) {
+    int fast = scanner.numGraphemes(str.c_str());
+    int icu = scanner.icuGraphemes(str.c_str());
+    if (fast != icu) {
+      std::cout << "\"" << str << "\": " << fast << " graphemes, ICU counts "
+                << icu << std::endl;
+      failures++;
+    }
+  }
+  for (auto [name, count] :
+       {std::make_pair("numGraphemes", &Scanner::numGraphemes),
+        std::make_pair("icuGraphemes", &Scanner::icuGraphemes)}) {
+    long total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+      for (auto &str : strs) total += (scanner.*count)(str.c_str());
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << name << ": " << seconds / iterations * 1000
+              << " ms/iteration, " << strs.size() * iterations / seconds / 1e6
+              << " Mstrings/s (" << total << ")" << std::endl;
+  }
+  return failures;
+}
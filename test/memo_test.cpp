@@ -0,0 +1,149 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Memoizes a recursive function and checks the hits and misses, then checks
+// that replacing a global invalidates the cached results that read it, and
+// that functions producing output are never memoized.
+// Usage: memoTest
+
+#include <iostream>
+#include <sstream>
+
+#include "codegen/bytecode_gen.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+
+using namespace sscad;
+
+static Location loc{};
+static Expr num(double v) { return std::make_shared<NumberNode>(v, loc); }
+static Expr ident(std::string name) {
+  return std::make_shared<IdentNode>(name, loc);
+}
+static Expr bin(Expr lhs, Expr rhs, BinOp op) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, loc);
+}
+static Expr call(std::string name, Expr arg) {
+  std::vector<AssignNode> args;
+  args.emplace_back("", arg, loc);
+  return std::make_shared<CallNode>(ident(name), args, loc);
+}
+static std::vector<AssignNode> params(std::string name) {
+  std::vector<AssignNode> assigns;
+  assigns.emplace_back(name, nullptr, loc);
+  return assigns;
+}
+
+int main() {
+  /**
+   * k = 2;
+   * function fib(n) = n < 2 ? n : fib(n - 1) + fib(n - 2);
+   * function scaled(x) = x * k;
+   */
+  TranslationUnit unit(0);
+  unit.assignments.emplace_back("k", num(2), loc);
+  unit.functions.emplace_back(
+      "fib", params("n"),
+      std::make_shared<IfExprNode>(
+          bin(ident("n"), num(2), BinOp::LT), ident("n"),
+          bin(call("fib", bin(ident("n"), num(1), BinOp::SUB)),
+              call("fib", bin(ident("n"), num(2), BinOp::SUB)), BinOp::ADD),
+          loc),
+      loc);
+  unit.functions.emplace_back("scaled", params("x"),
+                              bin(ident("x"), ident("k"), BinOp::MUL), loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  // entries: fib(30), scaled(3), then loud(7) and quiet(7), which claim to
+  // be pure:
+  // loud(x) = echo(x);
+  // quiet(x) = loud(x);
+  int entries = functions.size();
+  for (auto [function, arg] :
+       std::vector<std::pair<int, double>>{{0, 30},
+                                           {1, 3},
+                                           {entries + 4, 7},
+                                           {entries + 5, 7}}) {
+    std::vector<unsigned char> entry;
+    addDouble(entry, arg);
+    addInst(entry, Instruction::CallI, function);
+    addInst(entry, Instruction::Ret);
+    functions.push_back({entry, 0, false});
+  }
+  std::vector<unsigned char> loud;
+  addInst(loud, Instruction::GetI, 0);
+  addInst(loud, Instruction::Echo);
+  addInst(loud, Instruction::Ret);
+  functions.push_back({loud, 1, false, true});
+  std::vector<unsigned char> quiet;
+  addInst(quiet, Instruction::GetI, 0);
+  addInst(quiet, Instruction::CallI, entries + 4);
+  addInst(quiet, Instruction::Ret);
+  functions.push_back({quiet, 1, false, true});
+
+  int k = gen.globalIndex(0, "k");
+  std::vector<ValueTag> tags(gen.globalCount(), ValueTag::UNDEF);
+  std::vector<SValue> values(gen.globalCount());
+  tags[k] = ValueTag::NUMBER;
+  values[k].number = 2;
+  auto program = std::make_shared<const Program>(functions, tags, values,
+                                                 gen.constants);
+  std::stringstream output;
+  Evaluator evaluator(&output, program);
+  evaluator.setMemoization(1024);
+  int failures = 0;
+  auto expect = [&](std::string what, double expected, double actual) {
+    if (expected == actual) return;
+    std::cout << what << ": expected " << expected << ", got " << actual
+              << std::endl;
+    failures++;
+  };
+
+  // fib(30) goes to the number clone, where fib(n) misses once for each n
+  // < 30. fib(n - 2) is then a hit, except in fib(2) where fib(0) is new.
+  expect("fib(30)", 832040, evaluator.eval(entries).value.number);
+  expect("fib misses", 31, evaluator.memoStats().misses);
+  expect("fib hits", 28, evaluator.memoStats().hits);
+  expect("fib(30) again", 832040, evaluator.eval(entries).value.number);
+  expect("fib misses", 31, evaluator.memoStats().misses);
+  expect("fib hits", 29, evaluator.memoStats().hits);
+
+  evaluator.setMemoization(1024);
+  expect("scaled(3)", 6, evaluator.eval(entries + 1).value.number);
+  expect("scaled(3) again", 6, evaluator.eval(entries + 1).value.number);
+  expect("scaled misses", 1, evaluator.memoStats().misses);
+  expect("scaled hits", 1, evaluator.memoStats().hits);
+  evaluator.setGlobal(k, ValuePair(5.0));
+  expect("scaled(3) with k = 5", 15, evaluator.eval(entries + 1).value.number);
+  expect("scaled misses", 2, evaluator.memoStats().misses);
+  expect("scaled hits", 1, evaluator.memoStats().hits);
+
+  evaluator.setMemoization(1024);
+  expect("loud pure", false, program->functions[entries + 4].pure);
+  expect("quiet pure", false, program->functions[entries + 5].pure);
+  for (int i = 0; i < 2; i++) {
+    expect("loud(7)", 7, evaluator.eval(entries + 2).value.number);
+    expect("quiet(7)", 7, evaluator.eval(entries + 3).value.number);
+  }
+  expect("echo hits", 0, evaluator.memoStats().hits);
+  if (output.str() != "7\n7\n7\n7\n") {
+    std::cout << "missing output: " << output.str() << std::endl;
+    failures++;
+  }
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,138 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parses the same corpus from many threads at once, each thread with its own
+// frontend, and checks that every thread gets the AST of a serial parse.
+// Half of the parses skip the declaration bodies and parse them afterwards,
+// and half of them go through a parse cache shared by all the threads.
+// Usage: parseThreadsTest [threads] [iterations]
+
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "frontend.h"
+#include "parse_cache.h"
+#include "parser.h"
+#include "utils/ast_printer.h"
+
+using namespace sscad;
+using namespace std::string_literals;
+
+const std::vector<std::string> corpus = {
+    "use<1>\n"
+    "use<2>\n"
+    "echo(a + b(123, c = 456));\n"
+    "function foo(x) = x + 1;\n"
+    "foo2(123) { cube(); }\n",
+
+    "use<3>\n"
+    "include<4>\n"
+    "echo(foo + naïve);\n"
+    "module foo2(a, b = 2) { cube(); children(); }\n"
+    "*if (1+1==2) cube();\n"
+    "if (1+1==2) { a(foo() ? x : y + 2); } else { b(); }\n",
+
+    "use<3>\n"
+    "a = 1;\n"
+    "b = 2;\n"
+    "a = b + 1;\n"
+    "function foo(a, b) = a > 0 ? foo(a-1, b+2) : b;\n"
+    "echo(-(1 + 1 == 2 ? 5 : 6));\n",
+
+    "$a = 1.5e3;\n"
+    "function bar() = $a;\n"
+    "module foo() {\n"
+    "  $a = 2;\n"
+    "  echo(bar(), \"naïve \\u00e9\\x41\");\n"
+    "}\n"
+    "v = [for (i = [0:.5:10]) if (i % 2 == 0) let(j = i * i) j];\n"
+    "f = function(x) [x, x ^ 2, len(v)];\n",
+
+    "/* included file, ünïcödé comment */\n"
+    "// another comment\n"
+    "échelle = 2.;\n"
+    "echo(a * b + c * d > 12 && foo ^ bar);\r\n"
+    "echo(a+b+c\n+d, v[1], !true || false, undef);\n",
+};
+
+FileHandle resolve(const std::string &name, FileHandle) {
+  return std::stoi(name);
+}
+
+std::shared_ptr<std::istream> provide(FileHandle file) {
+  return std::make_shared<std::stringstream>(corpus.at(file));
+}
+
+std::string parseAll(unsigned int frontendThreads, bool lazyBodies,
+                     std::shared_ptr<ParseCache> cache = nullptr) {
+  Frontend frontend(resolve, provide, frontendThreads);
+  frontend.setLazyBodies(lazyBodies);
+  frontend.setParseCache(cache);
+  frontend.parse(0);
+  if (lazyBodies) frontend.parseBodies();
+  std::stringstream ss;
+  AstPrinter printer(&ss);
+  for (FileHandle file = 0; file < static_cast<int>(corpus.size()); file++) {
+    auto iter = frontend.units.find(file);
+    if (iter == frontend.units.end()) continue;
+    ss << "unit " << file << std::endl;
+    printer.visit(iter->second);
+  }
+  return ss.str();
+}
+
+int main(int argc, char **argv) {
+  unsigned int threads =
+      argc > 1 ? std::stoi(argv[1]) : std::thread::hardware_concurrency();
+  int iterations = argc > 2 ? std::stoi(argv[2]) : 200;
+  if (threads < 2) threads = 2;
+
+  std::string expected;
+  try {
+    expected = parseAll(1, false);
+  } catch (const Parser::syntax_error &e) {
+    std::cout << e.what() << " at " << e.location << std::endl;
+    return 1;
+  }
+
+  auto cache = std::make_shared<ParseCache>();
+  std::atomic<int> failures = 0;
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < threads; i++) {
+    workers.emplace_back([&, i]() {
+      for (int j = 0; j < iterations; j++) {
+        try {
+          // alternate between serial and parallel frontends
+          auto result = parseAll(j % 2 == 0 ? 1 : 0, j % 4 >= 2,
+                                 j % 8 >= 4 ? cache : nullptr);
+          if (result != expected) failures++;
+        } catch (const std::exception &e) {
+          std::cout << "thread " << i << ": " << e.what() << std::endl;
+          failures++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+
+  std::cout << threads << " threads, " << iterations
+            << " iterations: " << failures << " failures, "
+            << cache->stats().hits << " cache hits" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
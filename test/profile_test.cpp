@@ -0,0 +1,264 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Profiles a small program with and without a thread pool, and resumed in
+// small quanta. The counts must match, every instruction of the generated code
+// must have a source line, and the call stacks must add up to the instructions
+// executed. Then samples the program for a while, every sample must be a stack
+// starting at the entry, checks the backtrace of an error in a generated
+// function, and that the values of a failed evaluation are released. Prints the
+// report and, with an argument, writes the collapsed stacks to that file.
+// Usage: profileTest [stacks file]
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+
+#include "codegen/bytecode_gen.h"
+#include "utils/thread_pool.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+#include "vm/profile.h"
+#include "vm/sampler.h"
+
+using namespace sscad;
+
+static Location at(int line) {
+  Location loc;
+  loc.begin.line = loc.end.line = line;
+  loc.end.column = 40;
+  return loc;
+}
+static Expr num(double v, int line) {
+  return std::make_shared<NumberNode>(v, at(line));
+}
+static Expr ident(std::string name, int line) {
+  return std::make_shared<IdentNode>(name, at(line));
+}
+static Expr bin(Expr lhs, Expr rhs, BinOp op, int line) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, at(line));
+}
+static Expr call(std::string name, Expr arg, int line) {
+  std::vector<AssignNode> args;
+  args.emplace_back("", arg, at(line));
+  return std::make_shared<CallNode>(ident(name, line), args, at(line));
+}
+static std::vector<AssignNode> params(std::string name, int line) {
+  std::vector<AssignNode> assigns;
+  assigns.emplace_back(name, nullptr, at(line));
+  return assigns;
+}
+
+int main(int argc, char **argv) {
+  /**
+   * 1: function sum(n) = n <= 0 ? 0 : n + sum(n - 1);
+   * 2: function sq(x) = x * x;
+   * 3: function squares(n) = [for (i = [0:n]) sq(i)];
+   */
+  TranslationUnit unit(0);
+  unit.functions.emplace_back(
+      "sum", params("n", 1),
+      std::make_shared<IfExprNode>(
+          bin(ident("n", 1), num(0, 1), BinOp::LE, 1), num(0, 1),
+          bin(ident("n", 1),
+              call("sum", bin(ident("n", 1), num(1, 1), BinOp::SUB, 1), 1),
+              BinOp::ADD, 1),
+          at(1)),
+      at(1));
+  unit.functions.emplace_back(
+      "sq", params("x", 2),
+      bin(ident("x", 2), ident("x", 2), BinOp::MUL, 2), at(2));
+  std::vector<AssignNode> vars;
+  vars.emplace_back(
+      "i",
+      std::make_shared<RangeNode>(num(0, 3), num(1, 3), ident("n", 3), at(3)),
+      at(3));
+  auto body = std::make_shared<ListCompNode>(
+      vars,
+      std::vector<std::tuple<Expr, Expr, bool>>{
+          {num(1, 3), call("sq", ident("i", 3), 3), false}},
+      at(3));
+  unit.functions.emplace_back(
+      "squares", params("n", 3),
+      std::make_shared<ListExprNode>(
+          std::vector<std::pair<Expr, bool>>{{body, true}}, at(3)),
+      at(3));
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  const int generated = functions.size();
+  // squares(1000) with sum(100) appended
+  std::vector<unsigned char> entry;
+  addDouble(entry, 1000);
+  addInst(entry, Instruction::CallI, 2);
+  addDouble(entry, 100);
+  addInst(entry, Instruction::CallI, 0);
+  addBinOp(entry, BinOp::APPEND);
+  addInst(entry, Instruction::Ret);
+  functions.push_back({entry, 0, false});
+  // sum(true)
+  std::vector<unsigned char> failing;
+  addInst(failing, Instruction::ConstMisc, 1);
+  addInst(failing, Instruction::CallI, 0);
+  addInst(failing, Instruction::Ret);
+  functions.push_back({failing, 0, false});
+  // echo([]) with another list on the stack
+  std::vector<unsigned char> leaking;
+  addInst(leaking, Instruction::MakeList);
+  addInst(leaking, Instruction::MakeList);
+  addInst(leaking, Instruction::Echo);
+  addInst(leaking, Instruction::Ret);
+  functions.push_back({leaking, 0, false});
+  // sum(1000), which suspends in the recursive calls
+  std::vector<unsigned char> deep;
+  addDouble(deep, 1000);
+  addInst(deep, Instruction::CallI, 0);
+  addInst(deep, Instruction::Ret);
+  functions.push_back({deep, 0, false});
+  auto program = std::make_shared<const Program>(
+      functions, std::vector<ValueTag>{}, std::vector<SValue>{},
+      gen.constants);
+
+  Evaluator serial(&std::cout, program);
+  Evaluator parallel(&std::cout, program);
+  parallel.setThreadPool(std::make_shared<ThreadPool>(4), 1);
+  int failures = 0;
+  for (auto *evaluator : {&serial, &parallel}) {
+    evaluator->setProfiling(true);
+    auto result = evaluator->eval(generated);
+    if (result.tag != ValueTag::VECTOR) failures++;
+    Evaluator::release(result);
+  }
+
+  const Profile &profile = *serial.profile();
+  const Profile &other = *parallel.profile();
+  unsigned long total = 0;
+  for (size_t i = 0; i < profile.opcodes.size(); i++) {
+    total += profile.opcodes[i].count;
+    if (profile.opcodes[i].count != other.opcodes[i].count) failures++;
+  }
+  if (total != serial.instructionsExecuted()) failures++;
+
+  // suspending does not count the instruction that runs again on resume
+  Evaluator whole(&std::cout, program);
+  Evaluator resumed(&std::cout, program);
+  whole.setProfiling(true);
+  resumed.setProfiling(true);
+  Evaluator::release(whole.eval(generated + 3));
+  resumed.start(generated + 3);
+  std::optional<ValuePair> done;
+  int quanta = 0;
+  while (!(done = resumed.resume(100))) quanta++;
+  Evaluator::release(*done);
+  if (quanta < 10) failures++;
+  for (size_t i = 0; i < profile.opcodes.size(); i++)
+    if (whole.profile()->opcodes[i].count !=
+        resumed.profile()->opcodes[i].count)
+      failures++;
+  if (whole.profile()->pcCounts != resumed.profile()->pcCounts) failures++;
+
+  auto stats = profile.functionStats();
+  auto otherStats = other.functionStats();
+  for (size_t f = 0; f < stats.size(); f++) {
+    if (stats[f].calls != otherStats[f].calls ||
+        stats[f].exclusive != otherStats[f].exclusive ||
+        stats[f].inclusive != otherStats[f].inclusive)
+      failures++;
+    if (stats[f].inclusive < stats[f].exclusive) failures++;
+  }
+  if (stats[generated].inclusive != total || stats[generated].calls != 1)
+    failures++;
+  // sum(100) calls sum 101 times, in the generic function and its clone
+  unsigned long sumCalls = 0;
+  for (int f = 0; f < generated; f++)
+    if (functions[f].lines.front().second.begin.line == 1)
+      sumCalls += stats[f].calls;
+  if (sumCalls != 101) failures++;
+
+  // the generated instructions are all on the three lines
+  for (int f = 0; f < generated; f++)
+    for (size_t pc = 0; pc < profile.pcCounts[f].size(); pc++) {
+      if (profile.pcCounts[f][pc] == 0) continue;
+      const Location *loc = functions[f].location(pc);
+      if (loc == nullptr || loc->begin.line < 1 || loc->begin.line > 3)
+        failures++;
+    }
+
+  std::stringstream stacks;
+  profile.collapsedStacks(stacks);
+  unsigned long stackTotal = 0;
+  std::string line;
+  while (std::getline(stacks, line))
+    stackTotal += std::stoul(line.substr(line.rfind(' ') + 1));
+  if (stackTotal != total) failures++;
+  if (argc > 1) std::ofstream(argv[1]) << stacks.str();
+
+  profile.report(std::cout);
+
+  try {
+    Evaluator::release(serial.eval(generated + 1));
+    failures++;
+  } catch (const EvalError &e) {
+    std::cout << e.what() << std::endl;
+    if (e.backtrace.size() != 2 || e.backtrace[0].function != 0 ||
+        e.backtrace[1].function != generated + 1 ||
+        program->describe(0, e.backtrace[0].pc).find("sum (0:1:") != 0)
+      failures++;
+  }
+  // the values of a failed evaluation are released
+  for (int i = 0; i < 3; i++) {
+    try {
+      Evaluator::release(serial.eval(generated + 2));
+      failures++;
+    } catch (const EvalError &e) {
+      if (serial.memoryStats().vectors.count != 0) failures++;
+    }
+  }
+
+  // disabling profiling releases the profiles
+  auto sampler = std::make_shared<Sampler>(program,
+                                           std::chrono::microseconds(100));
+  std::vector<Sampler::Sample> samples;
+  for (auto *evaluator : {&serial, &parallel}) {
+    evaluator->setProfiling(false);
+    evaluator->setSampler(sampler);
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+    while (std::chrono::steady_clock::now() < end) {
+      Evaluator::release(evaluator->eval(generated));
+      sampler->drain(samples);
+    }
+    evaluator->setSampler(nullptr);
+  }
+  if (samples.empty()) failures++;
+  for (const auto &sample : samples) {
+    if (sample.depth < 1 || sample.truncated ||
+        sample.functions[sample.depth - 1] != generated)
+      failures++;
+    for (int i = 0; i < sample.depth; i++)
+      if (sample.functions[i] < 0 || sample.functions[i] > generated)
+        failures++;
+  }
+  std::stringstream sampled;
+  sampler->collapsedStacks(samples, sampled);
+  if (sampled.str().find("f" + std::to_string(generated)) != 0) failures++;
+
+  std::cout << samples.size() << " samples, " << sampler->dropped()
+            << " dropped" << std::endl;
+  std::cout << failures << " failures" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
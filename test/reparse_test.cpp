@@ -0,0 +1,175 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Edits a file and reparses it, with and without lazy bodies, and checks the
+// declarations reported as changed, moved and removed, the new uses, and that
+// nodes of the old unit outlive it.
+// Usage: reparseTest
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "frontend.h"
+
+using namespace sscad;
+
+static std::string describe(const UnitChanges &changes) {
+  std::stringstream ss;
+  auto list = [&](const char *name, const auto &items) {
+    ss << name << ":";
+    for (const auto &item : items) ss << " " << item;
+    ss << "\n";
+  };
+  list("functions", changes.functions);
+  list("modules", changes.modules);
+  list("assignments", changes.assignments);
+  list("moved functions", changes.movedFunctions);
+  list("moved modules", changes.movedModules);
+  list("moved assignments", changes.movedAssignments);
+  list("removed functions", changes.removedFunctions);
+  list("removed modules", changes.removedModules);
+  list("removed assignments", changes.removedAssignments);
+  list("new uses", changes.newUses);
+  ss << "module calls: " << changes.moduleCalls << "\n";
+  return ss.str();
+}
+
+static int check(bool lazy) {
+  std::vector<std::string> sources = {
+      "use<1>\n"
+      "a = 1;\n"
+      "function f(x) = x + 1;\n"
+      "function g(x) = x * 2;\n"
+      "module m() { cube(); }\n"
+      "c = 3;\n"
+      "d = 4;\n"
+      "b = a;\n"
+      "cube();\n",
+
+      "function u() = 1;\n",
+
+      "function v() = 2;\n",
+  };
+  Frontend frontend(
+      [](std::string name, FileHandle) { return std::stoi(name); },
+      [&](FileHandle file) {
+        return std::make_shared<std::stringstream>(sources.at(file));
+      });
+  frontend.setLazyBodies(lazy);
+  frontend.setIncremental(true);
+  frontend.parse(0);
+  // AST handles stay valid after the unit is replaced
+  auto call = frontend.units.at(0).moduleCalls.at(0);
+
+  int failures = 0;
+  auto expect = [&](const char *edit, const UnitChanges &changes,
+                    const std::string &expected) {
+    std::string actual = describe(changes);
+    if (actual == expected) return;
+    std::cout << (lazy ? "lazy " : "") << edit << ": expected\n"
+              << expected << "got\n"
+              << actual;
+    failures++;
+  };
+
+  // a use inserted below a, so everything after it moves, g is edited, h and
+  // k are added and m and d are removed
+  sources[0] =
+      "use<1>\n"
+      "a = 1;\n"
+      "use<2>\n"
+      "function f(x) = x + 1;\n"
+      "function g(x) = x * 3;\n"
+      "function h() = 0;\n"
+      "function k() = 0;\n"
+      "c = 3;\n"
+      "b = a;\n"
+      "cube();\n";
+  expect("insert", frontend.reparse(0),
+         "functions: 1 2 3\n"
+         "modules:\n"
+         "assignments:\n"
+         "moved functions: 0\n"
+         "moved modules:\n"
+         "moved assignments: 1 2\n"
+         "removed functions:\n"
+         "removed modules: m\n"
+         "removed assignments: d\n"
+         "new uses: 2\n"
+         "module calls: 1\n");
+  if (frontend.units.find(2) == frontend.units.end()) {
+    std::cout << (lazy ? "lazy " : "") << "new use not parsed" << std::endl;
+    failures++;
+  }
+  if (call->name != "cube" || call->loc.begin.line != 9) {
+    std::cout << (lazy ? "lazy " : "") << "old module call changed"
+              << std::endl;
+    failures++;
+  }
+  call.reset();
+  int line = frontend.units.at(0).functions.at(0).loc.begin.line;
+  if (line != 4) {
+    std::cout << (lazy ? "lazy " : "") << "f is on line " << line
+              << ", expected 4" << std::endl;
+    failures++;
+  }
+
+  expect("same", frontend.reparse(0),
+         "functions:\n"
+         "modules:\n"
+         "assignments:\n"
+         "moved functions:\n"
+         "moved modules:\n"
+         "moved assignments:\n"
+         "removed functions:\n"
+         "removed modules:\n"
+         "removed assignments:\n"
+         "new uses:\n"
+         "module calls: 0\n");
+
+  // whitespace before the name of f only moves it and its body
+  sources[0] =
+      "use<1>\n"
+      "a = 1;\n"
+      "use<2>\n"
+      "function  f(x) = x + 1;\n"
+      "function g(x) = x * 3;\n"
+      "function h() = 0;\n"
+      "function k() = 0;\n"
+      "c = 3;\n"
+      "b = a;\n"
+      "cube();\n";
+  expect("whitespace", frontend.reparse(0),
+         "functions:\n"
+         "modules:\n"
+         "assignments:\n"
+         "moved functions: 0\n"
+         "moved modules:\n"
+         "moved assignments:\n"
+         "removed functions:\n"
+         "removed modules:\n"
+         "removed assignments:\n"
+         "new uses:\n"
+         "module calls: 0\n");
+  return failures;
+}
+
+int main() {
+  int failures = check(false) + check(true);
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,111 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Reads a mapped file, an empty file and other streams through SourceStream,
+// and checks the contents, seeking, and the units parsed from them. The files
+// are created in the working directory and removed afterwards.
+// Usage: sourceStreamTest
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "frontend.h"
+#include "source_stream.h"
+
+using namespace sscad;
+
+static int failures = 0;
+
+static void expect(bool cond, const std::string &what) {
+  if (cond) return;
+  std::cout << what << std::endl;
+  failures++;
+}
+
+static std::string writeFile(const std::string &path,
+                             const std::string &contents) {
+  std::ofstream file(path, std::ios::binary);
+  file << contents;
+  return path;
+}
+
+// the number of assignments of a unit parsed from the stream
+static size_t parseAssignments(std::shared_ptr<std::istream> stream) {
+  Frontend frontend([](std::string, FileHandle) { return 1; },
+                    [&](FileHandle) { return stream; });
+  return frontend.parse(0).assignments.size();
+}
+
+int main() {
+  // larger than a page, with non-ASCII text and no trailing newline
+  std::stringstream ss;
+  for (int i = 0; i < 2000; i++)
+    ss << "x" << i << " = \"naïve " << i << "\";\n";
+  ss << "last = 1;";
+  const std::string contents = ss.str();
+
+  auto mapped =
+      SourceStream::mapFile(writeFile("source_stream_test.scad", contents));
+  expect(mapped->size() == contents.size() &&
+             std::string(mapped->data(), mapped->size()) == contents,
+         "mapped file contents differ");
+  std::string line;
+  std::getline(*mapped, line);
+  expect(line == "x0 = \"naïve 0\";", "first line of the mapped file");
+  mapped->seekg(-9, std::ios::end);
+  std::getline(*mapped, line);
+  expect(line == "last = 1;" && mapped->eof(), "seek from the end");
+  mapped->clear();
+  mapped->seekg(0);
+  expect(mapped->tellg() == 0, "seek to the start");
+  expect(parseAssignments(mapped) == 2001, "units parsed from a mapped file");
+  std::remove("source_stream_test.scad");
+
+  auto empty = SourceStream::mapFile(writeFile("source_stream_empty.scad", ""));
+  expect(empty->size() == 0, "empty file has contents");
+  expect(empty->get() == std::char_traits<char>::eof() && empty->eof(),
+         "reading an empty file");
+  empty->clear();
+  expect(parseAssignments(empty) == 0, "units parsed from an empty file");
+  std::remove("source_stream_empty.scad");
+
+  bool threw = false;
+  try {
+    SourceStream::mapFile("source_stream_missing.scad");
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  expect(threw, "missing file did not throw");
+
+  // read takes the rest of other streams and returns SourceStreams as is
+  auto partial = std::make_shared<std::stringstream>(contents);
+  std::getline(*partial, line);
+  auto rest = SourceStream::read(partial);
+  expect(std::string(rest->data(), rest->size()) ==
+             contents.substr(contents.find('\n') + 1),
+         "read does not start at the current position");
+  expect(SourceStream::read(rest) == rest, "read copied a SourceStream");
+  auto none = SourceStream::read(std::make_shared<std::stringstream>());
+  expect(none->size() == 0, "read of an empty stream has contents");
+  expect(parseAssignments(SourceStream::read(
+             std::make_shared<std::stringstream>(contents))) == 2001,
+         "units parsed from a copied stream");
+
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,175 @@
+/**
+ * Copyright 2023 The sscad Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Calls functions with number arguments and checks with the profiler that the
+// number specialized clones run, entered from the SpecializeI guard of the
+// generic versions. The results must be identical to a program where the
+// guards are removed, which only runs the generic versions.
+// Usage: specializeTest
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "codegen/bytecode_gen.h"
+#include "vm/evaluator.h"
+#include "vm/instructions.h"
+#include "vm/profile.h"
+
+using namespace sscad;
+
+static Location loc{};
+static Expr num(double v) { return std::make_shared<NumberNode>(v, loc); }
+static Expr ident(std::string name) {
+  return std::make_shared<IdentNode>(name, loc);
+}
+static Expr bin(Expr lhs, Expr rhs, BinOp op) {
+  return std::make_shared<BinaryOpNode>(lhs, rhs, op, loc);
+}
+static Expr call(std::string name, std::vector<Expr> args) {
+  std::vector<AssignNode> assigns;
+  for (auto &arg : args) assigns.emplace_back("", arg, loc);
+  return std::make_shared<CallNode>(ident(name), assigns, loc);
+}
+static std::vector<AssignNode> params(std::vector<std::string> names) {
+  std::vector<AssignNode> assigns;
+  for (auto &name : names) assigns.emplace_back(name, nullptr, loc);
+  return assigns;
+}
+
+static const std::vector<std::pair<int, std::vector<double>>> calls = {
+    {0, {20}}, {1, {3.5, -2}}, {1, {0, 0}}, {2, {2, 7}}, {2, {9, 4}}};
+
+// entries at the end of the program call the functions, see `calls`
+static std::vector<FunctionEntry> compile(bool guards) {
+  /**
+   * function fib(n) = n < 2 ? n : fib(n - 1) + fib(n - 2);
+   * function poly(x, y) = x * x - 3 * y / x + x ^ y % 5;
+   * function mixed(x, y) = x < y ? sqrt(x) - sin(y) : -abs(y - x);
+   */
+  TranslationUnit unit(0);
+  unit.functions.emplace_back(
+      "fib", params({"n"}),
+      std::make_shared<IfExprNode>(
+          bin(ident("n"), num(2), BinOp::LT), ident("n"),
+          bin(call("fib", {bin(ident("n"), num(1), BinOp::SUB)}),
+              call("fib", {bin(ident("n"), num(2), BinOp::SUB)}), BinOp::ADD),
+          loc),
+      loc);
+  unit.functions.emplace_back(
+      "poly", params({"x", "y"}),
+      bin(bin(bin(ident("x"), ident("x"), BinOp::MUL),
+              bin(bin(num(3), ident("y"), BinOp::MUL), ident("x"),
+                  BinOp::DIV),
+              BinOp::SUB),
+          bin(bin(ident("x"), ident("y"), BinOp::EXP), num(5), BinOp::MOD),
+          BinOp::ADD),
+      loc);
+  unit.functions.emplace_back(
+      "mixed", params({"x", "y"}),
+      std::make_shared<IfExprNode>(
+          bin(ident("x"), ident("y"), BinOp::LT),
+          bin(call("sqrt", {ident("x")}), call("sin", {ident("y")}),
+              BinOp::SUB),
+          std::make_shared<UnaryOpNode>(
+              call("abs", {bin(ident("y"), ident("x"), BinOp::SUB)}),
+              UnaryOp::NEG, loc),
+          loc),
+      loc);
+  BytecodeGen gen;
+  gen.visit(unit);
+  auto functions = gen.functions;
+  if (!guards) {
+    // jumps are relative, so the guard can be cut off
+    for (int i = 0; i < 3; i++) {
+      auto &code = functions[i].instructions;
+      if (static_cast<Instruction>(code[0]) != Instruction::SpecializeI)
+        return {};
+      code.erase(code.begin(), code.begin() + (code[1] == 0x80 ? 6 : 2));
+      functions[i].lines.clear();
+    }
+  }
+  for (auto &[function, args] : calls) {
+    std::vector<unsigned char> entry;
+    for (double arg : args) addDouble(entry, arg);
+    addInst(entry, Instruction::CallI, function);
+    addInst(entry, Instruction::Ret);
+    functions.push_back({entry, 0, false});
+  }
+  return functions;
+}
+
+int main() {
+  auto specialized = compile(true);
+  auto generic = compile(false);
+  if (specialized.empty() || generic.empty()) {
+    std::cout << "missing SpecializeI guard" << std::endl;
+    return 1;
+  }
+  auto specializedProgram = std::make_shared<const Program>(
+      specialized, std::vector<ValueTag>{}, std::vector<SValue>{});
+  auto genericProgram = std::make_shared<const Program>(
+      generic, std::vector<ValueTag>{}, std::vector<SValue>{});
+  Evaluator specializedEval(&std::cout, specializedProgram);
+  Evaluator genericEval(&std::cout, genericProgram);
+  specializedEval.setProfiling(true);
+  genericEval.setProfiling(true);
+  int failures = 0;
+  const int entries = specialized.size() - calls.size();
+  for (int i = 0; i < calls.size(); i++) {
+    auto expected = genericEval.eval(entries + i);
+    auto actual = specializedEval.eval(entries + i);
+    // bit identical, including the sign of zero and NaN
+    if (expected.tag != ValueTag::NUMBER || actual.tag != ValueTag::NUMBER ||
+        memcmp(&expected.value.number, &actual.value.number,
+               sizeof(double)) != 0) {
+      std::cout << "call " << i << ": expected " << expected.value.number
+                << ", got " << actual.value.number << std::endl;
+      failures++;
+    }
+  }
+
+  // the generic versions only run their guard, everything else runs in the
+  // clones
+  const Profile &profile = *specializedEval.profile();
+  for (int i = 0; i < 3; i++) {
+    auto &counts = profile.pcCounts[i];
+    unsigned long guards = counts.empty() ? 0 : counts[0];
+    unsigned long total = 0;
+    for (auto count : counts) total += count;
+    if (guards == 0 || total != guards) {
+      std::cout << specialized[i].name << ": generic version ran" << std::endl;
+      failures++;
+    }
+  }
+  auto count = [](const Profile &profile, Instruction inst) {
+    return profile.opcodes[static_cast<int>(inst)].count;
+  };
+  if (count(profile, Instruction::NumBinaryOp) == 0 ||
+      count(profile, Instruction::NumUnaryOp) == 0 ||
+      count(profile, Instruction::BinaryOp) != 0) {
+    std::cout << "clones use generic operations" << std::endl;
+    failures++;
+  }
+  const Profile &genericProfile = *genericEval.profile();
+  if (count(genericProfile, Instruction::SpecializeI) != 0 ||
+      count(genericProfile, Instruction::NumBinaryOp) != 0) {
+    std::cout << "generic program ran a clone" << std::endl;
+    failures++;
+  }
+  if (failures == 0) std::cout << "all passed" << std::endl;
+  return failures;
+}